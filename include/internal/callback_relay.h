@@ -0,0 +1,166 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file callback_relay.h
+ *
+ * @brief Hand nyx status callbacks over to the consumer's main loop.
+ *
+ * The modules notice status changes on their own threads (the fake
+ * directory watcher, the simulator). Rather than calling the consumer from
+ * there, callback_relay_post() queues an idle source on the GMainContext
+ * that was thread default when the callback was registered, and the
+ * callback runs when that context is next iterated. A consumer running a
+ * GMainLoop therefore always gets its callbacks on the loop's thread.
+ *
+ * Posts that arrive while one is still queued are folded into it; the
+ * callback is a "status changed, query it" signal, not a per-change event.
+ * All fields are guarded by lock, so registration, posting and
+ * callback_relay_clear() may happen on any thread. Modules close from the
+ * thread iterating that context, so no callback is in flight by then.
+ */
+
+#ifndef __NYX__MOD__QEMUX__CALLBACK_RELAY_H__
+#define __NYX__MOD__QEMUX__CALLBACK_RELAY_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib.h>
+#include <nyx/nyx_module.h>
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	nyx_device_callback_function_t func;
+	void *context;
+	GMainContext *main_context; /**< where func runs, see the file comment */
+	GSource *pending;           /**< queued delivery, at most one */
+	nyx_device_handle_t device;
+} callback_relay_t;
+
+#define CALLBACK_RELAY_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, NULL, NULL }
+
+static inline void
+callback_relay_cancel_locked(callback_relay_t *r)
+{
+	if (r->pending)
+	{
+		g_source_destroy(r->pending);
+		g_source_unref(r->pending);
+		r->pending = NULL;
+	}
+}
+
+static gboolean
+callback_relay_dispatch(gpointer data)
+{
+	callback_relay_t *r = (callback_relay_t *) data;
+	nyx_device_callback_function_t func;
+	nyx_device_handle_t device;
+	void *context;
+
+	pthread_mutex_lock(&r->lock);
+	func = r->func;
+	context = r->context;
+	device = r->device;
+
+	/* The context keeps the source alive until this returns */
+	if (r->pending && r->pending == g_main_current_source())
+	{
+		g_source_unref(r->pending);
+		r->pending = NULL;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	if (func)
+	{
+		func(device, NYX_CALLBACK_STATUS_DONE, context);
+	}
+
+	return FALSE;
+}
+
+/* Register func, to run in the calling thread's default main context */
+static inline void
+callback_relay_set(callback_relay_t *r, nyx_device_callback_function_t func,
+                   void *context)
+{
+	GMainContext *main_context = g_main_context_ref_thread_default();
+	GMainContext *old;
+
+	pthread_mutex_lock(&r->lock);
+	callback_relay_cancel_locked(r);
+	old = r->main_context;
+	r->func = func;
+	r->context = context;
+	r->main_context = main_context;
+	pthread_mutex_unlock(&r->lock);
+
+	if (old)
+	{
+		g_main_context_unref(old);
+	}
+}
+
+/* Drop the callback and anything still queued for it, e.g. on close */
+static inline void
+callback_relay_clear(callback_relay_t *r)
+{
+	GMainContext *old;
+
+	pthread_mutex_lock(&r->lock);
+	callback_relay_cancel_locked(r);
+	old = r->main_context;
+	r->func = NULL;
+	r->context = NULL;
+	r->main_context = NULL;
+	pthread_mutex_unlock(&r->lock);
+
+	if (old)
+	{
+		g_main_context_unref(old);
+	}
+}
+
+/**
+ * @brief From any thread, have the callback run once more in its context.
+ *
+ * @retval true if a delivery was queued, false if there is no callback or
+ *         one was already queued
+ */
+static inline bool
+callback_relay_post(callback_relay_t *r, nyx_device_handle_t device)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&r->lock);
+
+	if (r->func && !r->pending)
+	{
+		r->device = device;
+		r->pending = g_idle_source_new();
+		g_source_set_callback(r->pending, callback_relay_dispatch, r, NULL);
+		g_source_attach(r->pending, r->main_context);
+		queued = true;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	return queued;
+}
+
+#endif // __NYX__MOD__QEMUX__CALLBACK_RELAY_H__
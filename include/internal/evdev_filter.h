@@ -0,0 +1,153 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file evdev_filter.h
+ *
+ * @brief Kernel side filtering of evdev streams shared by the input modules.
+ *
+ * EVIOCSMASK (Linux 4.4+) stops the kernel from queueing events a reader
+ * ignores, and EVIOCGRAB keeps other readers of the same device from being
+ * woken. Both are best effort: on older kernels the modules still filter
+ * in userspace.
+ */
+
+#ifndef __NYX__MOD__QEMUX__EVDEV_FILTER_H__
+#define __NYX__MOD__QEMUX__EVDEV_FILTER_H__
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+/* Set to 1 to open the input devices for exclusive use */
+#define EVDEV_GRAB_ENV "NYX_INPUT_GRAB"
+/* Set to "monotonic" to have event timestamps taken from CLOCK_MONOTONIC */
+#define EVDEV_CLOCK_ENV "NYX_INPUT_CLOCK"
+
+#define BITS_PER_LONG       (sizeof(long) * 8)
+#define NBITS(x)            ((((x) - 1) / BITS_PER_LONG) + 1)
+#define TEST_BIT(bit, array) \
+	((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+#define SET_BIT(bit, array) \
+	(array[(bit) / BITS_PER_LONG] |= 1UL << ((bit) % BITS_PER_LONG))
+
+/**
+ * @brief Only deliver the listed codes of one event type.
+ *
+ * Passing EV_SYN as type selects the event type mask itself, in which
+ * case codes lists event types. EV_SYN must stay in that list: the kernel
+ * only wakes readers on SYN_REPORT.
+ *
+ * @retval 0 on success, -1 with errno set otherwise
+ */
+static inline int
+evdev_set_mask(int fd, unsigned int type, const unsigned int *codes,
+               size_t count, unsigned int code_max)
+{
+#ifdef EVIOCSMASK
+	unsigned long bits[NBITS(KEY_CNT)];
+	struct input_mask mask;
+	size_t i;
+
+	if (code_max > KEY_CNT)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(bits, 0, sizeof(bits));
+
+	for (i = 0; i < count; i++)
+	{
+		if (codes[i] < code_max)
+		{
+			SET_BIT(codes[i], bits);
+		}
+	}
+
+	mask.type = type;
+	mask.codes_size = NBITS(code_max) * sizeof(long);
+	mask.codes_ptr = (uintptr_t) bits;
+
+	return ioctl(fd, EVIOCSMASK, &mask);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static inline bool
+evdev_grab_requested(void)
+{
+	const char *grab = getenv(EVDEV_GRAB_ENV);
+
+	return grab && 0 == strcmp(grab, "1");
+}
+
+/**
+ * @brief Take exclusive ownership of the device, released again on close.
+ *
+ * @retval 0 on success, -1 with errno set otherwise
+ */
+static inline int
+evdev_grab(int fd)
+{
+	return ioctl(fd, EVIOCGRAB, (void *) 1);
+}
+
+/**
+ * @brief Switch the clock the kernel stamps events with, if one was asked
+ * for through EVDEV_CLOCK_ENV.
+ *
+ * Without it events carry CLOCK_REALTIME, which jumps when the wall clock
+ * is set.
+ *
+ * @retval 0 on success or if nothing was requested, -1 with errno set otherwise
+ */
+static inline int
+evdev_set_clock(int fd)
+{
+	const char *clock = getenv(EVDEV_CLOCK_ENV);
+	int clockId;
+
+	if (NULL == clock)
+	{
+		return 0;
+	}
+
+	if (0 == strcmp(clock, "monotonic"))
+	{
+		clockId = CLOCK_MONOTONIC;
+	}
+	else if (0 == strcmp(clock, "realtime"))
+	{
+		clockId = CLOCK_REALTIME;
+	}
+	else
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ioctl(fd, EVIOCSCLOCKID, &clockId);
+}
+
+#endif // __NYX__MOD__QEMUX__EVDEV_FILTER_H__
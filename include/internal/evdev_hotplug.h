@@ -0,0 +1,398 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file evdev_hotplug.h
+ *
+ * @brief Hot-plug aware set of evdev nodes behind a single epoll fd.
+ *
+ * The input modules hand the epoll fd out as their event source. It
+ * becomes readable when any attached node has input or when the inotify
+ * watch on the input directory fires, so devices that show up late (or
+ * re-enumerate) are picked up without reopening the module.
+ */
+
+#ifndef __NYX__MOD__QEMUX__EVDEV_HOTPLUG_H__
+#define __NYX__MOD__QEMUX__EVDEV_HOTPLUG_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "perf_counters.h"
+
+#define EVDEV_HOTPLUG_DIR           "/dev/input"
+#define EVDEV_HOTPLUG_MAX_NODES     8
+
+/*
+ * Called with every newly opened node. preferred is set for the udev
+ * symlink the module was configured with. Return <0 to reject the node.
+ */
+typedef int (*evdev_attach_fn)(void *ctx, int fd, bool preferred);
+/* Called before a node that went away is closed */
+typedef void (*evdev_detach_fn)(void *ctx, int fd);
+
+typedef struct
+{
+	int fd;
+	dev_t rdev;                 /**< device number, symlinks resolve to it too */
+	char name[NAME_MAX + 1];    /**< directory entry the node was opened as */
+} evdev_node_t;
+
+typedef struct
+{
+	int epoll_fd;
+	int inotify_fd;             /**< -1 if hot-plug detection is unavailable */
+	const char *dir;
+	const char *preferred;      /**< basename of the configured symlink, or NULL */
+	unsigned int max_nodes;
+	evdev_attach_fn attach;
+	evdev_detach_fn detach;
+	void *ctx;
+	perf_counters_t *perf;      /**< optional, counts the syscalls of reads */
+	unsigned int node_count;
+	evdev_node_t nodes[EVDEV_HOTPLUG_MAX_NODES];
+} evdev_hotplug_t;
+
+static inline int
+evdev_hotplug_find(const evdev_hotplug_t *hp, int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < hp->node_count; i++)
+	{
+		if (hp->nodes[i].fd == fd)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static inline void
+evdev_hotplug_remove(evdev_hotplug_t *hp, unsigned int index)
+{
+	evdev_node_t *node = &hp->nodes[index];
+
+	if (hp->detach)
+	{
+		hp->detach(hp->ctx, node->fd);
+	}
+
+	epoll_ctl(hp->epoll_fd, EPOLL_CTL_DEL, node->fd, NULL);
+	close(node->fd);
+
+	*node = hp->nodes[--hp->node_count];
+}
+
+/* Open the directory entry name if it is a node we want and don't have yet */
+static inline void
+evdev_hotplug_try_open(evdev_hotplug_t *hp, const char *name)
+{
+	char path[PATH_MAX];
+	struct epoll_event ev;
+	struct stat st;
+	evdev_node_t *node;
+	bool preferred;
+	unsigned int i;
+	int fd;
+
+	preferred = hp->preferred && 0 == strcmp(name, hp->preferred);
+
+	if (hp->node_count >= hp->max_nodes ||
+	        (!preferred && strncmp(name, "event", 5) != 0))
+	{
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", hp->dir, name);
+
+	/* stat() follows the udev symlink, so both names map to one rdev */
+	if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+	{
+		return;
+	}
+
+	for (i = 0; i < hp->node_count; i++)
+	{
+		if (hp->nodes[i].rdev == st.st_rdev)
+		{
+			return;
+		}
+	}
+
+	/* udev may not have fixed the permissions yet; IN_ATTRIB retries */
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (hp->attach(hp->ctx, fd, preferred) < 0 ||
+	        epoll_ctl(hp->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		close(fd);
+		return;
+	}
+
+	node = &hp->nodes[hp->node_count++];
+	node->fd = fd;
+	node->rdev = st.st_rdev;
+	snprintf(node->name, sizeof(node->name), "%s", name);
+}
+
+static inline void
+evdev_hotplug_scan(evdev_hotplug_t *hp)
+{
+	struct dirent *entry;
+	DIR *dir;
+
+	if (hp->preferred)
+	{
+		evdev_hotplug_try_open(hp, hp->preferred);
+	}
+
+	dir = opendir(hp->dir);
+
+	if (NULL == dir)
+	{
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		evdev_hotplug_try_open(hp, entry->d_name);
+	}
+
+	closedir(dir);
+}
+
+/* Drain the inotify watch and add or drop nodes accordingly */
+static inline void
+evdev_hotplug_handle_inotify(evdev_hotplug_t *hp)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	int i;
+
+	while ((len = read(hp->inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len)
+		{
+			event = (const struct inotify_event *) p;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				evdev_hotplug_scan(hp);
+			}
+
+			if (0 == event->len)
+			{
+				continue;
+			}
+
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+			{
+				for (i = hp->node_count - 1; i >= 0; i--)
+				{
+					if (0 == strcmp(hp->nodes[i].name, event->name))
+					{
+						evdev_hotplug_remove(hp, i);
+					}
+				}
+			}
+			else
+			{
+				evdev_hotplug_try_open(hp, event->name);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Create the epoll set, watch dir and attach every matching node.
+ *
+ * If only the inotify watch fails the set still works, it just won't see
+ * new devices; inotify_fd is left at -1 in that case.
+ *
+ * @retval  0 on success
+ * @retval -1 if the epoll fd could not be created
+ */
+static inline int
+evdev_hotplug_init(evdev_hotplug_t *hp, const char *dir, const char *preferred,
+                   unsigned int max_nodes, evdev_attach_fn attach,
+                   evdev_detach_fn detach, void *ctx)
+{
+	struct epoll_event ev;
+
+	memset(hp, 0, sizeof(*hp));
+	hp->dir = dir;
+	hp->preferred = preferred;
+	hp->max_nodes = max_nodes < EVDEV_HOTPLUG_MAX_NODES ?
+	                max_nodes : EVDEV_HOTPLUG_MAX_NODES;
+	hp->attach = attach;
+	hp->detach = detach;
+	hp->ctx = ctx;
+	hp->inotify_fd = -1;
+	hp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (hp->epoll_fd < 0)
+	{
+		return -1;
+	}
+
+	hp->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (hp->inotify_fd >= 0)
+	{
+		ev.events = EPOLLIN;
+		ev.data.fd = hp->inotify_fd;
+
+		/* Watch before scanning so that nothing slips in between */
+		if (inotify_add_watch(hp->inotify_fd, dir, IN_CREATE | IN_ATTRIB |
+		                      IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0 ||
+		        epoll_ctl(hp->epoll_fd, EPOLL_CTL_ADD, hp->inotify_fd, &ev) < 0)
+		{
+			close(hp->inotify_fd);
+			hp->inotify_fd = -1;
+		}
+	}
+
+	evdev_hotplug_scan(hp);
+
+	return 0;
+}
+
+static inline void
+evdev_hotplug_destroy(evdev_hotplug_t *hp)
+{
+	while (hp->node_count > 0)
+	{
+		close(hp->nodes[--hp->node_count].fd);
+	}
+
+	if (hp->inotify_fd >= 0)
+	{
+		close(hp->inotify_fd);
+		hp->inotify_fd = -1;
+	}
+
+	if (hp->epoll_fd >= 0)
+	{
+		close(hp->epoll_fd);
+		hp->epoll_fd = -1;
+	}
+}
+
+/**
+ * @brief Read whatever one ready node has, without blocking.
+ *
+ * Pending hot-plug notifications are handled on the way. Only one node is
+ * read per call so frames from different devices never interleave in buf;
+ * the others stay ready (epoll is level triggered) for the next call.
+ * Nodes that report an error or hang up are detached and closed.
+ *
+ * @retval bytes read, 0 if nothing was ready, -1 if epoll_wait failed
+ */
+static inline ssize_t
+evdev_hotplug_read(evdev_hotplug_t *hp, void *buf, size_t size)
+{
+	struct epoll_event events[EVDEV_HOTPLUG_MAX_NODES + 1];
+	bool hotplug = false;
+	ssize_t rd = 0;
+	int i, n, index;
+
+	if (hp->epoll_fd < 0)
+	{
+		return 0;
+	}
+
+	do
+	{
+		n = epoll_wait(hp->epoll_fd, events,
+		               sizeof(events) / sizeof(events[0]), 0);
+		perf_count(hp->perf, PERF_SYSCALLS, 1);
+	}
+	while (n < 0 && EINTR == errno);
+
+	if (n < 0)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].data.fd == hp->inotify_fd)
+		{
+			hotplug = true;
+			continue;
+		}
+
+		index = evdev_hotplug_find(hp, events[i].data.fd);
+
+		if (index < 0 || rd > 0)
+		{
+			continue;
+		}
+
+		if (events[i].events & EPOLLIN)
+		{
+			do
+			{
+				rd = read(hp->nodes[index].fd, buf, size);
+				perf_count(hp->perf, PERF_SYSCALLS, 1);
+			}
+			while (rd < 0 && EINTR == errno);
+
+			if (rd > 0 || (rd < 0 && EAGAIN == errno))
+			{
+				rd = rd > 0 ? rd : 0;
+				continue;
+			}
+
+			rd = 0;
+		}
+
+		/* EOF, ENODEV or EPOLLERR/EPOLLHUP: the device is gone */
+		evdev_hotplug_remove(hp, index);
+	}
+
+	/* Last, so a reused fd number can't be mistaken for one in events */
+	if (hotplug)
+	{
+		evdev_hotplug_handle_inotify(hp);
+	}
+
+	return rd;
+}
+
+#endif // __NYX__MOD__QEMUX__EVDEV_HOTPLUG_H__
@@ -0,0 +1,474 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file evdev_log.h
+ *
+ * @brief Recorded evdev input, for reproducing input problems offline.
+ *
+ * A log is an evdev_log_header_t followed by the raw struct input_event
+ * records exactly as read(2) returned them, timestamps included, so that
+ * replaying one feeds the module the same bytes it saw when it was
+ * recorded. The record count follows from the file size; a trailing
+ * partial record (from a recording cut short) is ignored.
+ *
+ * The recorder appends through a buffer that is only written out when it
+ * fills up or the recorder is closed. The player maps the file and hands
+ * out whole SYN_REPORT frames, either as fast as they are asked for or
+ * paced to the original gaps between them. Its timerfd goes into the
+ * module's epoll set in place of the device nodes, and is readable
+ * whenever a frame is due.
+ */
+
+#ifndef __NYX__MOD__QEMUX__EVDEV_LOG_H__
+#define __NYX__MOD__QEMUX__EVDEV_LOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/* "fast" replays as fast as the module is read, anything else is paced */
+#define EVDEV_LOG_PACE_ENV      "NYX_INPUT_REPLAY_PACE"
+
+#define EVDEV_LOG_MAGIC         "NYXEVLOG"
+#define EVDEV_LOG_VERSION       1
+#define EVDEV_LOG_BUFFER_SIZE   (64 * 1024)
+
+/* evdev_log_info_t flags */
+#define EVDEV_LOG_MT            0x1     /**< multi-touch protocol B device */
+
+/* What a module needs to know about the device the log was taken from */
+typedef struct
+{
+	uint32_t flags;
+	int32_t max_x, max_y;       /**< axis maxima, 0 for devices without axes */
+	int32_t res_x, res_y;       /**< display resolution the axes were scaled to */
+} evdev_log_info_t;
+
+typedef struct
+{
+	char magic[8];              /**< EVDEV_LOG_MAGIC, not terminated */
+	uint32_t version;           /**< EVDEV_LOG_VERSION */
+	uint32_t record_size;       /**< sizeof(struct input_event) of the recorder */
+	evdev_log_info_t info;
+	uint32_t reserved;          /**< 0, keeps the records 8 byte aligned */
+} evdev_log_header_t;
+
+typedef struct
+{
+	const unsigned char *map;   /**< NULL when not replaying */
+	size_t map_size;
+	const struct input_event *records;
+	size_t count;
+	size_t pos;                 /**< next record to hand out */
+	evdev_log_info_t info;
+	bool paced;
+	int64_t offset_ns;          /**< record time to CLOCK_MONOTONIC, when paced */
+	int timer_fd;
+} evdev_log_player_t;
+
+typedef struct
+{
+	int fd;
+	unsigned char *buf;         /**< NULL when not recording */
+	size_t used;
+} evdev_log_recorder_t;
+
+static inline bool
+evdev_log_paced(void)
+{
+	const char *pace = getenv(EVDEV_LOG_PACE_ENV);
+
+	return NULL == pace || strcmp(pace, "fast") != 0;
+}
+
+static inline void
+evdev_log_header_init(evdev_log_header_t *header, const evdev_log_info_t *info)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, EVDEV_LOG_MAGIC, sizeof(header->magic));
+	header->version = EVDEV_LOG_VERSION;
+	header->record_size = sizeof(struct input_event);
+	header->info = *info;
+}
+
+static inline int64_t
+evdev_log_record_ns(const struct input_event *record)
+{
+	return record->time.tv_sec * 1000000000LL + record->time.tv_usec * 1000LL;
+}
+
+static inline bool
+evdev_log_replaying(const evdev_log_player_t *p)
+{
+	return p->map != NULL;
+}
+
+/* Arm the timer for the next frame, or disarm it at the end of the log */
+static inline void
+evdev_log_player_arm(evdev_log_player_t *p)
+{
+	struct itimerspec its;
+	int64_t due = 1;
+
+	memset(&its, 0, sizeof(its));
+
+	if (p->pos < p->count)
+	{
+		if (p->paced)
+		{
+			due = evdev_log_record_ns(&p->records[p->pos]) + p->offset_ns;
+			due = due > 0 ? due : 1;
+		}
+
+		/* An expired timer stays readable until it is re-armed */
+		its.it_value.tv_sec = due / 1000000000LL;
+		its.it_value.tv_nsec = due % 1000000000LL;
+	}
+
+	timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static inline void
+evdev_log_player_close(evdev_log_player_t *p)
+{
+	if (!evdev_log_replaying(p))
+	{
+		return;
+	}
+
+	if (p->timer_fd >= 0)
+	{
+		close(p->timer_fd);
+	}
+
+	munmap((void *) p->map, p->map_size);
+	memset(p, 0, sizeof(*p));
+}
+
+/**
+ * @brief Map the log at path and add the player's timer to epoll_fd.
+ *
+ * @param paced replay with the recorded gaps between frames, see
+ *              evdev_log_paced()
+ *
+ * @retval  0 on success
+ * @retval -1 if the file can't be mapped or is not a log this build can
+ *            replay
+ */
+static inline int
+evdev_log_player_open(evdev_log_player_t *p, const char *path, bool paced,
+                      int epoll_fd)
+{
+	const evdev_log_header_t *header;
+	struct epoll_event ev;
+	struct timespec now;
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(p, 0, sizeof(*p));
+	p->timer_fd = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header))
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == map)
+	{
+		return -1;
+	}
+
+	p->map = map;
+	p->map_size = st.st_size;
+	header = (const evdev_log_header_t *) map;
+
+	if (memcmp(header->magic, EVDEV_LOG_MAGIC, sizeof(header->magic)) != 0 ||
+	        header->version != EVDEV_LOG_VERSION ||
+	        header->record_size != sizeof(struct input_event))
+	{
+		goto fail;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	p->info = header->info;
+	p->records = (const struct input_event *)(p->map + sizeof(*header));
+	p->count = (p->map_size - sizeof(*header)) / sizeof(struct input_event);
+	p->paced = paced;
+
+	p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (p->timer_fd < 0)
+	{
+		goto fail;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = p->timer_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->timer_fd, &ev) < 0)
+	{
+		goto fail;
+	}
+
+	if (p->count > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		p->offset_ns = now.tv_sec * 1000000000LL + now.tv_nsec -
+		               evdev_log_record_ns(&p->records[0]);
+	}
+
+	evdev_log_player_arm(p);
+
+	return 0;
+
+fail:
+	evdev_log_player_close(p);
+	return -1;
+}
+
+/**
+ * @brief Copy out the frames that are due, read(2) style.
+ *
+ * Only whole frames are handed out, unless a single one does not fit in
+ * buf. In fast mode this costs no syscalls until the log runs out; paced,
+ * it re-arms the timer once.
+ *
+ * @retval bytes copied, 0 if nothing is due or the log is done
+ */
+static inline ssize_t
+evdev_log_play(evdev_log_player_t *p, void *buf, size_t size)
+{
+	size_t room = size / sizeof(struct input_event);
+	size_t first = p->pos, end;
+	int64_t now_ns = 0;
+
+	if (p->paced)
+	{
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	}
+
+	while (p->pos < p->count && p->pos - first < room)
+	{
+		if (p->paced &&
+		        evdev_log_record_ns(&p->records[p->pos]) + p->offset_ns > now_ns)
+		{
+			break;
+		}
+
+		for (end = p->pos; end < p->count; end++)
+		{
+			if (EV_SYN == p->records[end].type && SYN_REPORT == p->records[end].code)
+			{
+				end++;
+				break;
+			}
+		}
+
+		if (end - first > room)
+		{
+			if (p->pos > first)
+			{
+				break;
+			}
+
+			end = first + room;
+		}
+
+		p->pos = end;
+	}
+
+	memcpy(buf, &p->records[first], (p->pos - first) * sizeof(struct input_event));
+
+	if (p->paced || p->pos >= p->count)
+	{
+		evdev_log_player_arm(p);
+	}
+
+	return (p->pos - first) * sizeof(struct input_event);
+}
+
+static inline bool
+evdev_log_recording(const evdev_log_recorder_t *r)
+{
+	return r->buf != NULL;
+}
+
+/* Write out the buffer, retval 0 on success, -1 after a failed write */
+static inline int
+evdev_log_recorder_flush(evdev_log_recorder_t *r)
+{
+	size_t done = 0;
+	ssize_t wr;
+
+	while (done < r->used)
+	{
+		wr = write(r->fd, r->buf + done, r->used - done);
+
+		if (wr < 0 && EINTR == errno)
+		{
+			continue;
+		}
+
+		if (wr <= 0)
+		{
+			r->used = 0;
+			return -1;
+		}
+
+		done += wr;
+	}
+
+	r->used = 0;
+	return 0;
+}
+
+/* Flush and stop recording, retval as evdev_log_recorder_flush() */
+static inline int
+evdev_log_recorder_close(evdev_log_recorder_t *r)
+{
+	int ret;
+
+	if (!evdev_log_recording(r))
+	{
+		return 0;
+	}
+
+	ret = evdev_log_recorder_flush(r);
+
+	if (close(r->fd) < 0)
+	{
+		ret = -1;
+	}
+
+	free(r->buf);
+	memset(r, 0, sizeof(*r));
+	return ret;
+}
+
+/**
+ * @brief Start appending to the log at path, creating it if needed.
+ *
+ * An existing log must have been recorded with the same header, so that
+ * one file only ever describes one device.
+ *
+ * @retval  0 on success
+ * @retval -1 if the file can't be opened or holds a different log
+ */
+static inline int
+evdev_log_recorder_open(evdev_log_recorder_t *r, const char *path,
+                        const evdev_log_info_t *info)
+{
+	evdev_log_header_t header, existing;
+	struct stat st;
+
+	memset(r, 0, sizeof(*r));
+	evdev_log_header_init(&header, info);
+
+	r->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (r->fd < 0)
+	{
+		return -1;
+	}
+
+	if (fstat(r->fd, &st) < 0)
+	{
+		goto fail;
+	}
+
+	if (0 == st.st_size)
+	{
+		if (write(r->fd, &header, sizeof(header)) != sizeof(header))
+		{
+			goto fail;
+		}
+	}
+	else if (pread(r->fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+	         memcmp(&existing, &header, sizeof(header)) != 0)
+	{
+		goto fail;
+	}
+
+	r->buf = (unsigned char *) malloc(EVDEV_LOG_BUFFER_SIZE);
+
+	if (NULL == r->buf)
+	{
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+/**
+ * @brief Append size bytes of records read from the device.
+ *
+ * size is one read's worth and may not exceed EVDEV_LOG_BUFFER_SIZE.
+ *
+ * @retval 0 on success, -1 if writing out the buffer failed
+ */
+static inline int
+evdev_log_record(evdev_log_recorder_t *r, const void *events, size_t size)
+{
+	if (size > EVDEV_LOG_BUFFER_SIZE)
+	{
+		return -1;
+	}
+
+	if (r->used + size > EVDEV_LOG_BUFFER_SIZE &&
+	        evdev_log_recorder_flush(r) < 0)
+	{
+		return -1;
+	}
+
+	memcpy(r->buf + r->used, events, size);
+	r->used += size;
+	return 0;
+}
+
+#endif // __NYX__MOD__QEMUX__EVDEV_LOG_H__
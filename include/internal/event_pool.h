@@ -0,0 +1,251 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file event_pool.h
+ *
+ * @brief Fixed-size freelist of preallocated event objects shared by the
+ * input modules, so that get_event/release_event do not touch the heap.
+ *
+ * A consumer may close the module while still holding events. Destroying
+ * a pool with objects still out therefore only marks it closing, and the
+ * event_pool_put() of the last one frees it. Malloc'd fallback objects
+ * don't live in the slab, but their put needs the pool too, so they are
+ * counted separately and waited for as well.
+ */
+
+#ifndef __NYX__MOD__QEMUX__EVENT_POOL_H__
+#define __NYX__MOD__QEMUX__EVENT_POOL_H__
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <glib.h>
+
+typedef struct
+{
+	char *slab;                 /**< backing store for all pooled objects */
+	void **free_list;           /**< stack of objects available for reuse */
+	unsigned int free_count;    /**< number of entries on free_list */
+	unsigned int high_water;    /**< number of objects owned by the pool */
+	size_t object_size;         /**< size of a single object */
+	unsigned int fallback_allocs; /**< objects malloc'd because the pool ran dry */
+	unsigned int outstanding;   /**< slab objects handed out, not put back yet */
+	unsigned int fallback_outstanding; /**< the same for fallback objects */
+	bool closing;               /**< destroyed, freed once nothing is out */
+} event_pool_t;
+
+/**
+ * @brief Preallocate high_water objects of object_size bytes.
+ *
+ * On failure the pool is left empty and every event_pool_get() falls back
+ * to malloc, so callers may carry on regardless of the return value.
+ *
+ * @retval  0 on success
+ * @retval -1 on failure
+ */
+static inline int
+event_pool_init(event_pool_t *pool, size_t object_size,
+                unsigned int high_water)
+{
+	unsigned int i;
+
+	pool->object_size = object_size;
+	pool->free_count = 0;
+	pool->fallback_allocs = 0;
+	pool->outstanding = 0;
+	pool->fallback_outstanding = 0;
+	pool->closing = false;
+	pool->slab = NULL;
+	pool->free_list = NULL;
+	pool->high_water = 0;
+
+	/* No preallocation, every object is malloc'd */
+	if (0 == high_water)
+	{
+		return 0;
+	}
+
+	pool->slab = (char *) calloc(high_water, object_size);
+	pool->free_list = (void **) calloc(high_water, sizeof(void *));
+
+	if (NULL == pool->slab || NULL == pool->free_list)
+	{
+		free(pool->slab);
+		free(pool->free_list);
+		pool->slab = NULL;
+		pool->free_list = NULL;
+		return -1;
+	}
+
+	pool->high_water = high_water;
+
+	for (i = 0; i < high_water; i++)
+	{
+		pool->free_list[pool->free_count++] = pool->slab + i * object_size;
+	}
+
+	return 0;
+}
+
+/* Upper bound for sizes taken from the environment */
+#define EVENT_POOL_SIZE_MAX 4096
+
+/**
+ * @brief Pool size set through the environment variable name.
+ *
+ * 0 preallocates nothing. Unset or invalid values give default_size.
+ */
+static inline unsigned int
+event_pool_size_from_env(const char *name, unsigned int default_size)
+{
+	const char *value = getenv(name);
+	char *end;
+	long size;
+
+	if (NULL == value || '\0' == *value)
+	{
+		return default_size;
+	}
+
+	size = strtol(value, &end, 10);
+
+	if ('\0' != *end || size < 0 || size > EVENT_POOL_SIZE_MAX)
+	{
+		return default_size;
+	}
+
+	return (unsigned int) size;
+}
+
+static inline void
+event_pool_free(event_pool_t *pool)
+{
+	free(pool->slab);
+	free(pool->free_list);
+	pool->slab = NULL;
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	pool->high_water = 0;
+	pool->closing = false;
+}
+
+/**
+ * @brief Free the pool now, or once the objects still out are put back.
+ *
+ * The pool itself must stay valid until then; the owner can tell from
+ * event_pool_put() when it is done with it.
+ *
+ * @retval 0 if the pool was freed
+ * @retval 1 if that is left to the last event_pool_put()
+ */
+static inline int
+event_pool_destroy(event_pool_t *pool)
+{
+	if (pool->outstanding > 0 || pool->fallback_outstanding > 0)
+	{
+		pool->closing = true;
+		return 1;
+	}
+
+	event_pool_free(pool);
+	return 0;
+}
+
+/* Slab objects handed out and not put back yet */
+static inline unsigned int
+event_pool_outstanding(const event_pool_t *pool)
+{
+	return pool->outstanding;
+}
+
+static inline bool
+event_pool_owns(const event_pool_t *pool, const void *object)
+{
+	const char *p = (const char *) object;
+
+	return p >= pool->slab &&
+	       p < pool->slab + (size_t) pool->high_water * pool->object_size;
+}
+
+/**
+ * @brief Take an object from the pool. The contents are not cleared.
+ *
+ * @retval object, or NULL if the pool is empty and malloc failed
+ */
+static inline void *
+event_pool_get(event_pool_t *pool)
+{
+	void *object;
+
+	if (G_LIKELY(pool->free_count > 0))
+	{
+		pool->outstanding++;
+		return pool->free_list[--pool->free_count];
+	}
+
+	pool->fallback_allocs++;
+	object = malloc(pool->object_size);
+
+	if (object)
+	{
+		pool->fallback_outstanding++;
+	}
+
+	return object;
+}
+
+/**
+ * @brief Return an object obtained from event_pool_get().
+ *
+ * @retval true if this was the last object out of a destroyed pool, which
+ *         is now freed
+ */
+static inline bool
+event_pool_put(event_pool_t *pool, void *object)
+{
+	if (event_pool_owns(pool, object))
+	{
+		if (G_LIKELY(pool->outstanding > 0))
+		{
+			pool->outstanding--;
+		}
+
+		if (G_LIKELY(pool->free_count < pool->high_water))
+		{
+			pool->free_list[pool->free_count++] = object;
+		}
+	}
+	else
+	{
+		if (G_LIKELY(pool->fallback_outstanding > 0))
+		{
+			pool->fallback_outstanding--;
+		}
+
+		free(object);
+	}
+
+	if (G_UNLIKELY(pool->closing) && 0 == pool->outstanding &&
+	        0 == pool->fallback_outstanding)
+	{
+		event_pool_free(pool);
+		return true;
+	}
+
+	return false;
+}
+
+#endif // __NYX__MOD__QEMUX__EVENT_POOL_H__
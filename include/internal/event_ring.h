@@ -0,0 +1,442 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file event_ring.h
+ *
+ * @brief Single producer, single consumer ring of fixed size events in a
+ * sealed memfd, so that finished events can be read in place by another
+ * thread or process.
+ *
+ * The memfd starts with an event_ring_header_t, followed by slot_count
+ * slots of slot_size bytes. head and tail both run freely; the slot of
+ * a position is position & (slot_count - 1). The producer fills slots
+ * and publishes them by advancing head, the consumer reads them and hands
+ * them back by advancing tail. Nothing ever blocks: an event that does
+ * not fit is dropped and counted.
+ *
+ * The eventfd is only written when a publish finds the consumer caught up,
+ * so a consumer that keeps up costs the producer no syscalls. A consumer
+ * must therefore read the eventfd (event_ring_ack()) before draining the
+ * ring, and only wait again once event_ring_peek() has returned NULL.
+ */
+
+#ifndef __NYX__MOD__QEMUX__EVENT_RING_H__
+#define __NYX__MOD__QEMUX__EVENT_RING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS     (1024 + 9)
+#define F_SEAL_SEAL     0x0001
+#define F_SEAL_SHRINK   0x0002
+#define F_SEAL_GROW     0x0004
+#endif
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS     (1024 + 10)
+#endif
+
+#define EVENT_RING_MAGIC        0x4e594552      /* "NYER" */
+#define EVENT_RING_VERSION      1
+#define EVENT_RING_CACHE_LINE   64
+
+typedef struct
+{
+	uint32_t magic;             /**< EVENT_RING_MAGIC */
+	uint32_t version;           /**< EVENT_RING_VERSION */
+	uint32_t slot_size;         /**< bytes per slot */
+	uint32_t slot_count;        /**< a power of two */
+	uint64_t dropped;           /**< events lost to a full ring */
+	/* Producer and consumer positions on cache lines of their own */
+	uint64_t head __attribute__((aligned(EVENT_RING_CACHE_LINE)));
+	uint64_t tail __attribute__((aligned(EVENT_RING_CACHE_LINE)));
+} __attribute__((aligned(EVENT_RING_CACHE_LINE))) event_ring_header_t;
+
+typedef struct
+{
+	event_ring_header_t *header;    /**< NULL when no ring is open */
+	unsigned char *slots;
+	size_t map_size;
+	uint32_t mask;
+	uint32_t slot_size;             /**< never re-read from the shared header */
+	int memfd;
+	int event_fd;                   /**< readable when the consumer should look */
+	int stop_fd;                    /**< producer side, see event_ring_wait() */
+	uint64_t head, tail;            /**< this side's copies of the positions */
+} event_ring_t;
+
+static inline bool
+event_ring_active(const event_ring_t *r)
+{
+	return r->header != NULL;
+}
+
+static inline void
+event_ring_destroy(event_ring_t *r)
+{
+	if (!event_ring_active(r))
+	{
+		return;
+	}
+
+	munmap(r->header, r->map_size);
+
+	if (r->memfd >= 0)
+	{
+		close(r->memfd);
+	}
+
+	if (r->event_fd >= 0)
+	{
+		close(r->event_fd);
+	}
+
+	if (r->stop_fd >= 0)
+	{
+		close(r->stop_fd);
+	}
+
+	memset(r, 0, sizeof(*r));
+}
+
+/* Bytes needed for a ring of this geometry, 0 if it does not fit a size_t */
+static inline size_t
+event_ring_map_size(size_t slot_size, size_t slot_count)
+{
+	if (slot_count != 0 &&
+	        slot_size > (SIZE_MAX - sizeof(event_ring_header_t)) / slot_count)
+	{
+		return 0;
+	}
+
+	return sizeof(event_ring_header_t) + slot_size * slot_count;
+}
+
+static inline int
+event_ring_map_fd(event_ring_t *r, int memfd, size_t map_size)
+{
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+	if (MAP_FAILED == map)
+	{
+		return -1;
+	}
+
+	r->header = (event_ring_header_t *) map;
+	r->slots = (unsigned char *) map + sizeof(event_ring_header_t);
+	r->map_size = map_size;
+	return 0;
+}
+
+/**
+ * @brief Create a ring of slot_count (a power of two) slots, producer side.
+ *
+ * The memfd is sealed against resizing, so a consumer can't make the
+ * producer fault by truncating it.
+ *
+ * @retval 0 on success, -1 otherwise
+ */
+static inline int
+event_ring_create(event_ring_t *r, const char *name, size_t slot_size,
+                  unsigned int slot_count)
+{
+	size_t map_size;
+
+	memset(r, 0, sizeof(*r));
+	r->memfd = r->event_fd = r->stop_fd = -1;
+
+	if (0 == slot_count || (slot_count & (slot_count - 1)) != 0 ||
+	        0 == slot_size || slot_size > UINT32_MAX - EVENT_RING_CACHE_LINE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Keep every slot cache line aligned */
+	slot_size = (slot_size + EVENT_RING_CACHE_LINE - 1) &
+	            ~(size_t)(EVENT_RING_CACHE_LINE - 1);
+	map_size = event_ring_map_size(slot_size, slot_count);
+
+	if (0 == map_size)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->memfd = syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (r->memfd < 0 || ftruncate(r->memfd, map_size) < 0 ||
+	        fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+	{
+		goto fail;
+	}
+
+	r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (r->event_fd < 0 || r->stop_fd < 0 || event_ring_map_fd(r, r->memfd, map_size) < 0)
+	{
+		goto fail;
+	}
+
+	r->header->magic = EVENT_RING_MAGIC;
+	r->header->version = EVENT_RING_VERSION;
+	r->header->slot_size = slot_size;
+	r->header->slot_count = slot_count;
+	r->slot_size = slot_size;
+	r->mask = slot_count - 1;
+
+	return 0;
+
+fail:
+
+	if (r->memfd >= 0)
+	{
+		close(r->memfd);
+	}
+
+	if (r->event_fd >= 0)
+	{
+		close(r->event_fd);
+	}
+
+	if (r->stop_fd >= 0)
+	{
+		close(r->stop_fd);
+	}
+
+	memset(r, 0, sizeof(*r));
+	return -1;
+}
+
+/**
+ * @brief Map a ring created elsewhere, consumer side.
+ *
+ * memfd and event_fd are dup'ed, the caller keeps its own. The header is
+ * only trusted as far as the memfd backs it: it has to be sealed against
+ * shrinking and at least as big as the geometry it claims, so that no slot
+ * access can fault. The geometry is copied once and never re-read.
+ *
+ * @retval 0 on success, -1 if the memfd does not hold a ring
+ */
+static inline int
+event_ring_open(event_ring_t *r, int memfd, int event_fd)
+{
+	event_ring_header_t header;
+	struct stat st;
+	size_t map_size;
+	int seals;
+
+	memset(r, 0, sizeof(*r));
+	r->memfd = r->event_fd = r->stop_fd = -1;
+
+	if (pread(memfd, &header, sizeof(header), 0) != sizeof(header) ||
+	        header.magic != EVENT_RING_MAGIC || header.version != EVENT_RING_VERSION ||
+	        0 == header.slot_count || (header.slot_count & (header.slot_count - 1)) != 0 ||
+	        0 == header.slot_size || header.slot_size % EVENT_RING_CACHE_LINE != 0)
+	{
+		return -1;
+	}
+
+	map_size = event_ring_map_size(header.slot_size, header.slot_count);
+	seals = fcntl(memfd, F_GET_SEALS);
+
+	if (0 == map_size || seals < 0 || !(seals & F_SEAL_SHRINK) ||
+	        fstat(memfd, &st) < 0 || st.st_size < 0 || (uint64_t) st.st_size < map_size)
+	{
+		return -1;
+	}
+
+	if (event_ring_map_fd(r, memfd, map_size) < 0)
+	{
+		return -1;
+	}
+
+	r->slot_size = header.slot_size;
+	r->mask = header.slot_count - 1;
+	r->memfd = fcntl(memfd, F_DUPFD_CLOEXEC, 0);
+	r->event_fd = fcntl(event_fd, F_DUPFD_CLOEXEC, 0);
+	r->tail = __atomic_load_n(&r->header->tail, __ATOMIC_RELAXED);
+	r->head = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+
+	if (r->memfd < 0 || r->event_fd < 0)
+	{
+		event_ring_destroy(r);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Copy one event of size bytes into the next free slot.
+ *
+ * Not visible to the consumer until event_ring_publish().
+ *
+ * @retval true if it was queued, false if the ring is full and it was dropped
+ */
+static inline bool
+event_ring_push(event_ring_t *r, const void *event, size_t size)
+{
+	if (r->head - r->tail > r->mask)
+	{
+		r->tail = __atomic_load_n(&r->header->tail, __ATOMIC_ACQUIRE);
+
+		if (r->head - r->tail > r->mask)
+		{
+			__atomic_store_n(&r->header->dropped,
+			                 __atomic_load_n(&r->header->dropped, __ATOMIC_RELAXED) + 1,
+			                 __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+
+	memcpy(r->slots + (size_t)(r->head & r->mask) * r->slot_size, event,
+	       size < r->slot_size ? size : r->slot_size);
+	r->head++;
+	return true;
+}
+
+/* Make the pushed events visible, waking the consumer if it had caught up */
+static inline void
+event_ring_publish(event_ring_t *r)
+{
+	uint64_t published = __atomic_load_n(&r->header->head, __ATOMIC_RELAXED);
+	uint64_t one = 1;
+
+	if (published == r->head)
+	{
+		return;
+	}
+
+	__atomic_store_n(&r->header->head, r->head, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in event_ring_peek(), see the file comment */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	r->tail = __atomic_load_n(&r->header->tail, __ATOMIC_RELAXED);
+
+	if (r->tail == published && write(r->event_fd, &one, sizeof(one)) < 0)
+	{
+		/* EAGAIN: the counter is saturated, the consumer is awake anyway */
+	}
+}
+
+/**
+ * @brief Wait for the producer's input or a stop request.
+ *
+ * @retval true once source_fd is readable, false when asked to stop
+ */
+static inline bool
+event_ring_wait(event_ring_t *r, int source_fd)
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = source_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = r->stop_fd;
+	fds[1].events = POLLIN;
+
+	while (poll(fds, 2, -1) < 0)
+	{
+		if (errno != EINTR)
+		{
+			return false;
+		}
+	}
+
+	return !(fds[1].revents & POLLIN);
+}
+
+/* Have event_ring_wait() return false, from any thread */
+static inline void
+event_ring_stop(event_ring_t *r)
+{
+	uint64_t one = 1;
+
+	if (write(r->stop_fd, &one, sizeof(one)) < 0)
+	{
+		/* Only fails once the counter is saturated, it is readable then */
+	}
+}
+
+/* Consumer: clear the wakeup before draining the ring */
+static inline void
+event_ring_ack(event_ring_t *r)
+{
+	uint64_t count;
+
+	if (read(r->event_fd, &count, sizeof(count)) < 0)
+	{
+		/* EAGAIN: nothing to clear */
+	}
+}
+
+/**
+ * @brief The oldest unread event, in place.
+ *
+ * It stays valid until event_ring_pop().
+ *
+ * @retval event, or NULL if the ring is empty
+ */
+static inline const void *
+event_ring_peek(event_ring_t *r)
+{
+	if (r->tail == r->head)
+	{
+		r->head = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+
+		if (r->tail == r->head)
+		{
+			/* Make sure a publish that missed our tail is seen here */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			r->head = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+
+			if (r->tail == r->head)
+			{
+				return NULL;
+			}
+		}
+	}
+
+	return r->slots + (size_t)(r->tail & r->mask) * r->slot_size;
+}
+
+/* Hand the event returned by event_ring_peek() back to the producer */
+static inline void
+event_ring_pop(event_ring_t *r)
+{
+	__atomic_store_n(&r->header->tail, ++r->tail, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t
+event_ring_dropped(const event_ring_t *r)
+{
+	return __atomic_load_n(&r->header->dropped, __ATOMIC_RELAXED);
+}
+
+#endif // __NYX__MOD__QEMUX__EVENT_RING_H__
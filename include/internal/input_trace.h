@@ -0,0 +1,232 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file input_trace.h
+ *
+ * @brief Binary tracepoints for the per-event paths of the input modules.
+ *
+ * Without NYX_INPUT_TRACE (the default, see the CMake option of the same
+ * name) INPUT_TRACE() expands to nothing and its arguments are never
+ * evaluated. With it, every tracepoint is also a USDT probe (provider
+ * nyx_input) where <sys/sdt.h> is available, and, if INPUT_TRACE_FILE_ENV
+ * names a file when a module is opened, records go into a ring of the
+ * last INPUT_TRACE_RING_SIZE records that is written to that file when
+ * the module is closed.
+ *
+ * The file is an input_trace_header_t followed by count records, oldest
+ * first.
+ */
+
+#ifndef __NYX__MOD__QEMUX__INPUT_TRACE_H__
+#define __NYX__MOD__QEMUX__INPUT_TRACE_H__
+
+/* Every tracepoint, with the meaning of its arguments */
+typedef enum
+{
+	INPUT_TRACE_TP_FINGER_DOWN,     /**< slot, x, y, weight */
+	INPUT_TRACE_TP_FINGER_UP,       /**< slot, x, y */
+	INPUT_TRACE_TP_FINGER_MATCH,    /**< input index, x, y, weight, distance */
+	INPUT_TRACE_TP_FINGER_REJECTED, /**< x, y: no free slot */
+	INPUT_TRACE_TP_FINGER_LIGHT,    /**< input index, weight: below threshold */
+	INPUT_TRACE_TP_COORD_IGNORED,   /**< slot, last weight, weight */
+	INPUT_TRACE_TP_NEW_FINGER,      /**< input index, fingers, x, y, weight */
+	INPUT_TRACE_TP_READ,            /**< raw events read */
+	INPUT_TRACE_TP_EVENT,           /**< items in the event handed out */
+	INPUT_TRACE_KEY_EVENT,          /**< evdev code, value, nyx key, key type */
+	INPUT_TRACE_COUNT
+} input_trace_id_t;
+
+#ifdef NYX_INPUT_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define INPUT_TRACE_USDT 1
+#endif
+#endif
+
+/* Set to a file name to have the trace ring recorded and written there */
+#define INPUT_TRACE_FILE_ENV    "NYX_INPUT_TRACE_FILE"
+#define INPUT_TRACE_RING_SIZE   4096    /* records, a power of two */
+#define INPUT_TRACE_MAGIC       "NYXTRACE"
+
+typedef struct
+{
+	uint64_t ns;                /**< CLOCK_MONOTONIC */
+	uint32_t id;                /**< input_trace_id_t */
+	int32_t args[5];
+} input_trace_record_t;
+
+typedef struct
+{
+	char magic[8];              /**< INPUT_TRACE_MAGIC, not terminated */
+	uint32_t version;           /**< 1 */
+	uint32_t record_size;
+	uint32_t count;             /**< records that follow */
+	uint32_t lost;              /**< older records overwritten in the ring */
+} input_trace_header_t;
+
+typedef struct
+{
+	bool enabled;
+	unsigned int head;          /**< free running, claimed atomically */
+	input_trace_record_t records[INPUT_TRACE_RING_SIZE];
+} input_trace_ring_t;
+
+/* Weak, so every translation unit of a module shares one ring */
+__attribute__((weak)) input_trace_ring_t input_trace_ring;
+
+/* Called at module open, turns recording on if INPUT_TRACE_FILE_ENV is set */
+static inline void
+input_trace_init(void)
+{
+	if (getenv(INPUT_TRACE_FILE_ENV))
+	{
+		__atomic_store_n(&input_trace_ring.enabled, true, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void
+input_trace_record(input_trace_id_t id, int32_t a, int32_t b, int32_t c,
+                   int32_t d, int32_t e)
+{
+	input_trace_record_t *record;
+	struct timespec ts;
+	unsigned int slot;
+
+	slot = __atomic_fetch_add(&input_trace_ring.head, 1, __ATOMIC_RELAXED);
+	record = &input_trace_ring.records[slot & (INPUT_TRACE_RING_SIZE - 1)];
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record->ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	record->id = id;
+	record->args[0] = a;
+	record->args[1] = b;
+	record->args[2] = c;
+	record->args[3] = d;
+	record->args[4] = e;
+}
+
+/**
+ * @brief Write the ring to the INPUT_TRACE_FILE_ENV file.
+ *
+ * Called at module close; tracepoints hit while it runs may or may not
+ * make it into the file.
+ *
+ * @retval 0 on success or if tracing is off, -1 otherwise
+ */
+static inline int
+input_trace_dump(void)
+{
+	const char *path = getenv(INPUT_TRACE_FILE_ENV);
+	unsigned int head = __atomic_load_n(&input_trace_ring.head, __ATOMIC_ACQUIRE);
+	unsigned int first, count;
+	input_trace_header_t header;
+	bool ok;
+	int fd;
+
+	if (!input_trace_ring.enabled || NULL == path)
+	{
+		return 0;
+	}
+
+	count = head < INPUT_TRACE_RING_SIZE ? head : INPUT_TRACE_RING_SIZE;
+	first = (head - count) & (INPUT_TRACE_RING_SIZE - 1);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INPUT_TRACE_MAGIC, sizeof(header.magic));
+	header.version = 1;
+	header.record_size = sizeof(input_trace_record_t);
+	header.count = count;
+	header.lost = head - count;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	/* The ring wraps at most once between first and head */
+	if (first + count <= INPUT_TRACE_RING_SIZE)
+	{
+		ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+		     write(fd, &input_trace_ring.records[first],
+		           count * sizeof(input_trace_record_t)) ==
+		     (ssize_t)(count * sizeof(input_trace_record_t));
+	}
+	else
+	{
+		unsigned int tail = INPUT_TRACE_RING_SIZE - first;
+
+		ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+		     write(fd, &input_trace_ring.records[first],
+		           tail * sizeof(input_trace_record_t)) ==
+		     (ssize_t)(tail * sizeof(input_trace_record_t)) &&
+		     write(fd, input_trace_ring.records,
+		           (count - tail) * sizeof(input_trace_record_t)) ==
+		     (ssize_t)((count - tail) * sizeof(input_trace_record_t));
+	}
+
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+#ifdef INPUT_TRACE_USDT
+#define INPUT_TRACE_PROBE(name, a, b, c, d, e) \
+	STAP_PROBE5(nyx_input, name, a, b, c, d, e)
+#else
+#define INPUT_TRACE_PROBE(name, a, b, c, d, e) do {} while (0)
+#endif
+
+/* Five ints, pass 0 for the ones a tracepoint does not use */
+#define INPUT_TRACE(name, a, b, c, d, e)                                      \
+	do {                                                                      \
+		INPUT_TRACE_PROBE(name, a, b, c, d, e);                               \
+		if (__builtin_expect(__atomic_load_n(&input_trace_ring.enabled,       \
+		                                     __ATOMIC_RELAXED), 0))           \
+		{                                                                     \
+			input_trace_record(INPUT_TRACE_##name, a, b, c, d, e);            \
+		}                                                                     \
+	} while (0)
+
+#else
+
+static inline void
+input_trace_init(void)
+{
+}
+
+static inline int
+input_trace_dump(void)
+{
+	return 0;
+}
+
+#define INPUT_TRACE(name, a, b, c, d, e) do {} while (0)
+
+#endif // NYX_INPUT_TRACE
+
+#endif // __NYX__MOD__QEMUX__INPUT_TRACE_H__
@@ -20,8 +20,6 @@
 /**Touchpanel*/
 #define MSGID_NYX_QMUX_TP_COORDBUF_ERR         "NYXTP_COORDBUF_ERR"
 #define MSGID_NYX_QMUX_TP_COORDS_ERR           "NYXTP_COORDS_ERR"
-#define MSGID_NYX_QMUX_TP_FINGER_WT            "NYXTP_FINGER_WT"
-#define MSGID_NYX_QMUX_TP_FING_LOW_WT          "NYXTP_FING_LOW_WT"
 #define MSGID_NYX_QMUX_TP_NOTOUCH_ERR          "NYXTP_NOTOUCH_ERR"
 #define MSGID_NYX_QMUX_TP_VBOX_OPEN_ERR        "NYXTP_VBOX_OPEN_ERR"
 #define MSGID_NYX_QMUX_TP_IOCTL_ERR            "NYXTP_IOCTL_ERR"
@@ -40,12 +38,23 @@
 #define MSGID_NYX_QMUX_TP_INVALID_EVENT        "NYXTP_INVALID_EVENT"
 #define MSGID_NYX_QMUX_TP_TOOMANY_ITEMS_ERR    "NYXTP_TOOMANY_ITEMS_ERR"
 #define MSGID_NYX_QMUX_TP_OUT_OF_MEMORY        "NYXTP_OUT_OF_MEM_ERR"
+#define MSGID_NYX_QMUX_TP_PERF                 "NYXTP_PERF"
+#define MSGID_NYX_QMUX_TP_TRACE_ERR            "NYXTP_TRACE_ERR"
+#define MSGID_NYX_QMUX_TP_REPLAY_ERR           "NYXTP_REPLAY_ERR"
+#define MSGID_NYX_QMUX_TP_RECORD_ERR           "NYXTP_RECORD_ERR"
+#define MSGID_NYX_QMUX_TP_RING_ERR             "NYXTP_RING_ERR"
 
 /** Keys */
 #define MSGID_NYX_QMUX_KEY_EVENT_ERR           "NYXKEY_EVENT_ERR"
 #define MSGID_NYX_QMUX_KEY_EVENT_READ_ERR      "NYXKEY_EVENT_READ_ERR"
 #define MSGID_NYX_QMUX_KEYS_OPEN_ERR           "NYXKEY_OPEN_ERR"
 #define MSGID_NYX_QMUX_KEY_OUT_OF_MEM          "NYXKEY_OUT_OF_MEM_ERR"
+#define MSGID_NYX_QMUX_KEY_KEYMAP_ERR          "NYXKEY_KEYMAP_ERR"
+#define MSGID_NYX_QMUX_KEY_PERF                "NYXKEY_PERF"
+#define MSGID_NYX_QMUX_KEY_TRACE_ERR           "NYXKEY_TRACE_ERR"
+#define MSGID_NYX_QMUX_KEY_REPLAY_ERR          "NYXKEY_REPLAY_ERR"
+#define MSGID_NYX_QMUX_KEY_RECORD_ERR          "NYXKEY_RECORD_ERR"
+#define MSGID_NYX_QMUX_KEY_RING_ERR            "NYXKEY_RING_ERR"
 
 /**Battery lib*/
 #define MSGID_NYX_QMUX_BAT_OPEN_ERR            "NYXBAT_OPEN_ERR"
@@ -53,10 +62,17 @@
 #define MSGID_NYX_QMUX_BAT_GET_CONTENT_ERR     "NYXBAT_GET_CONTENT_ERR"
 #define MSGID_NYX_QMUX_BAT_STRTOD_ERR          "NYXBAT_STRTOD_ERR"
 #define MSGID_NYX_QMUX_BAT_TOOMANY_ITEMS_ERR   "NYXBAT_TOOMANY_ITEMS_ERR"
+#define MSGID_NYX_QMUX_BAT_WATCH_ERR           "NYXBAT_WATCH_ERR"
+#define MSGID_NYX_QMUX_BAT_SEED_ERR            "NYXBAT_SEED_ERR"
+#define MSGID_NYX_QMUX_BAT_SIM_ERR             "NYXBAT_SIM_ERR"
+#define MSGID_NYX_QMUX_BAT_PERF                "NYXBAT_PERF"
 
 /**Charger lib*/
 #define MSGID_NYX_QMUX_CHARG_OPEN_ERR          "NYXCHG_OPEN_ERR"
 #define MSGID_NYX_QMUX_CHARG_OUT_OF_MEMORY     "NYXCHG_OUT_OF_MEM_ERR"
+#define MSGID_NYX_QMUX_CHARG_READ_ERR          "NYXCHG_READ_ERR"
+#define MSGID_NYX_QMUX_CHARG_WATCH_ERR         "NYXCHG_WATCH_ERR"
+#define MSGID_NYX_QMUX_CHARG_PERF              "NYXCHG_PERF"
 
 #endif // __NYX__MOD__QEMUX__MSGID_H__
 
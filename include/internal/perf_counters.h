@@ -0,0 +1,220 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file perf_counters.h
+ *
+ * @brief Cheap runtime counters describing what a module costs.
+ *
+ * Every module keeps one block, updated with relaxed atomics so it can be
+ * read from any thread while the event path runs. A block only ever
+ * written by one thread at a time (an input device) gets plain relaxed
+ * stores, one updated from several threads is marked shared and pays for
+ * atomic adds. Only every timing_period-th call is timed, so the clock is
+ * not read twice per event. The modules hand out a copy through their
+ * <prefix>_query_perf_counters() entry point and, if PERF_LOG_INTERVAL_ENV
+ * is set, log a summary every that many seconds.
+ */
+
+#ifndef __NYX__MOD__QEMUX__PERF_COUNTERS_H__
+#define __NYX__MOD__QEMUX__PERF_COUNTERS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Seconds between counter summaries in the log, unset or 0 for none */
+#define PERF_LOG_INTERVAL_ENV "NYX_PERF_LOG_INTERVAL"
+
+/* Timing period of the per-event paths */
+#define PERF_EVENT_TIMING_PERIOD    16
+
+/* Indices into the values handed out; new counters are only ever appended */
+typedef enum
+{
+	PERF_SYSCALLS,          /**< syscalls issued on the event path */
+	PERF_EVENTS_READ,       /**< raw input records (or status changes) taken in */
+	PERF_EVENTS_EMITTED,    /**< events (or notifications) handed to the caller */
+	PERF_EVENTS_DROPPED,    /**< input lost or deliberately merged away */
+	PERF_ALLOCS,            /**< heap allocations on the event path */
+	PERF_GESTURE_RUNS,      /**< gesture state machine invocations */
+	PERF_CALLS,             /**< get_event/query calls */
+	PERF_TIMED_CALLS,       /**< calls sampled for timing */
+	PERF_BUSY_NS,           /**< total time spent in the sampled calls */
+	PERF_MAX_NS,            /**< longest sampled call */
+	PERF_COUNTER_COUNT
+} perf_counter_t;
+
+typedef struct
+{
+	uint64_t values[PERF_COUNTER_COUNT];
+	bool shared;                /**< written from more than one thread */
+	unsigned int timing_mask;   /**< timing period - 1 */
+	uint64_t log_interval_ns;
+	uint64_t next_log_ns;
+} perf_counters_t;
+
+static inline uint64_t
+perf_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* timing_period must be a power of two, 1 times every call */
+static inline void
+perf_counters_init(perf_counters_t *c, bool shared, unsigned int timing_period)
+{
+	const char *interval = getenv(PERF_LOG_INTERVAL_ENV);
+
+	memset(c, 0, sizeof(*c));
+	c->shared = shared;
+	c->timing_mask = timing_period ? timing_period - 1 : 0;
+
+	if (interval)
+	{
+		c->log_interval_ns = strtoull(interval, NULL, 10) * 1000000000ULL;
+		c->next_log_ns = perf_now_ns() + c->log_interval_ns;
+	}
+}
+
+/* Returns the value before the addition */
+static inline uint64_t
+perf_add(perf_counters_t *c, perf_counter_t id, uint64_t n)
+{
+	uint64_t value;
+
+	if (c->shared)
+	{
+		return __atomic_fetch_add(&c->values[id], n, __ATOMIC_RELAXED);
+	}
+
+	value = __atomic_load_n(&c->values[id], __ATOMIC_RELAXED);
+	__atomic_store_n(&c->values[id], value + n, __ATOMIC_RELAXED);
+	return value;
+}
+
+/* c may be NULL for code that is shared with callers not keeping counters */
+static inline void
+perf_count(perf_counters_t *c, perf_counter_t id, uint64_t n)
+{
+	if (c)
+	{
+		perf_add(c, id, n);
+	}
+}
+
+/**
+ * @brief Count a call, and start timing it if it is sampled.
+ *
+ * @retval start time to hand to perf_call_done(), 0 if not sampled
+ */
+static inline uint64_t
+perf_call_begin(perf_counters_t *c)
+{
+	if (perf_add(c, PERF_CALLS, 1) & c->timing_mask)
+	{
+		return 0;
+	}
+
+	return perf_now_ns();
+}
+
+/**
+ * @brief Finish a call started with perf_call_begin().
+ *
+ * @retval true if a log summary is due, for exactly one caller per interval
+ */
+static inline bool
+perf_call_done(perf_counters_t *c, uint64_t start_ns)
+{
+	uint64_t now, elapsed, max, next;
+
+	if (0 == start_ns)
+	{
+		return false;
+	}
+
+	now = perf_now_ns();
+	elapsed = now - start_ns;
+	max = __atomic_load_n(&c->values[PERF_MAX_NS], __ATOMIC_RELAXED);
+
+	perf_add(c, PERF_TIMED_CALLS, 1);
+	perf_add(c, PERF_BUSY_NS, elapsed);
+
+	while (elapsed > max &&
+	        !__atomic_compare_exchange_n(&c->values[PERF_MAX_NS], &max, elapsed,
+	                                     true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (0 == c->log_interval_ns)
+	{
+		return false;
+	}
+
+	next = __atomic_load_n(&c->next_log_ns, __ATOMIC_RELAXED);
+
+	return now >= next &&
+	       __atomic_compare_exchange_n(&c->next_log_ns, &next,
+	                                   now + c->log_interval_ns, false,
+	                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Copy up to count values into values, returns how many were copied */
+static inline unsigned int
+perf_counters_read(const perf_counters_t *c, uint64_t *values,
+                   unsigned int count)
+{
+	unsigned int i;
+
+	if (count > PERF_COUNTER_COUNT)
+	{
+		count = PERF_COUNTER_COUNT;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		values[i] = __atomic_load_n(&c->values[i], __ATOMIC_RELAXED);
+	}
+
+	return count;
+}
+
+/* One line summary of a full set of values, for the log */
+static inline void
+perf_counters_format(const uint64_t *values, char *buf, size_t size)
+{
+	uint64_t timed = values[PERF_TIMED_CALLS];
+
+	snprintf(buf, size, "calls %llu (avg %llu ns, max %llu ns), syscalls %llu, "
+	         "events read %llu / emitted %llu / dropped %llu, allocs %llu, "
+	         "gesture runs %llu",
+	         (unsigned long long) values[PERF_CALLS],
+	         (unsigned long long)(timed ? values[PERF_BUSY_NS] / timed : 0),
+	         (unsigned long long) values[PERF_MAX_NS],
+	         (unsigned long long) values[PERF_SYSCALLS],
+	         (unsigned long long) values[PERF_EVENTS_READ],
+	         (unsigned long long) values[PERF_EVENTS_EMITTED],
+	         (unsigned long long) values[PERF_EVENTS_DROPPED],
+	         (unsigned long long) values[PERF_ALLOCS],
+	         (unsigned long long) values[PERF_GESTURE_RUNS]);
+}
+
+#endif // __NYX__MOD__QEMUX__PERF_COUNTERS_H__
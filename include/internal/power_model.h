@@ -0,0 +1,107 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file power_model.h
+ *
+ * @brief Power state shared between the battery and charger modules of one
+ * process.
+ *
+ * The modules are loaded as separate shared objects, so they cannot see
+ * each other's globals. The model is defined once, in power_model.c, which
+ * is built into a small shared library both modules link; the process
+ * then has a single copy of it. The state only lives as long as the
+ * process.
+ */
+
+#ifndef __NYX__MOD__QEMUX__POWER_MODEL_H__
+#define __NYX__MOD__QEMUX__POWER_MODEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct
+{
+	bool charging_disabled;     /**< set by charger_disable_charging() */
+	pthread_mutex_t lock;       /**< guards battery_notify_fd */
+	int battery_notify_fd;      /**< eventfd the battery module waits on, or -1 */
+} power_model_t;
+
+/* See power_model.c */
+extern power_model_t nyx_qemux86_power_model;
+
+/**
+ * @brief The power model of the current process.
+ *
+ * @retval model, never NULL
+ */
+static inline power_model_t *
+power_model_attach(void)
+{
+	return &nyx_qemux86_power_model;
+}
+
+static inline bool
+power_model_charging_enabled(const power_model_t *model)
+{
+	return NULL == model ||
+	       !__atomic_load_n(&model->charging_disabled, __ATOMIC_ACQUIRE);
+}
+
+/* Have power_model_set_charging() write to fd, -1 for no more wakeups */
+static inline void
+power_model_set_battery_notify(power_model_t *model, int fd)
+{
+	if (NULL == model)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&model->lock);
+	model->battery_notify_fd = fd;
+	pthread_mutex_unlock(&model->lock);
+}
+
+/**
+ * @brief Enable or disable charging and wake the battery module.
+ */
+static inline void
+power_model_set_charging(power_model_t *model, bool enable)
+{
+	uint64_t one = 1;
+
+	if (NULL == model)
+	{
+		return;
+	}
+
+	__atomic_store_n(&model->charging_disabled, !enable, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&model->lock);
+
+	if (model->battery_notify_fd >= 0)
+	{
+		/* A lost wakeup is picked up by the battery module's next refresh */
+		ssize_t ret = write(model->battery_notify_fd, &one, sizeof(one));
+		(void) ret;
+	}
+
+	pthread_mutex_unlock(&model->lock);
+}
+
+#endif // __NYX__MOD__QEMUX__POWER_MODEL_H__
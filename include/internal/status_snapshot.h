@@ -0,0 +1,136 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file status_snapshot.h
+ *
+ * @brief Seqlock publication of a module's status struct.
+ *
+ * Any number of threads can take a consistent copy of the status without
+ * blocking each other or the writer. Writers serialise among themselves
+ * (the modules hold their status lock) and bump seq before and after
+ * replacing the struct, so it is odd while an update is in progress.
+ * Readers copy the struct and retry until they saw the same even seq on
+ * both sides of the copy.
+ *
+ * Both copies go a word at a time through relaxed atomics, so a read that
+ * races an update is well defined, merely discarded. The struct has to be
+ * word aligned, which any struct holding an int is.
+ */
+
+#ifndef __NYX__MOD__QEMUX__STATUS_SNAPSHOT_H__
+#define __NYX__MOD__QEMUX__STATUS_SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+
+typedef uint32_t __attribute__((may_alias)) status_snapshot_word_t;
+
+typedef struct
+{
+	unsigned int seq;           /**< even when stable, see the file comment */
+} status_snapshot_t;
+
+/* Wait out an update; a writer preempted mid-update gets the CPU back */
+static inline void
+status_snapshot_relax(unsigned int *spins)
+{
+	if (++*spins % 128 == 0)
+	{
+		sched_yield();
+		return;
+	}
+
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/**
+ * @brief Copy a consistent version of the status at src into dst.
+ *
+ * @retval the version copied, it only changes when the status is published
+ */
+static inline unsigned int
+status_snapshot_read(const status_snapshot_t *s, void *dst, const void *src,
+                     size_t size)
+{
+	const status_snapshot_word_t *from = (const status_snapshot_word_t *) src;
+	status_snapshot_word_t *to = (status_snapshot_word_t *) dst;
+	size_t words = size / sizeof(*from);
+	unsigned int seq, spins = 0;
+	size_t i;
+
+	for (;;)
+	{
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+		{
+			status_snapshot_relax(&spins);
+			continue;
+		}
+
+		for (i = 0; i < words; i++)
+		{
+			to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		}
+
+		for (i = words * sizeof(*from); i < size; i++)
+		{
+			((unsigned char *) dst)[i] =
+			    __atomic_load_n((const unsigned char *) src + i, __ATOMIC_RELAXED);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (seq == __atomic_load_n(&s->seq, __ATOMIC_RELAXED))
+		{
+			return seq >> 1;
+		}
+	}
+}
+
+/* Replace the status at dst with status, with the writers' lock held */
+static inline void
+status_snapshot_publish(status_snapshot_t *s, void *dst, const void *status,
+                        size_t size)
+{
+	const status_snapshot_word_t *from = (const status_snapshot_word_t *) status;
+	status_snapshot_word_t *to = (status_snapshot_word_t *) dst;
+	size_t words = size / sizeof(*from);
+	unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	size_t i;
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < words; i++)
+	{
+		__atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+	}
+
+	for (i = words * sizeof(*from); i < size; i++)
+	{
+		__atomic_store_n((unsigned char *) dst + i,
+		                 ((const unsigned char *) status)[i], __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#endif // __NYX__MOD__QEMUX__STATUS_SNAPSHOT_H__
@@ -27,11 +27,20 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 
 #include <nyx/nyx_module.h>
 #include <nyx/module/nyx_utils.h>
 #include <nyx/module/nyx_log.h>
 #include "msgid.h"
+#include "perf_counters.h"
+#include "callback_relay.h"
+#include "power_model.h"
+#include "status_snapshot.h"
 
 #define SYSFS_DEVICE "/tmp/powerd/fake/battery/"
 
@@ -45,6 +54,101 @@
 #define   BATTERY_COULOMB   "getcoulomb"
 #define   BATTERY_AGE   "getage"
 
+/* Bit positions of the attribute files in a refresh mask */
+enum
+{
+	BATTERY_ATTR_PERCENT = 0,
+	BATTERY_ATTR_TEMPERATURE,
+	BATTERY_ATTR_VOLTS,
+	BATTERY_ATTR_CURRENT,
+	BATTERY_ATTR_AVG_CURRENT,
+	BATTERY_ATTR_FULL_40,
+	BATTERY_ATTR_RAW_COULOMB,
+	BATTERY_ATTR_COULOMB,
+	BATTERY_ATTR_AGE,
+	BATTERY_ATTR_COUNT
+};
+
+#define BATTERY_ATTR_ALL    ((1u << BATTERY_ATTR_COUNT) - 1)
+
+static const char *const battery_attr_files[BATTERY_ATTR_COUNT] =
+{
+	[BATTERY_ATTR_PERCENT] = BATTERY_PERCENT,
+	[BATTERY_ATTR_TEMPERATURE] = BATTERY_TEMPERATURE,
+	[BATTERY_ATTR_VOLTS] = BATTERY_VOLTS,
+	[BATTERY_ATTR_CURRENT] = BATTERY_CURRENT,
+	[BATTERY_ATTR_AVG_CURRENT] = BATTERY_AVG_CURRENT,
+	[BATTERY_ATTR_FULL_40] = BATTERY_FULL_40,
+	[BATTERY_ATTR_RAW_COULOMB] = BATTERY_RAW_COULOMB,
+	[BATTERY_ATTR_COULOMB] = BATTERY_COULOMB,
+	[BATTERY_ATTR_AGE] = BATTERY_AGE,
+};
+
+/*
+ * Values the fake battery directory is seeded with when an attribute file
+ * is missing. They can be overridden from FAKE_BATTERY_PROFILE, a file of
+ * "<attribute>=<value>" lines such as "getpercent=20"; '#' starts a comment.
+ */
+static const char *const battery_attr_defaults[BATTERY_ATTR_COUNT] =
+{
+	[BATTERY_ATTR_PERCENT] = "66",
+	[BATTERY_ATTR_TEMPERATURE] = "38",
+	[BATTERY_ATTR_VOLTS] = "3928400",
+	[BATTERY_ATTR_CURRENT] = "85703",
+	[BATTERY_ATTR_AVG_CURRENT] = "85703",
+	[BATTERY_ATTR_FULL_40] = "1150.000",
+	[BATTERY_ATTR_RAW_COULOMB] = "761.250",
+	[BATTERY_ATTR_COULOMB] = "748.800",
+	[BATTERY_ATTR_AGE] = "99.21875",
+};
+
+#ifndef FAKE_BATTERY_PROFILE
+#define FAKE_BATTERY_PROFILE "/etc/fake_battery_values.conf"
+#endif
+
+/*
+ * If set, names a script (e.g. fake_battery_values.sh) that is run instead
+ * of the built-in seeding, as was done unconditionally in the past.
+ */
+#define FAKE_BATTERY_SCRIPT_ENV "NYX_FAKE_BATTERY_SCRIPT"
+
+/*
+ * Fake mode runs an in-module simulator instead of following the files.
+ * Every tick_ms it advances the battery by tick_ms * acceleration of
+ * simulated time at a constant current, deriving the voltage from a
+ * piecewise linear percentage -> mV curve. All of it can be set from
+ * FAKE_BATTERY_PROFILE with the keys sim_tick_ms, sim_acceleration,
+ * sim_current_ma (negative while discharging), sim_ambient_temp and
+ * sim_curve ("<percent>:<mV>,..." in increasing percentage order).
+ */
+#define BATTERY_SIM_MAX_POINTS  16
+
+typedef struct
+{
+	int tick_ms;
+	double acceleration;
+	int current_ma;
+	int ambient_temp_c;
+	int curve_len;
+	int curve_percent[BATTERY_SIM_MAX_POINTS];
+	int curve_mv[BATTERY_SIM_MAX_POINTS];
+} battery_sim_config_t;
+
+static battery_sim_config_t battery_sim_config =
+{
+	.tick_ms = 1000,
+	.acceleration = 1.0,
+	.current_ma = -850,
+	.ambient_temp_c = 30,
+	.curve_len = 6,
+	.curve_percent = { 0, 5, 20, 50, 90, 100 },
+	.curve_mv = { 3300, 3600, 3700, 3800, 4100, 4200 },
+};
+
+static pthread_t battery_sim_thread;
+static bool battery_sim_running = false;
+static int battery_sim_stop_fd = -1;
+
 #define CHARGE_MIN_TEMPERATURE_C 0
 #define CHARGE_MAX_TEMPERATURE_C 57
 #define BATTERY_MAX_TEMPERATURE_C  60
@@ -53,36 +157,182 @@ nyx_device_t *nyxDev = NULL;
 nyx_battery_ctia_t battery_ctia_params;
 nyx_battery_status_t fake_battery_status;
 
-void *battery_callback_context = NULL;
-nyx_device_callback_function_t battery_callback = NULL;
+/* Status callback, delivered on the registering thread's main context */
+static callback_relay_t battery_callback = CALLBACK_RELAY_INIT;
+
+/*
+ * fake_battery_status is published through battery_status_snapshot (see
+ * status_snapshot.h), so queries never block. Writers serialise on
+ * battery_status_lock.
+ */
+static pthread_mutex_t battery_status_lock = PTHREAD_MUTEX_INITIALIZER;
+static status_snapshot_t battery_status_snapshot;
+
+/*
+ * Wakeup thresholds registered through battery_set_wakeup_percentage().
+ * While any are set, battery_callback only fires when the percentage drops
+ * to a threshold; a threshold re-arms once the percentage has climbed
+ * BATTERY_WAKEUP_HYSTERESIS above it again. Protected by battery_status_lock.
+ */
+#define BATTERY_WAKEUP_MAX         8
+#define BATTERY_WAKEUP_HYSTERESIS  2
+
+typedef struct
+{
+	int percentage;
+	bool armed;
+} battery_wakeup_t;
+
+static battery_wakeup_t battery_wakeup[BATTERY_WAKEUP_MAX];
+static int battery_wakeup_count = 0;
+
+/* inotify watch on SYSFS_DEVICE, see battery_watch_start() */
+static pthread_t battery_watch_thread;
+static bool battery_watch_running = false;
+static int battery_inotify_fd = -1;
+static int battery_watch_stop_fd = -1;
+
+/* Charging gate shared with the charger module, see power_model.h */
+static power_model_t *battery_power_model = NULL;
+static int battery_power_fd = -1;
+
+/* see battery_query_perf_counters() */
+static perf_counters_t battery_perf;
 
 NYX_DECLARE_MODULE(NYX_DEVICE_BATTERY, "Main");
 
-int FileGetDouble(const char *path, double *ret_data)
+/*
+ * The attribute files are opened once, relative to SYSFS_DEVICE, and kept
+ * open; every refresh is a single pread() into a small stack buffer.
+ * A file replaced by rename gets its descriptor dropped and reopened.
+ */
+#define BATTERY_ATTR_BUF_SIZE   64
+
+static int battery_dir_fd = -1;
+static int battery_attr_fds[BATTERY_ATTR_COUNT];
+
+static void battery_attr_close(unsigned int mask)
 {
-	GError *gerror = NULL;
-	char *contents = NULL;
-	char *endptr;
-	gsize len;
-	float val;
+	int i;
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		if ((mask & (1u << i)) && battery_attr_fds[i] >= 0)
+		{
+			close(battery_attr_fds[i]);
+			battery_attr_fds[i] = -1;
+		}
+	}
+}
+
+static void battery_attr_init(void)
+{
+	int i;
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		battery_attr_fds[i] = -1;
+	}
+
+	battery_dir_fd = open(SYSFS_DEVICE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (battery_dir_fd < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_GET_CONTENT_ERR, 0, "Failed to open %s",
+		          SYSFS_DEVICE);
+	}
+}
+
+static void battery_attr_deinit(void)
+{
+	battery_attr_close(BATTERY_ATTR_ALL);
+
+	if (battery_dir_fd >= 0)
+	{
+		close(battery_dir_fd);
+		battery_dir_fd = -1;
+	}
+}
 
-	if (!path || !g_file_get_contents(path, &contents, &len, &gerror))
+/* Read an attribute file into buf as a NUL terminated string */
+static int battery_attr_read(int attr, char *buf, size_t size)
+{
+	ssize_t len;
+
+	if (battery_attr_fds[attr] < 0)
 	{
-		if (gerror)
+		if (battery_dir_fd < 0)
+		{
+			return -1;
+		}
+
+		battery_attr_fds[attr] = openat(battery_dir_fd, battery_attr_files[attr],
+		                                O_RDONLY | O_CLOEXEC);
+		perf_count(&battery_perf, PERF_SYSCALLS, 1);
+
+		if (battery_attr_fds[attr] < 0)
 		{
-			nyx_error(MSGID_NYX_QMUX_BAT_GET_CONTENT_ERR, 0, "%s",gerror->message);
-			g_error_free(gerror);
+			return -1;
 		}
+	}
+
+	len = pread(battery_attr_fds[attr], buf, size - 1, 0);
+	perf_count(&battery_perf, PERF_SYSCALLS, 1);
+
+	if (len <= 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_GET_CONTENT_ERR, 0, "Failed to read %s",
+		          battery_attr_files[attr]);
+		battery_attr_close(1u << attr);
+		return -1;
+	}
+
+	buf[len] = '\0';
+	return 0;
+}
+
+/* Same contract as nyx_utils_read_value(): -1 on failure */
+static int battery_attr_read_value(int attr)
+{
+	char buf[BATTERY_ATTR_BUF_SIZE];
+	char *endptr;
+	long val;
+
+	if (battery_attr_read(attr, buf, sizeof(buf)))
+	{
+		return -1;
+	}
+
+	val = strtol(buf, &endptr, 10);
+
+	if (endptr == buf)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_STRTOD_ERR, 0, "Invalid input in %s.",
+		          battery_attr_files[attr]);
+		return -1;
+	}
+
+	return (int) val;
+}
+
+static int battery_attr_read_double(int attr, double *ret_data)
+{
+	char buf[BATTERY_ATTR_BUF_SIZE];
+	char *endptr;
+	double val;
 
+	if (battery_attr_read(attr, buf, sizeof(buf)))
+	{
 		return -1;
 	}
 
-	val = strtod(contents, &endptr);
+	val = strtod(buf, &endptr);
 
-	if (endptr == contents)
+	if (endptr == buf)
 	{
-		nyx_error(MSGID_NYX_QMUX_BAT_STRTOD_ERR, 0, "Invalid input in %s.", path);
-		goto end;
+		nyx_error(MSGID_NYX_QMUX_BAT_STRTOD_ERR, 0, "Invalid input in %s.",
+		          battery_attr_files[attr]);
+		return -1;
 	}
 
 	if (ret_data)
@@ -90,8 +340,6 @@ int FileGetDouble(const char *path, double *ret_data)
 		*ret_data = val;
 	}
 
-end:
-	g_free(contents);
 	return 0;
 }
 
@@ -103,7 +351,7 @@ end:
 int battery_percent(void)
 {
 	int val;
-	val = nyx_utils_read_value(SYSFS_DEVICE BATTERY_PERCENT);
+	val = battery_attr_read_value(BATTERY_ATTR_PERCENT);
 
 	if (val < 0)
 	{
@@ -120,7 +368,7 @@ int battery_percent(void)
 int battery_temperature(void)
 {
 	int val;
-	val = nyx_utils_read_value(SYSFS_DEVICE BATTERY_TEMPERATURE);
+	val = battery_attr_read_value(BATTERY_ATTR_TEMPERATURE);
 
 	if (val < 0)
 	{
@@ -140,7 +388,7 @@ int battery_voltage(void)
 {
 	int val = 0;
 
-	val = nyx_utils_read_value(SYSFS_DEVICE BATTERY_VOLTS);
+	val = battery_attr_read_value(BATTERY_ATTR_VOLTS);
 
 	if (val < 0)
 	{
@@ -160,7 +408,7 @@ int battery_current(void)
 {
 	int val = 0;
 
-	val = nyx_utils_read_value(SYSFS_DEVICE BATTERY_CURRENT);
+	val = battery_attr_read_value(BATTERY_ATTR_CURRENT);
 
 	if (val < 0)
 	{
@@ -181,7 +429,7 @@ int battery_avg_current(void)
 {
 	int val = 0;
 
-	val = nyx_utils_read_value(SYSFS_DEVICE BATTERY_AVG_CURRENT);
+	val = battery_attr_read_value(BATTERY_ATTR_AVG_CURRENT);
 
 	if (val < 0)
 	{
@@ -201,7 +449,7 @@ double battery_full40(void)
 {
 	double val;
 
-	if (FileGetDouble(SYSFS_DEVICE BATTERY_FULL_40, &val))
+	if (battery_attr_read_double(BATTERY_ATTR_FULL_40, &val))
 	{
 		return -1;
 	}
@@ -219,7 +467,7 @@ double battery_rawcoulomb(void)
 {
 	double val;
 
-	if (FileGetDouble(SYSFS_DEVICE BATTERY_RAW_COULOMB, &val))
+	if (battery_attr_read_double(BATTERY_ATTR_RAW_COULOMB, &val))
 	{
 		return -1;
 	}
@@ -238,7 +486,7 @@ double battery_coulomb(void)
 	double val;
 	int ret;
 
-	ret = FileGetDouble(SYSFS_DEVICE BATTERY_COULOMB, &val);
+	ret = battery_attr_read_double(BATTERY_ATTR_COULOMB, &val);
 
 	if (ret)
 	{
@@ -257,7 +505,7 @@ double battery_age(void)
 {
 	double val;
 
-	if (FileGetDouble(SYSFS_DEVICE BATTERY_AGE, &val))
+	if (battery_attr_read_double(BATTERY_ATTR_AGE, &val))
 	{
 		return -1;
 	}
@@ -272,35 +520,687 @@ bool battery_is_present(void)
 	return (voltage > 0);
 }
 
-nyx_error_t battery_init(void)
+static void battery_read_status(nyx_battery_status_t *status)
+{
+	status_snapshot_read(&battery_status_snapshot, status, &fake_battery_status,
+	                     sizeof(nyx_battery_status_t));
+}
+
+/* Must be called with battery_status_lock held */
+static void battery_publish_status(const nyx_battery_status_t *status)
+{
+	status_snapshot_publish(&battery_status_snapshot, &fake_battery_status, status,
+	                        sizeof(nyx_battery_status_t));
+}
+
+/**
+ * @brief Update the wakeup thresholds for a new percentage
+ *
+ * Must be called with battery_status_lock held.
+ *
+ * @retval true if any armed threshold was crossed
+ */
+static bool battery_wakeup_check(int percentage)
+{
+	bool crossed = false;
+	int i;
+
+	for (i = 0; i < battery_wakeup_count; i++)
+	{
+		battery_wakeup_t *wakeup = &battery_wakeup[i];
+
+		if (wakeup->armed && percentage <= wakeup->percentage)
+		{
+			wakeup->armed = false;
+			crossed = true;
+		}
+		else if (!wakeup->armed &&
+		         percentage >= wakeup->percentage + BATTERY_WAKEUP_HYSTERESIS)
+		{
+			wakeup->armed = true;
+		}
+	}
+
+	return crossed;
+}
+
+/*
+ * Whether a status that was just published should be reported through
+ * battery_callback. Must be called with battery_status_lock held.
+ */
+static bool battery_should_notify(const nyx_battery_status_t *status)
+{
+	if (0 == battery_wakeup_count)
+	{
+		return true;
+	}
+
+	return battery_wakeup_check(status->percentage);
+}
+
+/**
+ * @brief Re-read the attribute files selected by mask and publish the result
+ *
+ * @retval true if the published status changed and should be reported
+ */
+static bool battery_refresh_status(unsigned int mask)
+{
+	nyx_battery_status_t status;
+	bool changed;
+
+	pthread_mutex_lock(&battery_status_lock);
+	memcpy(&status, &fake_battery_status, sizeof(nyx_battery_status_t));
+
+	if (mask & (1u << BATTERY_ATTR_PERCENT))
+	{
+		status.percentage = battery_percent();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_TEMPERATURE))
+	{
+		status.temperature = battery_temperature();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_VOLTS))
+	{
+		status.voltage = battery_voltage();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_CURRENT))
+	{
+		status.current = battery_current();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_AVG_CURRENT))
+	{
+		status.avg_current = battery_avg_current();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_COULOMB))
+	{
+		status.capacity = battery_coulomb();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_RAW_COULOMB))
+	{
+		status.capacity_raw = battery_rawcoulomb();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_FULL_40))
+	{
+		status.capacity_full40 = battery_full40();
+	}
+
+	if (mask & (1u << BATTERY_ATTR_AGE))
+	{
+		status.age = battery_age();
+	}
+
+	/* The charger module can switch charging off without touching the files */
+	if (!power_model_charging_enabled(battery_power_model))
+	{
+		status.current = MIN(status.current, 0);
+		status.avg_current = MIN(status.avg_current, 0);
+	}
+
+	status.present = (status.voltage > 0);
+	status.charging = status.present && (status.avg_current > 0);
+
+	changed = (0 != memcmp(&status, &fake_battery_status,
+	                       sizeof(nyx_battery_status_t)));
+
+	if (changed)
+	{
+		battery_publish_status(&status);
+		changed = battery_should_notify(&status);
+	}
+
+	pthread_mutex_unlock(&battery_status_lock);
+
+	return changed;
+}
+
+/* Report a new status through battery_callback, if anyone registered one */
+static void battery_notify(void)
+{
+	if (callback_relay_post(&battery_callback, nyxDev))
+	{
+		perf_count(&battery_perf, PERF_EVENTS_EMITTED, 1);
+	}
+}
+
+static unsigned int battery_attr_mask(const char *name)
+{
+	int i;
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		if (0 == strcmp(name, battery_attr_files[i]))
+		{
+			return 1u << i;
+		}
+	}
+
+	return 0;
+}
+
+static void *battery_watch(void *unused)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[3];
+
+	fds[0].fd = battery_inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = battery_watch_stop_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = battery_power_fd;
+	fds[2].events = POLLIN;
+
+	for (;;)
+	{
+		unsigned int changed = 0, replaced = 0;
+		ssize_t len;
+
+		perf_count(&battery_perf, PERF_SYSCALLS, 1);
+
+		if (poll(fds, 3, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			break;
+		}
+
+		if (fds[1].revents)
+		{
+			break;
+		}
+
+		/* Drain everything queued so one batch of writes fires one callback */
+		while ((len = read(battery_inotify_fd, buf, sizeof(buf))) > 0)
+		{
+			char *p = buf;
+
+			perf_count(&battery_perf, PERF_SYSCALLS, 1);
+
+			while (p < buf + len)
+			{
+				const struct inotify_event *event = (const struct inotify_event *) p;
+
+				perf_count(&battery_perf, PERF_EVENTS_READ, 1);
+
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					perf_count(&battery_perf, PERF_EVENTS_DROPPED, 1);
+					changed = BATTERY_ATTR_ALL;
+					replaced = BATTERY_ATTR_ALL;
+				}
+				else if (event->len)
+				{
+					changed |= battery_attr_mask(event->name);
+
+					if (event->mask & IN_MOVED_TO)
+					{
+						replaced |= battery_attr_mask(event->name);
+					}
+				}
+
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+
+		/* Charging was switched on or off, re-apply the gate to the currents */
+		if (fds[2].revents & POLLIN)
+		{
+			uint64_t count;
+
+			if (read(battery_power_fd, &count, sizeof(count)) == sizeof(count))
+			{
+				changed |= (1u << BATTERY_ATTR_CURRENT) | (1u << BATTERY_ATTR_AVG_CURRENT);
+			}
+		}
+
+		if (replaced)
+		{
+			pthread_mutex_lock(&battery_status_lock);
+			battery_attr_close(replaced);
+			pthread_mutex_unlock(&battery_status_lock);
+		}
+
+		/* The simulator owns the status while fake mode is on */
+		if (__atomic_load_n(&battery_sim_running, __ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+
+		if (changed && battery_refresh_status(changed))
+		{
+			battery_notify();
+		}
+	}
+
+	return NULL;
+}
+
+static void battery_watch_stop(void)
+{
+	if (battery_watch_running)
+	{
+		uint64_t one = 1;
+
+		if (write(battery_watch_stop_fd, &one, sizeof(one)) == sizeof(one))
+		{
+			pthread_join(battery_watch_thread, NULL);
+		}
+
+		battery_watch_running = false;
+	}
+
+	if (battery_watch_stop_fd >= 0)
+	{
+		close(battery_watch_stop_fd);
+		battery_watch_stop_fd = -1;
+	}
+
+	if (battery_inotify_fd >= 0)
+	{
+		close(battery_inotify_fd);
+		battery_inotify_fd = -1;
+	}
+
+	if (battery_power_fd >= 0)
+	{
+		power_model_set_battery_notify(battery_power_model, -1);
+		close(battery_power_fd);
+		battery_power_fd = -1;
+	}
+}
+
+/*
+ * Watch the fake battery directory so that scripted writes to the attribute
+ * files show up in fake_battery_status without reopening the module.
+ */
+static void battery_watch_start(void)
+{
+	battery_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	battery_watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+	battery_power_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (battery_inotify_fd < 0 || battery_watch_stop_fd < 0 ||
+	        battery_power_fd < 0 ||
+	        inotify_add_watch(battery_inotify_fd, SYSFS_DEVICE,
+	                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+	        pthread_create(&battery_watch_thread, NULL, battery_watch, NULL) != 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_WATCH_ERR, 0,
+		          "Failed to watch %s, battery status will not be refreshed", SYSFS_DEVICE);
+		battery_watch_stop();
+		return;
+	}
+
+	battery_watch_running = true;
+	power_model_set_battery_notify(battery_power_model, battery_power_fd);
+}
+
+static int battery_attr_index(const char *name)
+{
+	int i;
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		if (0 == strcmp(name, battery_attr_files[i]))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void battery_parse_sim_curve(char *spec)
+{
+	char *point, *saveptr = NULL;
+	int len = 0;
+
+	for (point = strtok_r(spec, ",", &saveptr);
+	        point && len < BATTERY_SIM_MAX_POINTS;
+	        point = strtok_r(NULL, ",", &saveptr))
+	{
+		int percent, mv;
+
+		if (sscanf(point, "%d:%d", &percent, &mv) != 2 ||
+		        (len && percent <= battery_sim_config.curve_percent[len - 1]))
+		{
+			nyx_error(MSGID_NYX_QMUX_BAT_SEED_ERR, 0, "Ignoring invalid sim_curve");
+			return;
+		}
+
+		battery_sim_config.curve_percent[len] = percent;
+		battery_sim_config.curve_mv[len] = mv;
+		len++;
+	}
+
+	if (len >= 2)
+	{
+		battery_sim_config.curve_len = len;
+	}
+}
+
+static void battery_parse_sim_key(const char *key, char *value)
+{
+	if (0 == strcmp(key, "sim_tick_ms"))
+	{
+		battery_sim_config.tick_ms = MAX(atoi(value), 1);
+	}
+	else if (0 == strcmp(key, "sim_acceleration"))
+	{
+		battery_sim_config.acceleration = MAX(strtod(value, NULL), 0.0);
+	}
+	else if (0 == strcmp(key, "sim_current_ma"))
+	{
+		battery_sim_config.current_ma = atoi(value);
+	}
+	else if (0 == strcmp(key, "sim_ambient_temp"))
+	{
+		battery_sim_config.ambient_temp_c = atoi(value);
+	}
+	else if (0 == strcmp(key, "sim_curve"))
+	{
+		battery_parse_sim_curve(value);
+	}
+}
+
+/*
+ * Override the seed values and the simulator settings with whatever
+ * FAKE_BATTERY_PROFILE provides
+ */
+static void battery_load_profile(char values[][BATTERY_ATTR_BUF_SIZE])
+{
+	char line[256];
+	FILE *profile = fopen(FAKE_BATTERY_PROFILE, "r");
+
+	if (NULL == profile)
+	{
+		return;
+	}
+
+	while (fgets(line, sizeof(line), profile))
+	{
+		char *value = strchr(line, '=');
+		char *key;
+		int attr;
+
+		if (line[0] == '#' || NULL == value)
+		{
+			continue;
+		}
+
+		*value++ = '\0';
+		key = g_strstrip(line);
+		value = g_strstrip(value);
+		attr = battery_attr_index(key);
+
+		if (attr >= 0)
+		{
+			g_strlcpy(values[attr], value, BATTERY_ATTR_BUF_SIZE);
+		}
+		else
+		{
+			battery_parse_sim_key(key, value);
+		}
+	}
+
+	fclose(profile);
+}
+
+/*
+ * Create the fake battery directory and any attribute file that does not
+ * exist yet, leaving values written by test harnesses untouched.
+ */
+static int battery_seed_fake_values(char values[][BATTERY_ATTR_BUF_SIZE])
+{
+	int i, dir_fd;
+
+	if (g_mkdir_with_parents(SYSFS_DEVICE, 0755) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_SEED_ERR, 0, "Failed to create %s",
+		          SYSFS_DEVICE);
+		return -1;
+	}
+
+	dir_fd = open(SYSFS_DEVICE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dir_fd < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_SEED_ERR, 0, "Failed to open %s",
+		          SYSFS_DEVICE);
+		return -1;
+	}
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		int fd = openat(dir_fd, battery_attr_files[i],
+		                O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+		if (fd < 0)
+		{
+			if (errno != EEXIST)
+			{
+				nyx_error(MSGID_NYX_QMUX_BAT_SEED_ERR, 0, "Failed to create %s",
+				          battery_attr_files[i]);
+			}
+
+			continue;
+		}
+
+		if (dprintf(fd, "%s\n", values[i]) < 0)
+		{
+			nyx_error(MSGID_NYX_QMUX_BAT_SEED_ERR, 0, "Failed to write %s",
+			          battery_attr_files[i]);
+		}
+
+		close(fd);
+	}
+
+	close(dir_fd);
+	return 0;
+}
+
+/* Voltage in mV for a state of charge, interpolated on the sim curve */
+static int battery_sim_voltage(double percent)
+{
+	const battery_sim_config_t *cfg = &battery_sim_config;
+	int i;
+
+	if (percent <= cfg->curve_percent[0])
+	{
+		return cfg->curve_mv[0];
+	}
+
+	for (i = 1; i < cfg->curve_len; i++)
+	{
+		if (percent <= cfg->curve_percent[i])
+		{
+			double span = cfg->curve_percent[i] - cfg->curve_percent[i - 1];
+			double frac = (percent - cfg->curve_percent[i - 1]) / span;
+
+			return cfg->curve_mv[i - 1] +
+			       (int)(frac * (cfg->curve_mv[i] - cfg->curve_mv[i - 1]));
+		}
+	}
+
+	return cfg->curve_mv[cfg->curve_len - 1];
+}
+
+/**
+ * @brief Advance a battery status by hours of simulated time
+ *
+ * The status capacity fields are floats, so the charge is carried in
+ * *coulomb across ticks to avoid losing small increments.
+ */
+static void battery_sim_step(nyx_battery_status_t *status, double *coulomb,
+                             double hours)
+{
+	const battery_sim_config_t *cfg = &battery_sim_config;
+	double full = status->capacity_full40 > 0 ? status->capacity_full40 : 1150.0;
+	int current = cfg->current_ma;
+	double percent;
+	double target_temp;
+
+	if (!power_model_charging_enabled(battery_power_model))
+	{
+		current = MIN(current, 0);
+	}
+
+	*coulomb += current * hours;
+
+	if (*coulomb <= 0)
+	{
+		*coulomb = 0;
+		current = MAX(current, 0);
+	}
+	else if (*coulomb >= full)
+	{
+		*coulomb = full;
+		current = MIN(current, 0);
+	}
+
+	percent = *coulomb * 100.0 / full;
+
+	status->present = true;
+	status->capacity_full40 = full;
+	status->capacity = *coulomb;
+	status->capacity_raw = *coulomb;
+	status->percentage = (int)(percent + 0.5);
+	status->voltage = battery_sim_voltage(percent);
+	status->current = current;
+	status->avg_current = current;
+	status->charging = (current > 0);
+
+	/* Drift towards a temperature that rises with the load */
+	target_temp = cfg->ambient_temp_c + abs(current) / 100.0;
+	status->temperature += (int)((target_temp - status->temperature) / 4);
+}
+
+static void *battery_sim(void *unused)
 {
-        int result = system("sh /usr/sbin/fake_battery_values.sh");
-	if (result)
+	struct pollfd fds[1];
+	nyx_battery_status_t status;
+	double coulomb;
+	bool notify;
+
+	battery_read_status(&status);
+	coulomb = status.capacity;
+
+	fds[0].fd = battery_sim_stop_fd;
+	fds[0].events = POLLIN;
+
+	for (;;)
+	{
+		int ret = poll(fds, 1, battery_sim_config.tick_ms);
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret != 0)
+		{
+			break;
+		}
+
+		battery_sim_step(&status, &coulomb,
+		                 battery_sim_config.tick_ms * battery_sim_config.acceleration /
+		                 3600000.0);
+
+		pthread_mutex_lock(&battery_status_lock);
+		battery_publish_status(&status);
+		notify = battery_should_notify(&status);
+		pthread_mutex_unlock(&battery_status_lock);
+
+		if (notify)
+		{
+			battery_notify();
+		}
+	}
+
+	return NULL;
+}
+
+static void battery_sim_stop(void)
+{
+	if (battery_sim_running)
+	{
+		uint64_t one = 1;
+
+		if (write(battery_sim_stop_fd, &one, sizeof(one)) == sizeof(one))
+		{
+			pthread_join(battery_sim_thread, NULL);
+		}
+
+		__atomic_store_n(&battery_sim_running, false, __ATOMIC_RELEASE);
+	}
+
+	if (battery_sim_stop_fd >= 0)
+	{
+		close(battery_sim_stop_fd);
+		battery_sim_stop_fd = -1;
+	}
+}
+
+static nyx_error_t battery_sim_start(void)
+{
+	battery_sim_stop_fd = eventfd(0, EFD_CLOEXEC);
+
+	if (battery_sim_stop_fd < 0 ||
+	        pthread_create(&battery_sim_thread, NULL, battery_sim, NULL) != 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_BAT_SIM_ERR, 0, "Failed to start battery simulator");
+		battery_sim_stop();
 		return NYX_ERROR_GENERIC;
+	}
+
+	__atomic_store_n(&battery_sim_running, true, __ATOMIC_RELEASE);
+	return NYX_ERROR_NONE;
+}
+
+nyx_error_t battery_init(void)
+{
+	char values[BATTERY_ATTR_COUNT][BATTERY_ATTR_BUF_SIZE];
+	const char *script = getenv(FAKE_BATTERY_SCRIPT_ENV);
+	int i;
+
+	for (i = 0; i < BATTERY_ATTR_COUNT; i++)
+	{
+		g_strlcpy(values[i], battery_attr_defaults[i], BATTERY_ATTR_BUF_SIZE);
+	}
 
-  	fake_battery_status.present = battery_is_present();
+	battery_load_profile(values);
 
-	if (fake_battery_status.present)
+	if (script)
 	{
-		fake_battery_status.percentage = battery_percent();
-		fake_battery_status.temperature = battery_temperature();
-		fake_battery_status.voltage = battery_voltage();
-		fake_battery_status.current = battery_current();
-		fake_battery_status.avg_current = battery_avg_current();
-		fake_battery_status.capacity = battery_coulomb();
-		fake_battery_status.capacity_raw = battery_rawcoulomb();
-		fake_battery_status.capacity_full40 = battery_full40();
-		fake_battery_status.age = battery_age();
+		gchar *command = g_strdup_printf("sh %s", script);
+		int result = system(command);
 
-		if (fake_battery_status.avg_current >  0)
+		g_free(command);
+
+		if (result)
 		{
-			fake_battery_status.charging = true;
+			return NYX_ERROR_GENERIC;
 		}
 	}
-	else
+	else if (battery_seed_fake_values(values) < 0)
 	{
-		fake_battery_status.charging = false;
+		return NYX_ERROR_GENERIC;
 	}
+
+	battery_power_model = power_model_attach();
+
+	battery_attr_init();
+	battery_refresh_status(BATTERY_ATTR_ALL);
+
 	return NYX_ERROR_NONE;
 }
 
@@ -327,6 +1227,8 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 		return NYX_ERROR_OUT_OF_MEMORY;
 	}
 
+	perf_counters_init(&battery_perf, true, PERF_EVENT_TIMING_PERIOD);
+
 	nyx_module_register_method(i, (nyx_device_t *)nyxDev,
 	                           NYX_BATTERY_QUERY_BATTERY_STATUS_MODULE_METHOD,
 	                           "battery_query_battery_status");
@@ -362,6 +1264,10 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 		free(nyxDev);
 		nyxDev = NULL;
 	}
+	else
+	{
+		battery_watch_start();
+	}
 
 	*d = (nyx_device_t *)nyxDev;
 	return result;
@@ -378,6 +1284,12 @@ nyx_error_t nyx_module_close(nyx_device_t *d)
 
 	if (NULL != nyxDev)
 	{
+		battery_sim_stop();
+		battery_watch_stop();
+		callback_relay_clear(&battery_callback);
+		battery_attr_deinit();
+		battery_power_model = NULL;
+		battery_wakeup_count = 0;
 		free(nyxDev);
 		nyxDev = NULL;
 	}
@@ -408,11 +1320,57 @@ nyx_error_t battery_query_battery_status(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	memcpy(status, &fake_battery_status, sizeof(nyx_battery_status_t));
+	uint64_t start = perf_call_begin(&battery_perf);
+
+	battery_read_status(status);
+
+	if (perf_call_done(&battery_perf, start))
+	{
+		char summary[256];
+		uint64_t values[PERF_COUNTER_COUNT];
+
+		perf_counters_read(&battery_perf, values, PERF_COUNTER_COUNT);
+		perf_counters_format(values, summary, sizeof(summary));
+		nyx_info(MSGID_NYX_QMUX_BAT_PERF, 0, "Battery: %s", summary);
+	}
+
+	return NYX_ERROR_NONE;
+}
+
+/**
+ * @brief Copy out the module's performance counters.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. values
+ * is indexed by perf_counter_t; count limits how many are written.
+ *
+ * @param count in: room in values, out: number of values written
+ */
+nyx_error_t battery_query_perf_counters(nyx_device_handle_t handle,
+                                        uint64_t *values, unsigned int *count)
+{
+	if (handle != nyxDev)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (!values || !count)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	*count = perf_counters_read(&battery_perf, values, *count);
 
 	return NYX_ERROR_NONE;
 }
 
+/*
+ * The callback never runs on the module's own threads: it is queued on the
+ * main context that is thread default for the caller here (see
+ * callback_relay.h), so that context has to be iterated for it to arrive.
+ * Changes made before it runs are folded into one call. Registering again
+ * replaces the callback, and nyx_module_close() drops it, so close the
+ * module from that same thread.
+ */
 nyx_error_t battery_register_battery_status_callback(nyx_device_handle_t handle,
         nyx_device_callback_function_t callback_func, void *context)
 {
@@ -426,8 +1384,7 @@ nyx_error_t battery_register_battery_status_callback(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	battery_callback_context = context;
-	battery_callback = callback_func;
+	callback_relay_set(&battery_callback, callback_func, context);
 
 	return NYX_ERROR_NONE;
 }
@@ -467,14 +1424,58 @@ nyx_error_t battery_get_ctia_parameters(nyx_device_handle_t handle,
 	return NYX_ERROR_NONE;
 }
 
+/*
+ * Each call adds percentage to the set of wakeup thresholds, up to
+ * BATTERY_WAKEUP_MAX of them. A percentage of 0 clears the set, which
+ * goes back to reporting every status change.
+ */
 nyx_error_t battery_set_wakeup_percentage(nyx_device_handle_t handle,
         int percentage)
 {
+	nyx_error_t result = NYX_ERROR_NONE;
+	int i;
+
 	if (handle != nyxDev)
 	{
 		return NYX_ERROR_INVALID_HANDLE;
 	}
-	return NYX_ERROR_NOT_IMPLEMENTED;
+
+	if (percentage < 0 || percentage > 100)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	pthread_mutex_lock(&battery_status_lock);
+
+	if (0 == percentage)
+	{
+		battery_wakeup_count = 0;
+		goto out;
+	}
+
+	for (i = 0; i < battery_wakeup_count; i++)
+	{
+		if (battery_wakeup[i].percentage == percentage)
+		{
+			goto out;
+		}
+	}
+
+	if (battery_wakeup_count == BATTERY_WAKEUP_MAX)
+	{
+		result = NYX_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* A battery already at or below the threshold only fires after recovering */
+	battery_wakeup[battery_wakeup_count].percentage = percentage;
+	battery_wakeup[battery_wakeup_count].armed =
+	    (fake_battery_status.percentage > percentage);
+	battery_wakeup_count++;
+
+out:
+	pthread_mutex_unlock(&battery_status_lock);
+	return result;
 }
 
 nyx_error_t battery_set_fake_mode(nyx_device_handle_t handle,
@@ -484,7 +1485,26 @@ nyx_error_t battery_set_fake_mode(nyx_device_handle_t handle,
 	{
 		return NYX_ERROR_INVALID_HANDLE;
 	}
-	return NYX_ERROR_NOT_IMPLEMENTED;
+
+	if (enable == battery_sim_running)
+	{
+		return NYX_ERROR_NONE;
+	}
+
+	if (enable)
+	{
+		return battery_sim_start();
+	}
+
+	/* Back to following the attribute files */
+	battery_sim_stop();
+
+	if (battery_refresh_status(BATTERY_ATTR_ALL))
+	{
+		battery_notify();
+	}
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t battery_get_fake_mode(nyx_device_handle_t handle,
@@ -495,6 +1515,6 @@ nyx_error_t battery_get_fake_mode(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-        *enable = false;
+	*enable = battery_sim_running;
 	return NYX_ERROR_NONE;
 }
@@ -17,6 +17,10 @@
 #!/bin/sh
 
 # Initial fake values for battery reads
+#
+# The battery module seeds these values itself when it is opened. This
+# script is only run when NYX_FAKE_BATTERY_SCRIPT points at it, and unlike
+# the built-in seeding it resets every value on each open.
 
 mkdir -p /tmp/powerd/fake/battery/
 cd /tmp/powerd/fake/battery/
@@ -382,6 +382,359 @@ static void test_battery_set_wakeup_percentage(api_test_fixture *fixture,
 	                  fixture->fixture_device, testPercentage));
 }
 
+//
+// Test for the battery_set_fake_mode/battery_get_fake_mode APIs
+//
+static void test_battery_set_fake_mode(api_test_fixture *fixture,
+                                       gconstpointer unused)
+{
+	bool enabled = true;
+
+	// Force a failed call
+	g_assert_true(NYX_ERROR_INVALID_HANDLE == battery_set_fake_mode(NULL, true));
+	g_assert_true(NYX_ERROR_INVALID_HANDLE == battery_get_fake_mode(
+	                  fixture->fixture_device, NULL));
+
+	// Simulator is off after open
+	g_assert_true(NYX_ERROR_NONE == battery_get_fake_mode(fixture->fixture_device,
+	              &enabled));
+	g_assert_false(enabled);
+
+	g_assert_true(NYX_ERROR_NONE == battery_set_fake_mode(fixture->fixture_device,
+	              true));
+	g_assert_true(NYX_ERROR_NONE == battery_get_fake_mode(fixture->fixture_device,
+	              &enabled));
+	g_assert_true(enabled);
+
+	g_assert_true(NYX_ERROR_NONE == battery_set_fake_mode(fixture->fixture_device,
+	              false));
+	g_assert_true(NYX_ERROR_NONE == battery_get_fake_mode(fixture->fixture_device,
+	              &enabled));
+	g_assert_false(enabled);
+}
+
+//
+// Check that wakeup thresholds fire once per crossing, with hysteresis
+//
+static void test_battery_wakeup_threshold(api_test_fixture *fixture,
+        gconstpointer unused)
+{
+	fake_battery_status.percentage = 50;
+	g_assert_true(NYX_ERROR_NONE == battery_set_wakeup_percentage(
+	                  fixture->fixture_device, 20));
+
+	g_assert_false(battery_wakeup_check(25));
+	g_assert_true(battery_wakeup_check(20));
+
+	// Bouncing around the threshold does not fire again
+	g_assert_false(battery_wakeup_check(21));
+	g_assert_false(battery_wakeup_check(20));
+	g_assert_false(battery_wakeup_check(19));
+
+	// Re-armed once the battery recovers past the hysteresis
+	g_assert_false(battery_wakeup_check(20 + BATTERY_WAKEUP_HYSTERESIS));
+	g_assert_true(battery_wakeup_check(18));
+
+	// Clearing the thresholds reports every change again
+	g_assert_true(NYX_ERROR_NONE == battery_set_wakeup_percentage(
+	                  fixture->fixture_device, 0));
+	g_assert_true(battery_should_notify(&fake_battery_status));
+}
+
+//
+// Check the simulator discharge step against the default curve
+//
+static void test_battery_sim_step(void)
+{
+	nyx_battery_status_t status;
+	double coulomb = 575.0;
+
+	memset(&status, 0, sizeof(status));
+	status.capacity_full40 = 1150.0;
+
+	// A quarter of an hour at the default -850mA
+	battery_sim_step(&status, &coulomb, 0.25);
+	g_assert_false(status.charging);
+	g_assert_cmpint(status.avg_current, ==, -850);
+	g_assert_cmpint(status.percentage, ==, 32);
+	g_assert_cmpint(status.voltage, ==, 3738);
+
+	// An empty battery stops drawing current
+	battery_sim_step(&status, &coulomb, 1.0);
+	g_assert_cmpfloat(coulomb, ==, 0.0);
+	g_assert_cmpint(status.current, ==, 0);
+	g_assert_cmpint(status.percentage, ==, 0);
+	g_assert_cmpint(status.voltage, ==, 3300);
+}
+
+//
+// The power model is process local: every attach hands out the same one,
+// and flipping the charging gate wakes whoever registered for it.
+//
+static void test_battery_power_model(void)
+{
+	power_model_t *model = power_model_attach();
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	uint64_t count = 0;
+
+	g_assert_nonnull(model);
+	g_assert_true(power_model_attach() == model);
+	g_assert_true(fd >= 0);
+
+	power_model_set_battery_notify(model, fd);
+	power_model_set_charging(model, false);
+	g_assert_false(power_model_charging_enabled(model));
+	g_assert_true(read(fd, &count, sizeof(count)) == sizeof(count));
+	g_assert_cmpuint(count, ==, 1);
+
+	power_model_set_battery_notify(model, -1);
+	power_model_set_charging(model, true);
+	g_assert_true(power_model_charging_enabled(model));
+	g_assert_true(read(fd, &count, sizeof(count)) < 0);
+
+	close(fd);
+}
+
+//
+// Status callbacks run on the registering thread's main context, never on
+// the thread that noticed the change, and queued changes fold into one call.
+//
+static unsigned int callback_calls;
+static pthread_t callback_thread;
+
+static void test_callback_note(nyx_device_handle_t device,
+                               nyx_callback_status_t status, void *context)
+{
+	g_assert_true(device == nyxDev);
+	g_assert_true(context == &callback_calls);
+	callback_calls++;
+	callback_thread = pthread_self();
+}
+
+static void *callback_notifier(void *unused)
+{
+	battery_notify();
+	battery_notify();
+	return NULL;
+}
+
+static void test_battery_callback_delivery(void)
+{
+	static nyx_device_t device;
+	GMainContext *context = g_main_context_new();
+	pthread_t notifier;
+
+	nyxDev = &device;
+	callback_calls = 0;
+	g_main_context_push_thread_default(context);
+	g_assert_true(NYX_ERROR_NONE == battery_register_battery_status_callback(
+	                  nyxDev, test_callback_note, &callback_calls));
+
+	g_assert_true(pthread_create(&notifier, NULL, callback_notifier, NULL) == 0);
+	pthread_join(notifier, NULL);
+	g_assert_cmpuint(callback_calls, ==, 0);
+
+	while (g_main_context_iteration(context, FALSE));
+
+	g_assert_cmpuint(callback_calls, ==, 1);
+	g_assert_true(pthread_equal(callback_thread, pthread_self()));
+
+	// Nothing queued survives the callback being dropped
+	battery_notify();
+	callback_relay_clear(&battery_callback);
+	battery_notify();
+
+	while (g_main_context_iteration(context, FALSE));
+
+	g_assert_cmpuint(callback_calls, ==, 1);
+
+	g_main_context_pop_thread_default(context);
+	g_main_context_unref(context);
+	nyxDev = NULL;
+}
+
+//
+// Status snapshots: readers race a writer publishing as fast as it can.
+// They go through battery_query_battery_status(), take the snapshot alone,
+// or, for comparison, copy the status under the writers' lock.
+//
+#define SNAPSHOT_MAX_READERS    16
+
+typedef enum
+{
+	SNAPSHOT_QUERY,
+	SNAPSHOT_READ,
+	SNAPSHOT_LOCKED
+} snapshot_mode_t;
+
+typedef struct
+{
+	pthread_t thread;
+	snapshot_mode_t mode;
+	uint64_t reads;
+	uint64_t torn;
+} snapshot_reader_t;
+
+static bool snapshot_stop;
+
+/* Every field follows n, so a mix of two versions is easy to spot */
+static void snapshot_fill(nyx_battery_status_t *status, int32_t n)
+{
+	memset(status, 0, sizeof(*status));
+	status->present = true;
+	status->charging = n & 1;
+	status->percentage = n;
+	status->temperature = n;
+	status->current = -n;
+	status->voltage = n;
+	status->capacity = n & 0xffff;
+	status->avg_current = -n;
+	status->capacity_raw = n & 0xffff;
+	status->capacity_full40 = n & 0xffff;
+	status->age = n;
+}
+
+static void *snapshot_writer(void *arg)
+{
+	uint64_t *writes = (uint64_t *) arg;
+	nyx_battery_status_t status;
+	int32_t n = 0;
+
+	while (!__atomic_load_n(&snapshot_stop, __ATOMIC_RELAXED))
+	{
+		snapshot_fill(&status, ++n);
+		pthread_mutex_lock(&battery_status_lock);
+		battery_publish_status(&status);
+		pthread_mutex_unlock(&battery_status_lock);
+	}
+
+	*writes = n;
+	return NULL;
+}
+
+static void *snapshot_reader(void *arg)
+{
+	snapshot_reader_t *reader = (snapshot_reader_t *) arg;
+	nyx_battery_status_t status, expected;
+
+	while (!__atomic_load_n(&snapshot_stop, __ATOMIC_RELAXED))
+	{
+		switch (reader->mode)
+		{
+			case SNAPSHOT_QUERY:
+				g_assert_true(battery_query_battery_status(nyxDev, &status) == NYX_ERROR_NONE);
+				break;
+
+			case SNAPSHOT_READ:
+				battery_read_status(&status);
+				break;
+
+			case SNAPSHOT_LOCKED:
+				pthread_mutex_lock(&battery_status_lock);
+				memcpy(&status, &fake_battery_status, sizeof(status));
+				pthread_mutex_unlock(&battery_status_lock);
+				break;
+		}
+
+		snapshot_fill(&expected, status.percentage);
+		reader->torn += (0 != memcmp(&expected, &status, sizeof(status)));
+		reader->reads++;
+	}
+
+	return NULL;
+}
+
+/* Run readers against the writer for ms, returns the total number of reads */
+static uint64_t snapshot_run(unsigned int readers, snapshot_mode_t mode, unsigned int ms,
+                             uint64_t *writes, uint64_t *torn)
+{
+	static nyx_device_t device;
+	snapshot_reader_t reader[SNAPSHOT_MAX_READERS];
+	nyx_battery_status_t status;
+	pthread_t writer;
+	uint64_t reads = 0;
+	unsigned int i;
+
+	nyxDev = &device;
+	perf_counters_init(&battery_perf, true, PERF_EVENT_TIMING_PERIOD);
+	snapshot_fill(&status, 0);
+	battery_publish_status(&status);
+	__atomic_store_n(&snapshot_stop, false, __ATOMIC_RELAXED);
+
+	g_assert_true(pthread_create(&writer, NULL, snapshot_writer, writes) == 0);
+
+	for (i = 0; i < readers; i++)
+	{
+		memset(&reader[i], 0, sizeof(reader[i]));
+		reader[i].mode = mode;
+		g_assert_true(pthread_create(&reader[i].thread, NULL, snapshot_reader,
+		                             &reader[i]) == 0);
+	}
+
+	g_usleep(ms * 1000);
+	__atomic_store_n(&snapshot_stop, true, __ATOMIC_RELAXED);
+	pthread_join(writer, NULL);
+	*torn = 0;
+
+	for (i = 0; i < readers; i++)
+	{
+		pthread_join(reader[i].thread, NULL);
+		reads += reader[i].reads;
+		*torn += reader[i].torn;
+	}
+
+	nyxDev = NULL;
+	return reads;
+}
+
+//
+// No query ever sees a half published status
+//
+static void test_battery_snapshot_consistent(void)
+{
+	uint64_t reads, writes, torn;
+
+	reads = snapshot_run(4, SNAPSHOT_QUERY, 100, &writes, &torn);
+	g_assert_cmpuint(reads, >, 0);
+	g_assert_cmpuint(writes, >, 0);
+	g_assert_cmpuint(torn, ==, 0);
+
+	reads = snapshot_run(4, SNAPSHOT_READ, 100, &writes, &torn);
+	g_assert_cmpuint(reads, >, 0);
+	g_assert_cmpuint(torn, ==, 0);
+}
+
+//
+// Query throughput by reader threads, while the writer publishes flat out.
+// Only runs in perf mode (-m perf).
+//
+static void test_battery_snapshot_benchmark(void)
+{
+	static const char *const names[] = { "query", "snapshot", "locked" };
+	unsigned int max = MIN(MAX(g_get_num_processors(), 4), SNAPSHOT_MAX_READERS);
+	unsigned int pass, readers;
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	for (pass = 0; pass < G_N_ELEMENTS(names); pass++)
+	{
+		for (readers = 1; readers <= max; readers *= 2)
+		{
+			uint64_t reads, writes, torn;
+
+			reads = snapshot_run(readers, (snapshot_mode_t) pass, 200, &writes, &torn);
+			g_assert_cmpuint(torn, ==, 0);
+			g_test_maximized_result(reads / 0.2, "%s, %u readers: %.2f M queries/s "
+			                        "(%.2f M per reader), %.2f M updates/s",
+			                        names[pass], readers, reads / 0.2e6,
+			                        reads / 0.2e6 / readers, writes / 0.2e6);
+		}
+	}
+}
+
 
 //
 // Set-up GLib, then register and run the tests.
@@ -400,6 +753,15 @@ int main(int argc, char **argv)
 	            test_battery_get_ctia_parameters);
 	ADD_APITEST("/battery/api/battery_set_wakeup_percentage",
 	            test_battery_set_wakeup_percentage);
+	ADD_APITEST("/battery/api/battery_set_fake_mode",
+	            test_battery_set_fake_mode);
+	ADD_APITEST("/battery/api/battery_wakeup_threshold",
+	            test_battery_wakeup_threshold);
+	g_test_add_func("/battery/sim/step", test_battery_sim_step);
+	g_test_add_func("/battery/power/model", test_battery_power_model);
+	g_test_add_func("/battery/callback/delivery", test_battery_callback_delivery);
+	g_test_add_func("/battery/snapshot/consistent", test_battery_snapshot_consistent);
+	g_test_add_func("/battery/snapshot/benchmark", test_battery_snapshot_benchmark);
 
 	return g_test_run();
 }
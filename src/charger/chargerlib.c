@@ -25,21 +25,44 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <poll.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 
 #include <nyx/nyx_module.h>
 #include <nyx/module/nyx_utils.h>
 #include <nyx/module/nyx_log.h>
 #include "msgid.h"
+#include "perf_counters.h"
+#include "callback_relay.h"
+#include "power_model.h"
+#include "status_snapshot.h"
 
 nyx_device_t *nyxDev = NULL;
-void *charger_status_callback_context = NULL;
-void *state_change_callback_context = NULL;
-nyx_device_callback_function_t charger_status_callback;
-nyx_device_callback_function_t state_change_callback;
+/* Delivered on the registering thread's main context, see callback_relay.h */
+static callback_relay_t charger_status_callback = CALLBACK_RELAY_INIT;
+static callback_relay_t state_change_callback = CALLBACK_RELAY_INIT;
 
 NYX_DECLARE_MODULE(NYX_DEVICE_CHARGER, "Main");
 
+/*
+ * Fake charger attributes. connected and powered hold nyx_charger_type_t
+ * bits, maxcurrent is in mA and dockserial is the dock serial number.
+ * Any of them missing reads as 0 / empty. With neither connected nor
+ * powered there, as on images that never write them, the charger keeps
+ * its old default of charging, which matches the seeded battery values.
+ */
+#define CHARGER_FAKE_DIR "/tmp/powerd/fake/charger/"
+
+#define CHARGER_CONNECTED    "connected"
+#define CHARGER_POWERED      "powered"
+#define CHARGER_MAX_CURRENT  "maxcurrent"
+#define CHARGER_DOCK_SERIAL  "dockserial"
+
+#define CHARGER_ATTR_BUF_SIZE 64
+
 nyx_charger_status_t gChargerStatus =
 {
 	.charger_max_current = 0,
@@ -49,8 +72,280 @@ nyx_charger_status_t gChargerStatus =
 	.is_charging = true,
 };
 
+/*
+ * Serialises updates of gChargerStatus, which is published through
+ * charger_status_snapshot (see status_snapshot.h) so queries never block.
+ */
+static pthread_mutex_t charger_status_lock = PTHREAD_MUTEX_INITIALIZER;
+static status_snapshot_t charger_status_snapshot;
+
+/* nyx_charger_event_t bits not yet collected by charger_query_charger_event() */
+static unsigned int charger_pending_events = NYX_NO_NEW_EVENT;
+
+/* inotify watch on CHARGER_FAKE_DIR, see charger_watch_start() */
+static pthread_t charger_watch_thread;
+static bool charger_watch_running = false;
+static int charger_inotify_fd = -1;
+static int charger_watch_stop_fd = -1;
+
+/* Charging gate shared with the battery module, see power_model.h */
+static power_model_t *charger_power_model = NULL;
+
+/* see charger_query_perf_counters() */
+static perf_counters_t charger_perf;
+
+/* Read an attribute file into buf as a NUL terminated, stripped string */
+static int charger_attr_read(const char *name, char *buf, size_t size)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	ssize_t len;
+
+	buf[0] = '\0';
+	perf_count(&charger_perf, PERF_SYSCALLS, 1);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	perf_count(&charger_perf, PERF_SYSCALLS, 2);
+
+	if (len < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_CHARG_READ_ERR, 0, "Failed to read %s", name);
+		return -1;
+	}
+
+	buf[len] = '\0';
+	g_strstrip(buf);
+	return 0;
+}
+
+/* 0 if the file is missing, found is cleared then */
+static int charger_attr_read_value(const char *name, bool *found)
+{
+	char buf[CHARGER_ATTR_BUF_SIZE];
+
+	if (charger_attr_read(name, buf, sizeof(buf)))
+	{
+		*found = false;
+		return 0;
+	}
+
+	return (int)strtol(buf, NULL, 0);
+}
+
+static void charger_read_attrs(nyx_charger_status_t *status)
+{
+	char serial[CHARGER_ATTR_BUF_SIZE];
+	bool connected_found = true, powered_found = true, found;
+
+	status->connected = charger_attr_read_value(CHARGER_FAKE_DIR CHARGER_CONNECTED,
+	                    &connected_found);
+	status->powered = charger_attr_read_value(CHARGER_FAKE_DIR CHARGER_POWERED,
+	                  &powered_found);
+	status->charger_max_current =
+	    MAX(charger_attr_read_value(CHARGER_FAKE_DIR CHARGER_MAX_CURRENT, &found), 0);
+
+	charger_attr_read(CHARGER_FAKE_DIR CHARGER_DOCK_SERIAL, serial, sizeof(serial));
+	g_strlcpy(status->dock_serial_number, serial, NYX_DOCK_SERIAL_NUMBER_LEN);
+
+	/* See CHARGER_FAKE_DIR for the default without either file */
+	status->is_charging = (status->powered != NYX_NO_CHARGER ||
+	                       (!connected_found && !powered_found)) &&
+	                      power_model_charging_enabled(charger_power_model);
+}
+
+/* Charger events implied by going from one status to the next */
+static unsigned int charger_transition_events(const nyx_charger_status_t *prev,
+        const nyx_charger_status_t *next)
+{
+	/* A charger that only reports powered (e.g. inductive) still counts */
+	bool was_attached = prev->connected || prev->powered;
+	bool attached = next->connected || next->powered;
+	unsigned int events = NYX_NO_NEW_EVENT;
+
+	if (!was_attached && attached)
+	{
+		events |= NYX_CHARGER_CONNECTED;
+	}
+	else if (was_attached && !attached)
+	{
+		events |= NYX_CHARGER_DISCONNECTED;
+	}
+	else if (attached && !prev->is_charging && next->is_charging)
+	{
+		events |= NYX_CHARGE_RESTART;
+	}
+
+	return events;
+}
+
+/*
+ * Re-read the fake charger attributes, queue the events for any transition
+ * and queue each callback once if something changed.
+ */
+static void charger_refresh_status(void)
+{
+	nyx_charger_status_t status;
+	unsigned int events;
+	bool changed;
+
+	pthread_mutex_lock(&charger_status_lock);
+	charger_read_attrs(&status);
+	changed = (0 != memcmp(&status, &gChargerStatus, sizeof(nyx_charger_status_t)));
+	events = charger_transition_events(&gChargerStatus, &status);
+
+	if (changed)
+	{
+		status_snapshot_publish(&charger_status_snapshot, &gChargerStatus, &status,
+		                        sizeof(nyx_charger_status_t));
+	}
+
+	if (events)
+	{
+		__atomic_fetch_or(&charger_pending_events, events, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&charger_status_lock);
+	perf_count(&charger_perf, PERF_EVENTS_READ, 1);
+
+	if (changed && callback_relay_post(&charger_status_callback, nyxDev))
+	{
+		perf_count(&charger_perf, PERF_EVENTS_EMITTED, 1);
+	}
+
+	if (events && callback_relay_post(&state_change_callback, nyxDev))
+	{
+		perf_count(&charger_perf, PERF_EVENTS_EMITTED, 1);
+	}
+}
+
+static void *charger_watch(void *unused)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2];
+
+	fds[0].fd = charger_inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = charger_watch_stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;)
+	{
+		bool changed = false;
+
+		perf_count(&charger_perf, PERF_SYSCALLS, 1);
+
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			break;
+		}
+
+		if (fds[1].revents)
+		{
+			break;
+		}
+
+		/* Drain everything queued so one batch of writes is one transition */
+		while (read(charger_inotify_fd, buf, sizeof(buf)) > 0)
+		{
+			perf_count(&charger_perf, PERF_SYSCALLS, 1);
+			changed = true;
+		}
+
+		if (changed)
+		{
+			charger_refresh_status();
+		}
+	}
+
+	return NULL;
+}
+
+static void charger_watch_stop(void)
+{
+	if (charger_watch_running)
+	{
+		uint64_t one = 1;
+
+		if (write(charger_watch_stop_fd, &one, sizeof(one)) == sizeof(one))
+		{
+			pthread_join(charger_watch_thread, NULL);
+		}
+
+		charger_watch_running = false;
+	}
+
+	if (charger_watch_stop_fd >= 0)
+	{
+		close(charger_watch_stop_fd);
+		charger_watch_stop_fd = -1;
+	}
+
+	if (charger_inotify_fd >= 0)
+	{
+		close(charger_inotify_fd);
+		charger_inotify_fd = -1;
+	}
+}
+
+/*
+ * Watch the fake charger directory so that scripted plug/unplug writes turn
+ * into charger events without anyone polling for them.
+ */
+static void charger_watch_start(void)
+{
+	if (g_mkdir_with_parents(CHARGER_FAKE_DIR, 0755) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_CHARG_WATCH_ERR, 0, "Failed to create %s",
+		          CHARGER_FAKE_DIR);
+		return;
+	}
+
+	charger_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	charger_watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+
+	if (charger_inotify_fd < 0 || charger_watch_stop_fd < 0 ||
+	        inotify_add_watch(charger_inotify_fd, CHARGER_FAKE_DIR,
+	                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0 ||
+	        pthread_create(&charger_watch_thread, NULL, charger_watch, NULL) != 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_CHARG_WATCH_ERR, 0,
+		          "Failed to watch %s, charger status will not be refreshed",
+		          CHARGER_FAKE_DIR);
+		charger_watch_stop();
+		return;
+	}
+
+	charger_watch_running = true;
+}
+
+/* Time one query and log a counter summary whenever one is due */
+static void charger_perf_call_done(uint64_t start)
+{
+	if (perf_call_done(&charger_perf, start))
+	{
+		char summary[256];
+		uint64_t values[PERF_COUNTER_COUNT];
+
+		perf_counters_read(&charger_perf, values, PERF_COUNTER_COUNT);
+		perf_counters_format(values, summary, sizeof(summary));
+		nyx_info(MSGID_NYX_QMUX_CHARG_PERF, 0, "Charger: %s", summary);
+	}
+}
+
 nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 {
+	nyx_charger_status_t initial;
+
 	if (NULL == d)
 	{
 		nyx_error(MSGID_NYX_QMUX_CHARG_OPEN_ERR, 0,"Charger device  open error.");
@@ -72,6 +367,8 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 		return NYX_ERROR_OUT_OF_MEMORY;
 	}
 
+	perf_counters_init(&charger_perf, true, PERF_EVENT_TIMING_PERIOD);
+
 	nyx_module_register_method(i, (nyx_device_t *)nyxDev,
 	                           NYX_CHARGER_QUERY_CHARGER_STATUS_MODULE_METHOD,
 	                           "charger_query_charger_status");
@@ -96,6 +393,17 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 	                           NYX_CHARGER_QUERY_CHARGER_EVENT_MODULE_METHOD,
 	                           "charger_query_charger_event");
 
+	charger_power_model = power_model_attach();
+
+	/* Start from whatever the fake directory says, without reporting it */
+	charger_read_attrs(&initial);
+	pthread_mutex_lock(&charger_status_lock);
+	status_snapshot_publish(&charger_status_snapshot, &gChargerStatus, &initial,
+	                        sizeof(nyx_charger_status_t));
+	pthread_mutex_unlock(&charger_status_lock);
+	charger_pending_events = NYX_NO_NEW_EVENT;
+	charger_watch_start();
+
 	*d = (nyx_device_t *)nyxDev;
 	return NYX_ERROR_NONE;
 }
@@ -111,6 +419,10 @@ nyx_error_t nyx_module_close(nyx_device_t *d)
 
 	if (NULL != nyxDev)
 	{
+		charger_watch_stop();
+		callback_relay_clear(&charger_status_callback);
+		callback_relay_clear(&state_change_callback);
+		charger_power_model = NULL;
 		free(nyxDev);
 		nyxDev = NULL;
 	}
@@ -131,10 +443,22 @@ nyx_error_t charger_query_charger_status(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	memcpy(status, &gChargerStatus, sizeof(nyx_charger_status_t));
+	uint64_t start = perf_call_begin(&charger_perf);
+
+	status_snapshot_read(&charger_status_snapshot, status, &gChargerStatus,
+	                     sizeof(nyx_charger_status_t));
+	charger_perf_call_done(start);
 	return NYX_ERROR_NONE;
 }
 
+/*
+ * The callback never runs on the module's own threads, nor from inside
+ * charger_enable_charging() and charger_disable_charging(): it is queued
+ * on the main context that is thread default for the caller here (see
+ * callback_relay.h), so that context has to be iterated for it to arrive.
+ * Changes made before it runs are folded into one call. nyx_module_close()
+ * drops it, so close the module from that same thread.
+ */
 nyx_error_t charger_register_charger_status_callback(nyx_device_handle_t handle,
         nyx_device_callback_function_t callback_func, void *context)
 {
@@ -148,12 +472,24 @@ nyx_error_t charger_register_charger_status_callback(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	charger_status_callback = callback_func;
-	charger_status_callback_context = context;
+	callback_relay_set(&charger_status_callback, callback_func, context);
 
 	return NYX_ERROR_NONE;
 }
 
+/*
+ * Flip the shared charging gate, which also stops or resumes the battery
+ * module's charge current, and report the resulting status.
+ */
+static void charger_set_charging(bool enable, nyx_charger_status_t *status)
+{
+	power_model_set_charging(charger_power_model, enable);
+	charger_refresh_status();
+
+	status_snapshot_read(&charger_status_snapshot, status, &gChargerStatus,
+	                     sizeof(nyx_charger_status_t));
+}
+
 nyx_error_t charger_enable_charging(nyx_device_handle_t handle,
                                     nyx_charger_status_t *status)
 {
@@ -167,7 +503,7 @@ nyx_error_t charger_enable_charging(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	memcpy(status, &gChargerStatus, sizeof(nyx_charger_status_t));
+	charger_set_charging(true, status);
 	return NYX_ERROR_NONE;
 }
 
@@ -184,10 +520,11 @@ nyx_error_t charger_disable_charging(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	memcpy(status, &gChargerStatus, sizeof(nyx_charger_status_t));
+	charger_set_charging(false, status);
 	return NYX_ERROR_NONE;
 }
 
+/* Same delivery rules as charger_register_charger_status_callback() */
 nyx_error_t charger_register_state_change_callback(nyx_device_handle_t handle,
         nyx_device_callback_function_t callback_func, void *context)
 {
@@ -201,8 +538,7 @@ nyx_error_t charger_register_state_change_callback(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	state_change_callback = callback_func;
-	state_change_callback_context = context;
+	callback_relay_set(&state_change_callback, callback_func, context);
 
 	return NYX_ERROR_NONE;
 }
@@ -220,7 +556,38 @@ nyx_error_t charger_query_charger_event(nyx_device_handle_t handle,
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	*event = NYX_NO_NEW_EVENT;
+	uint64_t start = perf_call_begin(&charger_perf);
+
+	/* Everything that happened since the last call, collected in one go */
+	*event = (nyx_charger_event_t)__atomic_exchange_n(&charger_pending_events,
+	         NYX_NO_NEW_EVENT, __ATOMIC_ACQUIRE);
+
+	charger_perf_call_done(start);
+	return NYX_ERROR_NONE;
+}
+
+/**
+ * @brief Copy out the module's performance counters.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. values
+ * is indexed by perf_counter_t; count limits how many are written.
+ *
+ * @param count in: room in values, out: number of values written
+ */
+nyx_error_t charger_query_perf_counters(nyx_device_handle_t handle,
+                                        uint64_t *values, unsigned int *count)
+{
+	if (handle != nyxDev)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (!values || !count)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	*count = perf_counters_read(&charger_perf, values, *count);
 
 	return NYX_ERROR_NONE;
 }
@@ -447,6 +447,263 @@ static void test_charger_query_charger_event(api_test_fixture *fixture,
 	g_assert_true(testEvent == NYX_CHARGER_CONNECTED);
 }
 
+static void writeFakeChargerAttr(const char *name, const char *value)
+{
+	gchar *path = g_strconcat(CHARGER_FAKE_DIR, name, NULL);
+	g_assert_true(g_file_set_contents(path, value, -1, NULL));
+	g_free(path);
+}
+
+//
+// Test that plugging and unplugging the fake charger queues its events
+//
+static void test_charger_plug_events(api_test_fixture *fixture,
+                                     gconstpointer unused)
+{
+	nyx_charger_event_t testEvent = NYX_NO_NEW_EVENT;
+	nyx_charger_status_t testChargerStatus;
+
+	writeFakeChargerAttr(CHARGER_POWERED, "0");
+	writeFakeChargerAttr(CHARGER_CONNECTED, "0");
+	charger_refresh_status();
+	charger_query_charger_event(fixture->fixture_device, &testEvent);
+
+	writeFakeChargerAttr(CHARGER_CONNECTED, "2");
+	writeFakeChargerAttr(CHARGER_POWERED, "8");
+	charger_refresh_status();
+
+	g_assert_true(NYX_ERROR_NONE == charger_query_charger_event(
+	                  fixture->fixture_device, &testEvent));
+	g_assert_true(testEvent & NYX_CHARGER_CONNECTED);
+	g_assert_true(NYX_ERROR_NONE == charger_query_charger_status(
+	                  fixture->fixture_device, &testChargerStatus));
+	g_assert_true(testChargerStatus.connected == NYX_CHARGER_WALL_CONNECTED);
+	g_assert_true(testChargerStatus.is_charging);
+
+	// The queue was drained by the previous call
+	g_assert_true(NYX_ERROR_NONE == charger_query_charger_event(
+	                  fixture->fixture_device, &testEvent));
+	g_assert_true(testEvent == NYX_NO_NEW_EVENT);
+
+	writeFakeChargerAttr(CHARGER_CONNECTED, "0");
+	writeFakeChargerAttr(CHARGER_POWERED, "0");
+	charger_refresh_status();
+
+	g_assert_true(NYX_ERROR_NONE == charger_query_charger_event(
+	                  fixture->fixture_device, &testEvent));
+	g_assert_true(testEvent & NYX_CHARGER_DISCONNECTED);
+}
+
+//
+// Without the fake charger files the charger reports charging, as it did
+// before they existed; once they are written they decide
+//
+static void test_charger_default_status(void)
+{
+	nyx_charger_status_t status;
+
+	g_assert_true(g_mkdir_with_parents(CHARGER_FAKE_DIR, 0755) == 0);
+	unlink(CHARGER_FAKE_DIR CHARGER_CONNECTED);
+	unlink(CHARGER_FAKE_DIR CHARGER_POWERED);
+
+	charger_read_attrs(&status);
+	g_assert_true(status.is_charging);
+	g_assert_cmpint(status.connected, ==, 0);
+	g_assert_cmpint(status.powered, ==, 0);
+
+	writeFakeChargerAttr(CHARGER_POWERED, "0");
+	charger_read_attrs(&status);
+	g_assert_false(status.is_charging);
+
+	writeFakeChargerAttr(CHARGER_POWERED, "8");
+	charger_read_attrs(&status);
+	g_assert_true(status.is_charging);
+
+	unlink(CHARGER_FAKE_DIR CHARGER_POWERED);
+}
+
+//
+// Status snapshots: readers race a writer publishing as fast as it can.
+// They go through charger_query_charger_status(), take the snapshot alone,
+// or, for comparison, copy the status under the writers' lock.
+//
+#define SNAPSHOT_MAX_READERS    16
+
+typedef enum
+{
+	SNAPSHOT_QUERY,
+	SNAPSHOT_READ,
+	SNAPSHOT_LOCKED
+} snapshot_mode_t;
+
+typedef struct
+{
+	pthread_t thread;
+	snapshot_mode_t mode;
+	uint64_t reads;
+	uint64_t torn;
+} snapshot_reader_t;
+
+static bool snapshot_stop;
+
+/* Every field follows n, so a mix of two versions is easy to spot */
+static void snapshot_fill(nyx_charger_status_t *status, int n)
+{
+	memset(status, 0, sizeof(*status));
+	status->charger_max_current = n;
+	status->connected = n & NYX_CHARGER_WALL_CONNECTED;
+	status->powered = n;
+	snprintf(status->dock_serial_number, sizeof(status->dock_serial_number), "%d", n);
+	status->is_charging = n & 1;
+}
+
+static void *snapshot_writer(void *arg)
+{
+	uint64_t *writes = (uint64_t *) arg;
+	nyx_charger_status_t status;
+	int n = 0;
+
+	while (!__atomic_load_n(&snapshot_stop, __ATOMIC_RELAXED))
+	{
+		snapshot_fill(&status, ++n);
+		pthread_mutex_lock(&charger_status_lock);
+		status_snapshot_publish(&charger_status_snapshot, &gChargerStatus, &status,
+		                        sizeof(status));
+		pthread_mutex_unlock(&charger_status_lock);
+	}
+
+	*writes = n;
+	return NULL;
+}
+
+static void *snapshot_reader(void *arg)
+{
+	snapshot_reader_t *reader = (snapshot_reader_t *) arg;
+	nyx_charger_status_t status, expected;
+
+	while (!__atomic_load_n(&snapshot_stop, __ATOMIC_RELAXED))
+	{
+		switch (reader->mode)
+		{
+			case SNAPSHOT_QUERY:
+				g_assert_true(charger_query_charger_status(nyxDev, &status) == NYX_ERROR_NONE);
+				break;
+
+			case SNAPSHOT_READ:
+				status_snapshot_read(&charger_status_snapshot, &status, &gChargerStatus,
+				                     sizeof(status));
+				break;
+
+			case SNAPSHOT_LOCKED:
+				pthread_mutex_lock(&charger_status_lock);
+				memcpy(&status, &gChargerStatus, sizeof(status));
+				pthread_mutex_unlock(&charger_status_lock);
+				break;
+		}
+
+		snapshot_fill(&expected, status.powered);
+		reader->torn += (0 != memcmp(&expected, &status, sizeof(status)));
+		reader->reads++;
+	}
+
+	return NULL;
+}
+
+/* Run readers against the writer for ms, returns the total number of reads */
+static uint64_t snapshot_run(unsigned int readers, snapshot_mode_t mode, unsigned int ms,
+                             uint64_t *writes, uint64_t *torn)
+{
+	static nyx_device_t device;
+	snapshot_reader_t reader[SNAPSHOT_MAX_READERS];
+	nyx_charger_status_t saved, status;
+	pthread_t writer;
+	uint64_t reads = 0;
+	unsigned int i;
+
+	memcpy(&saved, &gChargerStatus, sizeof(saved));
+	nyxDev = &device;
+	perf_counters_init(&charger_perf, true, PERF_EVENT_TIMING_PERIOD);
+	snapshot_fill(&status, 0);
+	status_snapshot_publish(&charger_status_snapshot, &gChargerStatus, &status,
+	                        sizeof(status));
+	__atomic_store_n(&snapshot_stop, false, __ATOMIC_RELAXED);
+
+	g_assert_true(pthread_create(&writer, NULL, snapshot_writer, writes) == 0);
+
+	for (i = 0; i < readers; i++)
+	{
+		memset(&reader[i], 0, sizeof(reader[i]));
+		reader[i].mode = mode;
+		g_assert_true(pthread_create(&reader[i].thread, NULL, snapshot_reader,
+		                             &reader[i]) == 0);
+	}
+
+	g_usleep(ms * 1000);
+	__atomic_store_n(&snapshot_stop, true, __ATOMIC_RELAXED);
+	pthread_join(writer, NULL);
+	*torn = 0;
+
+	for (i = 0; i < readers; i++)
+	{
+		pthread_join(reader[i].thread, NULL);
+		reads += reader[i].reads;
+		*torn += reader[i].torn;
+	}
+
+	status_snapshot_publish(&charger_status_snapshot, &gChargerStatus, &saved,
+	                        sizeof(saved));
+	nyxDev = NULL;
+	return reads;
+}
+
+//
+// No query ever sees a half published status
+//
+static void test_charger_snapshot_consistent(void)
+{
+	uint64_t reads, writes, torn;
+
+	reads = snapshot_run(4, SNAPSHOT_QUERY, 100, &writes, &torn);
+	g_assert_cmpuint(reads, >, 0);
+	g_assert_cmpuint(writes, >, 0);
+	g_assert_cmpuint(torn, ==, 0);
+
+	reads = snapshot_run(4, SNAPSHOT_READ, 100, &writes, &torn);
+	g_assert_cmpuint(reads, >, 0);
+	g_assert_cmpuint(torn, ==, 0);
+}
+
+//
+// Query throughput by reader threads, while the writer publishes flat out.
+// Only runs in perf mode (-m perf).
+//
+static void test_charger_snapshot_benchmark(void)
+{
+	static const char *const names[] = { "query", "snapshot", "locked" };
+	unsigned int max = MIN(MAX(g_get_num_processors(), 4), SNAPSHOT_MAX_READERS);
+	unsigned int pass, readers;
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	for (pass = 0; pass < G_N_ELEMENTS(names); pass++)
+	{
+		for (readers = 1; readers <= max; readers *= 2)
+		{
+			uint64_t reads, writes, torn;
+
+			reads = snapshot_run(readers, (snapshot_mode_t) pass, 200, &writes, &torn);
+			g_assert_cmpuint(torn, ==, 0);
+			g_test_maximized_result(reads / 0.2, "%s, %u readers: %.2f M queries/s "
+			                        "(%.2f M per reader), %.2f M updates/s",
+			                        names[pass], readers, reads / 0.2e6,
+			                        reads / 0.2e6 / readers, writes / 0.2e6);
+		}
+	}
+}
+
 
 //
 // Set-up GLib, then register and run the tests.
@@ -467,6 +724,11 @@ int main(int argc, char **argv)
 	            test_charger_register_state_change_callback);
 	ADD_APITEST("/charger/api/charger_query_charger_event",
 	            test_charger_query_charger_event);
+	ADD_APITEST("/charger/fake/plug_events",
+	            test_charger_plug_events);
+	g_test_add_func("/charger/fake/default_status", test_charger_default_status);
+	g_test_add_func("/charger/snapshot/consistent", test_charger_snapshot_consistent);
+	g_test_add_func("/charger/snapshot/benchmark", test_charger_snapshot_benchmark);
 
 	return g_test_run();
 }
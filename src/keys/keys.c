@@ -21,16 +21,24 @@
 #include <fcntl.h>
 #include <linux/input.h>
 #include <errno.h>
-#include <poll.h>
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <nyx/nyx_module.h>
 #include <nyx/module/nyx_utils.h>
 #include <nyx/module/nyx_log.h>
+#include "event_pool.h"
+#include "event_ring.h"
+#include "evdev_filter.h"
+#include "evdev_hotplug.h"
+#include "evdev_log.h"
+#include "input_trace.h"
 #include "msgid.h"
+#include "perf_counters.h"
 
 enum
 {
@@ -48,13 +56,37 @@ enum
 	KEY_ORANGE = 0x64
 };
 
-int keypad_event_fd;
+/* Number of key events kept preallocated per device, read at open */
+#ifndef KEYS_EVENT_POOL_SIZE
+#define KEYS_EVENT_POOL_SIZE  16
+#endif
+
+#define KEYS_EVENT_POOL_ENV "NYX_KEYS_EVENT_POOL"
+
+/*
+ * Keymap loaded at open on top of the built-in translation. Each line is
+ * "<evdev code> <nyx key>", with the nyx key either a number or one of the
+ * names in keys_keymap_names. '#' starts a comment.
+ */
+#ifndef KEYS_KEYMAP_FILE
+#define KEYS_KEYMAP_FILE "/etc/nyx/qemux86-keymap.conf"
+#endif
+
+#define KEYS_KEYMAP_ENV "NYX_KEYS_KEYMAP"
 
+/*
+ * Replay an evdev log (see evdev_log.h) instead of reading the keyboards,
+ * and record whatever is read into one.
+ */
+#define KEYS_REPLAY_ENV "NYX_KEYS_REPLAY"
+#define KEYS_RECORD_ENV "NYX_KEYS_RECORD"
+
+/* Translation of one evdev keycode */
 typedef struct
 {
-	nyx_device_t _parent;
-	nyx_event_keys_t *current_event_ptr;
-} keys_device_t;
+	int key;
+	nyx_key_type_t key_type;
+} key_map_entry_t;
 
 NYX_DECLARE_MODULE(NYX_DEVICE_KEYS, "Keys");
 
@@ -70,17 +102,220 @@ typedef struct InputEvent
 	int32_t value;        /**< event value: coordinate, intensity,etc. */
 } InputEvent_t;
 
+#define MAX_EVENTS      64
+
+/*
+ * All read state is per device, so several keyboards can be opened and
+ * drained from different threads.
+ */
+typedef struct
+{
+	nyx_device_t _parent;
+	nyx_event_keys_t *current_event_ptr;
+	event_pool_t event_pool;
+	key_map_entry_t keymap[KEY_CNT];
+
+	evdev_hotplug_t input;                 /**< every keyboard found so far */
+	InputEvent_t raw_events[MAX_EVENTS];   /**< last batch read from event_fd */
+	int event_count;                       /**< events in raw_events */
+	int event_iter;                        /**< next event to translate */
+
+	evdev_log_player_t replay;             /**< replaces the keyboards if set */
+	evdev_log_recorder_t record;
+
+	perf_counters_t perf;                  /**< see keys_query_perf_counters() */
+
+	event_ring_t ring;                     /**< see keys_open_event_ring() */
+	pthread_t ring_thread;
+} keys_device_t;
+
+#define CUSTOM_KEY(k) { NYX_KEYS_CUSTOM_KEY_##k, NYX_KEY_TYPE_CUSTOM }
+#define STANDARD_KEY(k) { k, NYX_KEY_TYPE_STANDARD }
+
+/*
+ * Built-in translation, indexed by evdev keycode. Codes without an entry
+ * (key == 0) are passed through unchanged as standard keys.
+ */
+static const key_map_entry_t keys_default_map[KEY_CNT] =
+{
+	[KEY_Q] = CUSTOM_KEY(HOME),
+	[KEY_HOME] = CUSTOM_KEY(HOME),
+	[KEY_W] = CUSTOM_KEY(HOT),
+	[KEY_HOMEPAGE] = CUSTOM_KEY(HOT),
+	[KEY_E] = CUSTOM_KEY(BACK),
+	[KEY_BACK] = CUSTOM_KEY(BACK),
+	[KEY_VOLUMEUP] = CUSTOM_KEY(VOL_UP),
+	[KEY_VOLUMEDOWN] = CUSTOM_KEY(VOL_DOWN),
+	[KEY_MUTE] = CUSTOM_KEY(VOL_MUTE),
+	[KEY_END] = CUSTOM_KEY(POWER_ON),
+	[KEY_PLAY] = CUSTOM_KEY(MEDIA_PLAY),
+	[KEY_PAUSE] = CUSTOM_KEY(MEDIA_PAUSE),
+	[KEY_STOP] = CUSTOM_KEY(MEDIA_STOP),
+	[KEY_NEXT] = CUSTOM_KEY(MEDIA_NEXT),
+	[KEY_PREVIOUS] = CUSTOM_KEY(MEDIA_PREVIOUS),
+	[KEY_REWIND] = CUSTOM_KEY(MEDIA_REWIND),
+	[KEY_FASTFORWARD] = CUSTOM_KEY(MEDIA_FASTFORWARD),
+	// add keyboard function keys
+	[KEY_SEARCH] = CUSTOM_KEY(SEARCH),
+	[KEY_BRIGHTNESSDOWN] = CUSTOM_KEY(BRIGHTNESS_DOWN),
+	[KEY_BRIGHTNESSUP] = CUSTOM_KEY(BRIGHTNESS_UP),
+	[KEY_F1] = STANDARD_KEY(F1),
+	[KEY_F2] = STANDARD_KEY(F2),
+	[KEY_F3] = STANDARD_KEY(F3),
+	[KEY_F4] = STANDARD_KEY(F4),
+	[KEY_F5] = STANDARD_KEY(F5),
+	[KEY_F6] = STANDARD_KEY(F6),
+	[KEY_F7] = STANDARD_KEY(F7),
+	[KEY_F8] = STANDARD_KEY(F8),
+	[KEY_F9] = STANDARD_KEY(F9),
+	[KEY_F10] = STANDARD_KEY(F10),
+	[KEY_RIGHTALT] = STANDARD_KEY(KEY_ORANGE),
+};
+
+/* Names accepted as the nyx key in a keymap file */
+static const struct
+{
+	const char *name;
+	key_map_entry_t entry;
+} keys_keymap_names[] =
+{
+	{ "home", CUSTOM_KEY(HOME) },
+	{ "hot", CUSTOM_KEY(HOT) },
+	{ "back", CUSTOM_KEY(BACK) },
+	{ "vol_up", CUSTOM_KEY(VOL_UP) },
+	{ "vol_down", CUSTOM_KEY(VOL_DOWN) },
+	{ "vol_mute", CUSTOM_KEY(VOL_MUTE) },
+	{ "power", CUSTOM_KEY(POWER_ON) },
+	{ "play", CUSTOM_KEY(MEDIA_PLAY) },
+	{ "pause", CUSTOM_KEY(MEDIA_PAUSE) },
+	{ "stop", CUSTOM_KEY(MEDIA_STOP) },
+	{ "next", CUSTOM_KEY(MEDIA_NEXT) },
+	{ "previous", CUSTOM_KEY(MEDIA_PREVIOUS) },
+	{ "rewind", CUSTOM_KEY(MEDIA_REWIND) },
+	{ "fastforward", CUSTOM_KEY(MEDIA_FASTFORWARD) },
+	{ "search", CUSTOM_KEY(SEARCH) },
+	{ "brightness_down", CUSTOM_KEY(BRIGHTNESS_DOWN) },
+	{ "brightness_up", CUSTOM_KEY(BRIGHTNESS_UP) },
+	{ "f1", STANDARD_KEY(F1) },
+	{ "f2", STANDARD_KEY(F2) },
+	{ "f3", STANDARD_KEY(F3) },
+	{ "f4", STANDARD_KEY(F4) },
+	{ "f5", STANDARD_KEY(F5) },
+	{ "f6", STANDARD_KEY(F6) },
+	{ "f7", STANDARD_KEY(F7) },
+	{ "f8", STANDARD_KEY(F8) },
+	{ "f9", STANDARD_KEY(F9) },
+	{ "f10", STANDARD_KEY(F10) },
+	{ "sym", STANDARD_KEY(KEY_SYM) },
+	{ "orange", STANDARD_KEY(KEY_ORANGE) },
+};
+
+static bool keys_keymap_parse_key(const char *str, key_map_entry_t *entry)
+{
+	char *endptr;
+	long key;
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(keys_keymap_names); i++)
+	{
+		if (0 == g_ascii_strcasecmp(str, keys_keymap_names[i].name))
+		{
+			*entry = keys_keymap_names[i].entry;
+			return true;
+		}
+	}
+
+	key = strtol(str, &endptr, 0);
+
+	if (endptr == str || *endptr != '\0' || key <= 0)
+	{
+		return false;
+	}
+
+	entry->key = key;
+	entry->key_type = NYX_KEY_TYPE_STANDARD;
+	return true;
+}
+
+static void keys_keymap_load(keys_device_t *d, const char *path)
+{
+	char line[128];
+	FILE *keymap = fopen(path, "r");
+
+	if (NULL == keymap)
+	{
+		return;
+	}
+
+	while (fgets(line, sizeof(line), keymap))
+	{
+		char code_str[32], key_str[32];
+		key_map_entry_t entry;
+		char *endptr;
+		long code;
+
+		if (line[0] == '#' || sscanf(line, "%31s %31s", code_str, key_str) != 2)
+		{
+			continue;
+		}
+
+		code = strtol(code_str, &endptr, 0);
+
+		if (*endptr != '\0' || code < 0 || code >= KEY_CNT ||
+		        !keys_keymap_parse_key(key_str, &entry))
+		{
+			nyx_warn(MSGID_NYX_QMUX_KEY_KEYMAP_ERR, 0, "Ignoring keymap entry %s %s",
+			         code_str, key_str);
+			continue;
+		}
+
+		d->keymap[code] = entry;
+	}
+
+	fclose(keymap);
+}
+
+/* Fill in the full per-device table so that every lookup is a single load */
+static void keys_keymap_init(keys_device_t *d)
+{
+	const char *path = getenv(KEYS_KEYMAP_ENV);
+	int code;
+
+	for (code = 0; code < KEY_CNT; code++)
+	{
+		if (keys_default_map[code].key)
+		{
+			d->keymap[code] = keys_default_map[code];
+		}
+		else
+		{
+			d->keymap[code].key = code;
+			d->keymap[code].key_type = NYX_KEY_TYPE_STANDARD;
+		}
+	}
+
+	keys_keymap_load(d, path ? path : KEYS_KEYMAP_FILE);
+}
 
-static nyx_event_keys_t *keys_event_create()
+
+static nyx_event_keys_t *keys_event_create(keys_device_t *d)
 {
-	nyx_event_keys_t *event_ptr = (nyx_event_keys_t *) calloc(
-	                                  sizeof(nyx_event_keys_t), 1);
+	nyx_event_keys_t *event_ptr;
+
+	if (G_UNLIKELY(0 == d->event_pool.free_count))
+	{
+		perf_count(&d->perf, PERF_ALLOCS, 1);
+	}
+
+	event_ptr = (nyx_event_keys_t *) event_pool_get(&d->event_pool);
 
 	if (NULL == event_ptr)
 	{
 		return event_ptr;
 	}
 
+	memset(event_ptr, 0, sizeof(nyx_event_keys_t));
+
 	((nyx_event_t *) event_ptr)->type = NYX_EVENT_KEYS;
 
 	return event_ptr;
@@ -98,29 +333,124 @@ nyx_error_t keys_release_event(nyx_device_t *d, nyx_event_t *e)
 		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-	nyx_event_keys_t *a = (nyx_event_keys_t *) e;
+	keys_device_t *keys_device = (keys_device_t *) d;
+
+	/* The last event held past nyx_module_close() takes the device with it */
+	if (event_pool_put(&keys_device->event_pool, e))
+	{
+		free(keys_device);
+	}
 
-	free(a);
 	return NYX_ERROR_NONE;
 }
 
 
+/*
+ * Only key events (and the SYN_REPORTs that wake us) are of any use here,
+ * so have the kernel drop EV_MSC scancodes, LEDs and the rest.
+ */
+static void
+filter_keypad_events(int fd)
+{
+	static const unsigned int types[] = { EV_SYN, EV_KEY };
+
+	if (evdev_set_mask(fd, EV_SYN, types, G_N_ELEMENTS(types), EV_CNT) < 0)
+	{
+		nyx_debug("EVIOCSMASK not supported (%d), filtering key events in userspace",
+		          errno);
+	}
+
+	if (evdev_grab_requested() && evdev_grab(fd) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_EVENT_ERR, 0, "Failed to grab keypad device");
+	}
+}
+
+/* Anything with letter keys and no pointer axes counts as a keyboard */
+static bool
+is_keyboard(int fd)
+{
+	unsigned long evBits[NBITS(EV_CNT)] = { 0 };
+	unsigned long keyBits[NBITS(KEY_CNT)] = { 0 };
+
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(evBits)), evBits) < 0 ||
+	        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBits)), keyBits) < 0)
+	{
+		return false;
+	}
+
+	return TEST_BIT(EV_KEY, evBits) && !TEST_BIT(EV_ABS, evBits) &&
+	       TEST_BIT(KEY_A, keyBits) && TEST_BIT(KEY_ENTER, keyBits);
+}
+
+static int
+attach_keypad(void *ctx, int fd, bool preferred)
+{
+	if (!preferred && !is_keyboard(fd))
+	{
+		return -1;
+	}
+
+	filter_keypad_events(fd);
+	nyx_debug("Keys %p: attached input device (fd %d)", ctx, fd);
+
+	return 0;
+}
+
+/*
+ * Keyboards are picked up, and dropped again, as they come and go under
+ * /dev/input. The udev symlink KEYPAD_INPUT_DEVICE names is always taken,
+ * other event nodes only if they look like a keyboard.
+ */
 static int
-init_keypad(void)
+init_keypad(keys_device_t *d)
 {
+	const char *replay = getenv(KEYS_REPLAY_ENV);
+	const char *record = getenv(KEYS_RECORD_ENV);
+	const char *preferred = NULL;
+	evdev_log_info_t info = { 0 };
+
 #ifdef KEYPAD_INPUT_DEVICE
-	keypad_event_fd = open(KEYPAD_INPUT_DEVICE, O_RDWR);
+	preferred = strrchr(KEYPAD_INPUT_DEVICE, '/');
+	preferred = preferred ? preferred + 1 : KEYPAD_INPUT_DEVICE;
+#endif
 
-	if (keypad_event_fd < 0)
+	/* A replayed log is the only input, no keyboard is attached */
+	if (evdev_hotplug_init(&d->input, EVDEV_HOTPLUG_DIR, preferred,
+	                       replay ? 0 : EVDEV_HOTPLUG_MAX_NODES, attach_keypad, NULL, d) < 0)
 	{
-		nyx_error(MSGID_NYX_QMUX_KEY_EVENT_ERR, 0, "Error in opening keypad event file");
+		nyx_error(MSGID_NYX_QMUX_KEY_EVENT_ERR, 0, "Error in creating keypad event source");
 		return -1;
 	}
 
+	if (record && evdev_log_recorder_open(&d->record, record, &info) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_RECORD_ERR, 0, "Cannot record key events to %s",
+		         record);
+	}
+
+	if (replay)
+	{
+		if (evdev_log_player_open(&d->replay, replay, evdev_log_paced(),
+		                          d->input.epoll_fd) < 0)
+		{
+			nyx_error(MSGID_NYX_QMUX_KEY_REPLAY_ERR, 0, "Cannot replay key events from %s",
+			          replay);
+			return -1;
+		}
+
+		nyx_debug("Keys %p: replaying %zu events from %s", d, d->replay.count, replay);
+		return 0;
+	}
+
+	if (d->input.inotify_fd < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_EVENT_ERR, 0,
+		         "Cannot watch %s, keyboards plugged in later will be missed",
+		         EVDEV_HOTPLUG_DIR);
+	}
+
 	return 0;
-#else
-	return -1;
-#endif
 }
 
 nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
@@ -140,7 +470,19 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 		return NYX_ERROR_OUT_OF_MEMORY;
 	}
 
-	init_keypad();
+	if (event_pool_init(&keys_device->event_pool, sizeof(nyx_event_keys_t),
+	                    event_pool_size_from_env(KEYS_EVENT_POOL_ENV,
+	                            KEYS_EVENT_POOL_SIZE)) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_OUT_OF_MEM, 0,
+		         "Failed to preallocate key events, falling back to malloc");
+	}
+
+	keys_keymap_init(keys_device);
+	input_trace_init();
+	perf_counters_init(&keys_device->perf, false, PERF_EVENT_TIMING_PERIOD);
+	init_keypad(keys_device);
+	keys_device->input.perf = &keys_device->perf;
 
 	nyx_module_register_method(i, (nyx_device_t *) keys_device,
 	                           NYX_GET_EVENT_SOURCE_MODULE_METHOD, "keys_get_event_source");
@@ -155,6 +497,10 @@ nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
 
 }
 
+/*
+ * Events the consumer still holds stay valid: the device then lingers,
+ * closed, until the last of them is released through it.
+ */
 nyx_error_t nyx_module_close(nyx_device_t *d)
 {
 	keys_device_t *keys_device = (keys_device_t *) d;
@@ -164,13 +510,43 @@ nyx_error_t nyx_module_close(nyx_device_t *d)
 		return NYX_ERROR_INVALID_HANDLE;
 	}
 
+	if (event_ring_active(&keys_device->ring))
+	{
+		event_ring_stop(&keys_device->ring);
+		pthread_join(keys_device->ring_thread, NULL);
+		event_ring_destroy(&keys_device->ring);
+	}
+
 	if (keys_device->current_event_ptr)
 	{
 		keys_release_event(d, (nyx_event_t *) keys_device->current_event_ptr);
+		keys_device->current_event_ptr = NULL;
+	}
+
+	nyx_debug("Freeing keys %p (%u event pool fallback allocations)", d,
+	          keys_device->event_pool.fallback_allocs);
+
+	evdev_log_player_close(&keys_device->replay);
+	evdev_hotplug_destroy(&keys_device->input);
+
+	if (evdev_log_recorder_close(&keys_device->record) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_RECORD_ERR, 0, "Failed to write the key event log");
 	}
 
-	nyx_debug("Freeing keys %p", d);
-	free(d);
+	if (input_trace_dump() < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_TRACE_ERR, 0, "Failed to write the input trace");
+	}
+
+	if (event_pool_destroy(&keys_device->event_pool) == 0)
+	{
+		free(d);
+	}
+	else
+	{
+		nyx_debug("Keys %p closed with events still held, freed with the last one", d);
+	}
 
 	return NYX_ERROR_NONE;
 }
@@ -187,244 +563,377 @@ nyx_error_t keys_get_event_source(nyx_device_t *d, int *f)
 		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	*f = keypad_event_fd;
+	keys_device_t *keys_device = (keys_device_t *) d;
+
+	*f = event_ring_active(&keys_device->ring) ? keys_device->ring.event_fd :
+	     keys_device->input.epoll_fd;
 
 	return NYX_ERROR_NONE;
 }
 
-static int lookup_key(keys_device_t *d, uint16_t keyCode, int32_t keyValue,
-                      nyx_key_type_t *key_type_out_ptr)
+static inline int lookup_key(keys_device_t *d, uint16_t keyCode,
+                             int32_t keyValue, nyx_key_type_t *key_type_out_ptr)
 {
-	int key = 0;
+	const key_map_entry_t *entry;
 
-	switch (keyCode)
+	if (G_UNLIKELY(keyCode >= KEY_CNT))
 	{
-		case KEY_Q:
-			key = NYX_KEYS_CUSTOM_KEY_HOME;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
-
-		case KEY_HOMEPAGE:
-		case KEY_W:
-			key = NYX_KEYS_CUSTOM_KEY_HOT;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+		return keyCode;
+	}
 
-		case KEY_BACK:
-		case KEY_E:
-			key = NYX_KEYS_CUSTOM_KEY_BACK;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	entry = &d->keymap[keyCode];
+	*key_type_out_ptr = entry->key_type;
+	return entry->key;
+}
 
-		case KEY_HOME:
-			key = NYX_KEYS_CUSTOM_KEY_HOME;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+static int
+read_input_event(keys_device_t *d, InputEvent_t *pEvents, int maxEvents)
+{
+	ssize_t rd;
 
-		case KEY_VOLUMEUP:
-			key = NYX_KEYS_CUSTOM_KEY_VOL_UP;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	if (pEvents == NULL)
+	{
+		return -1;
+	}
 
-		case KEY_VOLUMEDOWN:
-			key = NYX_KEYS_CUSTOM_KEY_VOL_DOWN;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	if (evdev_log_replaying(&d->replay))
+	{
+		rd = evdev_log_play(&d->replay, pEvents, sizeof(InputEvent_t) * maxEvents);
+	}
+	else
+	{
+		rd = evdev_hotplug_read(&d->input, pEvents, sizeof(InputEvent_t) * maxEvents);
+	}
 
-		case KEY_END:
-			key = NYX_KEYS_CUSTOM_KEY_POWER_ON;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	if (rd < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_KEY_EVENT_READ_ERR, 0, "Failed to read events from keypad event file");
+		return -1;
+	}
 
-		case KEY_PLAY:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PLAY;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	if (rd > 0 && evdev_log_recording(&d->record) &&
+	        evdev_log_record(&d->record, pEvents, rd) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_KEY_RECORD_ERR, 0, "Failed to write the key event log");
+		evdev_log_recorder_close(&d->record);
+	}
 
-		case KEY_PAUSE:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PAUSE;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	return rd / sizeof(InputEvent_t);
+}
 
-		case KEY_STOP:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_STOP;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+/* Translate the next ready key, NULL if there is none */
+static nyx_event_t *
+keys_next_event(keys_device_t *keys_device)
+{
+	nyx_event_t *event = NULL;
 
-		case KEY_NEXT:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_NEXT;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	/*
+	 * Event bookkeeping...
+	 */
+	if (!keys_device->event_iter)
+	{
+		keys_device->event_count = read_input_event(keys_device,
+		                           keys_device->raw_events, MAX_EVENTS);
 
-		case KEY_PREVIOUS:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PREVIOUS;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+		if (keys_device->event_count > 0)
+		{
+			perf_count(&keys_device->perf, PERF_EVENTS_READ, keys_device->event_count);
+		}
+	}
 
-		// add keyboard function keys
-		case KEY_SEARCH:
-			key = NYX_KEYS_CUSTOM_KEY_SEARCH;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	if (keys_device->current_event_ptr == NULL)
+	{
+		/*
+		 * let's allocate new event and hold it here.
+		 */
+		keys_device->current_event_ptr = keys_event_create(keys_device);
+	}
 
-		case KEY_BRIGHTNESSDOWN:
-			key = NYX_KEYS_CUSTOM_KEY_BRIGHTNESS_DOWN;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+	for (; keys_device->event_iter < keys_device->event_count;)
+	{
+		InputEvent_t *input_event_ptr;
+		input_event_ptr = &keys_device->raw_events[keys_device->event_iter];
+		keys_device->event_iter++;
 
-		case KEY_BRIGHTNESSUP:
-			key = NYX_KEYS_CUSTOM_KEY_BRIGHTNESS_UP;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+		if (input_event_ptr->type == EV_SYN && input_event_ptr->code == SYN_DROPPED)
+		{
+			// The kernel buffer overflowed, whatever was in it is gone
+			perf_count(&keys_device->perf, PERF_EVENTS_DROPPED, 1);
+			continue;
+		}
+		else if (input_event_ptr->type == EV_KEY)
+		{
+			if (G_UNLIKELY(NULL == keys_device->current_event_ptr))
+			{
+				perf_count(&keys_device->perf, PERF_EVENTS_DROPPED, 1);
+				continue;
+			}
 
-		case KEY_MUTE:
-			key = NYX_KEYS_CUSTOM_KEY_VOL_MUTE;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+			keys_device->current_event_ptr->key = lookup_key(keys_device,
+			                                      input_event_ptr->code, input_event_ptr->value,
+			                                      &keys_device->current_event_ptr->key_type);
+		}
+		else
+		{
+			continue;
+		}
 
-		case KEY_REWIND:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_REWIND;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+		keys_device->current_event_ptr->key_is_press
+		    = (input_event_ptr->value) ? true : false;
+		keys_device->current_event_ptr->key_is_auto_repeat
+		    = (input_event_ptr->value > 1) ? true : false;
+		INPUT_TRACE(KEY_EVENT, input_event_ptr->code, input_event_ptr->value,
+		            keys_device->current_event_ptr->key,
+		            keys_device->current_event_ptr->key_type, 0);
 
-		case KEY_FASTFORWARD:
-			key = NYX_KEYS_CUSTOM_KEY_MEDIA_FASTFORWARD;
-			*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
-			break;
+		event = (nyx_event_t *) keys_device->current_event_ptr;
+		keys_device->current_event_ptr = NULL;
 
-		default:
+		/*
+		 * Generated event, bail out and let the caller know.
+		 */
+		if (NULL != event)
+		{
+			perf_count(&keys_device->perf, PERF_EVENTS_EMITTED, 1);
 			break;
+		}
 	}
 
-	if (*key_type_out_ptr != NYX_KEY_TYPE_CUSTOM)
+	if (keys_device->event_iter >= keys_device->event_count)
 	{
-		if (keyCode == KEY_LEFTSHIFT)
-		{
-			key = KEY_LEFTSHIFT;
-		}
-		else
-		{
-			key = keyCode;
-		}
+		keys_device->event_iter = 0;
 	}
 
-	return key;
+	return event;
 }
 
-struct pollfd fds[1];
+static void
+keys_perf_call_done(keys_device_t *keys_device, uint64_t start)
+{
+	if (perf_call_done(&keys_device->perf, start))
+	{
+		char summary[256];
+		uint64_t values[PERF_COUNTER_COUNT];
 
-int
-read_input_event(InputEvent_t *pEvents, int maxEvents)
+		perf_counters_read(&keys_device->perf, values, PERF_COUNTER_COUNT);
+		perf_counters_format(values, summary, sizeof(summary));
+		nyx_info(MSGID_NYX_QMUX_KEY_PERF, 0, "Keys %p: %s", keys_device, summary);
+	}
+}
+
+nyx_error_t keys_get_event(nyx_device_t *d, nyx_event_t **e)
 {
-	int numEvents = 0;
-	int rd = 0;
+	keys_device_t *keys_device = (keys_device_t *) d;
+	uint64_t start;
 
-	if (pEvents == NULL)
+	if (G_UNLIKELY(event_ring_active(&keys_device->ring)))
 	{
-		return -1;
+		*e = NULL;
+		return NYX_ERROR_INVALID_OPERATION;
 	}
 
-	fds[0].fd = keypad_event_fd;
-	fds[0].events = POLLIN;
+	start = perf_call_begin(&keys_device->perf);
+	*e = keys_next_event(keys_device);
+	keys_perf_call_done(keys_device, start);
 
-	int ret_val = poll(fds, 1, 0);
+	return NYX_ERROR_NONE;
+}
 
-	if (ret_val <= 0)
+/**
+ * @brief Take up to max ready key events in one call.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. Hands out
+ * what calling keys_get_event() until it returns no event would, stopping
+ * early once max events are taken, but is counted (and read with) as a
+ * single call. Events go back through keys_release_events() or one at a
+ * time through keys_release_event().
+ *
+ * @param count out: number of events stored in events
+ */
+nyx_error_t keys_get_events(nyx_device_t *d, nyx_event_t **events,
+                            unsigned int max, unsigned int *count)
+{
+	keys_device_t *keys_device = (keys_device_t *) d;
+	uint64_t start;
+	unsigned int n = 0;
+
+	if (NULL == d)
 	{
-		return 0;
+		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-	if (fds[0].revents & POLLIN)
+	if (NULL == events || NULL == count)
 	{
-		/* keep looping if get EINTR */
-		for (;;)
-		{
-			rd = read(fds[0].fd, pEvents, sizeof(InputEvent_t) * maxEvents);
+		return NYX_ERROR_INVALID_VALUE;
+	}
 
-			if (rd > 0)
-			{
-				numEvents += rd / sizeof(InputEvent_t);
-				break;
-			}
-			else if (rd < 0 && errno != EINTR)
-			{
-				nyx_error(MSGID_NYX_QMUX_KEY_EVENT_READ_ERR, 0, "Failed to read events from keypad event file");
-				return -1;
-			}
-		}
+	if (G_UNLIKELY(event_ring_active(&keys_device->ring)))
+	{
+		*count = 0;
+		return NYX_ERROR_INVALID_OPERATION;
 	}
 
-	return numEvents;
-}
+	start = perf_call_begin(&keys_device->perf);
 
-#define MAX_EVENTS      64
+	while (n < max && (events[n] = keys_next_event(keys_device)) != NULL)
+	{
+		n++;
+	}
 
-nyx_error_t keys_get_event(nyx_device_t *d, nyx_event_t **e)
-{
-	static InputEvent_t raw_events[MAX_EVENTS];
+	keys_perf_call_done(keys_device, start);
+	*count = n;
 
-	static int event_count = 0;
-	static int event_iter = 0;
+	return NYX_ERROR_NONE;
+}
 
+/**
+ * @brief Release count events, as taken by keys_get_events().
+ *
+ * NULL entries are skipped, and reported once all others are released.
+ */
+nyx_error_t keys_release_events(nyx_device_t *d, nyx_event_t **events,
+                                unsigned int count)
+{
 	keys_device_t *keys_device = (keys_device_t *) d;
+	nyx_error_t ret = NYX_ERROR_NONE;
+	unsigned int i;
 
-	/*
-	 * Event bookkeeping...
-	 */
-	if (!event_iter)
+	if (NULL == d)
 	{
-		event_count = read_input_event(raw_events, MAX_EVENTS);
-		keys_device->current_event_ptr = NULL;
+		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-	if (keys_device->current_event_ptr == NULL)
+	if (NULL == events && count > 0)
 	{
-		/*
-		 * let's allocate new event and hold it here.
-		 */
-		keys_device->current_event_ptr = keys_event_create();
+		return NYX_ERROR_INVALID_VALUE;
 	}
 
-	for (; event_iter < event_count;)
+	for (i = 0; i < count; i++)
 	{
-		InputEvent_t *input_event_ptr;
-		input_event_ptr = &raw_events[event_iter];
-		event_iter++;
-
-		if (input_event_ptr->type == EV_KEY)
+		if (NULL == events[i])
 		{
-			keys_device->current_event_ptr->key_type = NYX_KEY_TYPE_STANDARD;
-			keys_device->current_event_ptr->key = lookup_key(keys_device,
-			                                      input_event_ptr->code, input_event_ptr->value,
-			                                      &keys_device->current_event_ptr->key_type);
+			ret = NYX_ERROR_INVALID_HANDLE;
+			continue;
 		}
-		else
+
+		if (event_pool_put(&keys_device->event_pool, events[i]))
 		{
-			continue;
+			/* The last ones held past nyx_module_close() */
+			free(keys_device);
+			break;
 		}
+	}
 
-		keys_device->current_event_ptr->key_is_press
-		    = (input_event_ptr->value) ? true : false;
-		keys_device->current_event_ptr->key_is_auto_repeat
-		    = (input_event_ptr->value > 1) ? true : false;
+	return ret;
+}
 
-		*e = (nyx_event_t *) keys_device->current_event_ptr;
-		keys_device->current_event_ptr = NULL;
+/* Drains the keyboards into the ring for as long as the module is open */
+static void *
+keys_ring_thread(void *arg)
+{
+	keys_device_t *keys_device = (keys_device_t *) arg;
+	nyx_event_t *event;
+	uint64_t start;
 
-		/*
-		 * Generated event, bail out and let the caller know.
-		 */
-		if (NULL != *e)
+	while (event_ring_wait(&keys_device->ring, keys_device->input.epoll_fd))
+	{
+		start = perf_call_begin(&keys_device->perf);
+
+		while ((event = keys_next_event(keys_device)) != NULL)
 		{
-			break;
+			if (!event_ring_push(&keys_device->ring, event, sizeof(nyx_event_keys_t)))
+			{
+				perf_count(&keys_device->perf, PERF_EVENTS_DROPPED, 1);
+			}
+
+			event_pool_put(&keys_device->event_pool, event);
 		}
+
+		event_ring_publish(&keys_device->ring);
+		keys_perf_call_done(keys_device, start);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Switch to delivering events through a shared memory ring.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. From now
+ * on a thread of the module reads the keyboards and writes every
+ * nyx_event_keys_t into a ring of slots slots, see event_ring.h.
+ * keys_get_event_source() then returns the ring's eventfd and
+ * keys_get_event() is no longer available. The ring stays until the
+ * module is closed; asking again returns it.
+ *
+ * @param slots a power of two
+ * @param fd out: the ring's memfd, owned by the module; map it with
+ *           event_ring_open() or pass it to another process
+ */
+nyx_error_t keys_open_event_ring(nyx_device_t *d, unsigned int slots, int *fd)
+{
+	keys_device_t *keys_device = (keys_device_t *) d;
+
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == fd)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	if (event_ring_active(&keys_device->ring))
+	{
+		*fd = keys_device->ring.memfd;
+		return NYX_ERROR_NONE;
+	}
+
+	if (event_ring_create(&keys_device->ring, "nyx-keys", sizeof(nyx_event_keys_t),
+	                      slots) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_KEY_RING_ERR, 0, "Cannot create a %u slot event ring: %d",
+		          slots, errno);
+		return EINVAL == errno ? NYX_ERROR_INVALID_VALUE : NYX_ERROR_GENERIC;
+	}
+
+	if (pthread_create(&keys_device->ring_thread, NULL, keys_ring_thread,
+	                   keys_device) != 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_KEY_RING_ERR, 0, "Cannot start the event ring thread");
+		event_ring_destroy(&keys_device->ring);
+		return NYX_ERROR_GENERIC;
+	}
+
+	*fd = keys_device->ring.memfd;
+
+	return NYX_ERROR_NONE;
+}
+
+/**
+ * @brief Copy out the module's performance counters.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. values
+ * is indexed by perf_counter_t; count limits how many are written.
+ *
+ * @param count in: room in values, out: number of values written
+ */
+nyx_error_t keys_query_perf_counters(nyx_device_t *d, uint64_t *values,
+                                     unsigned int *count)
+{
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-	if (event_iter >= event_count)
+	if (NULL == values || NULL == count)
 	{
-		event_iter = 0;
+		return NYX_ERROR_INVALID_VALUE;
 	}
 
+	*count = perf_counters_read(&((keys_device_t *) d)->perf, values, *count);
+
 	return NYX_ERROR_NONE;
 }
 
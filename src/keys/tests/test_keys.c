@@ -0,0 +1,663 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <glib.h>
+#include <stdio.h>
+#include <poll.h>
+
+#ifndef g_assert_true
+#define g_assert_true(X) g_assert((X))
+#endif
+
+#ifndef g_assert_nonnull
+#define g_assert_nonnull(X) g_assert((X) != NULL)
+#endif
+
+//
+// Pull in the relevant nyx headers. That way we can redefine macros
+// if necessary (e.g. for logging) and the anti-recursion in the headers
+// will let our redefinitions leak through into the UUT.
+//
+#include <nyx/nyx_module.h>
+#include <nyx/module/nyx_utils.h>
+
+//
+// Mock out all the calls to nyx-lib
+//
+#undef nyx_info
+#define nyx_info(m, args...) {}
+#undef nyx_debug
+#define nyx_debug(m, args...) {}
+#undef nyx_warn
+#define nyx_warn(m, args...) {}
+#undef nyx_error
+#define nyx_error(m, args...) {}
+
+static nyx_instance_t the_instance = "an instance";
+
+nyx_error_t nyx_module_register_method(nyx_instance_t instance,
+                                       nyx_device_t *device_in_ptr,
+                                       module_method_t method,
+                                       const char *symbol_str)
+{
+	g_assert_true(instance == the_instance);
+	return NYX_ERROR_NONE;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+// Pull in the unit under test
+#include "../keys.c"
+
+//*****************************************************************************
+//*****************************************************************************
+
+//
+// The switch based translation the keymap table replaced, kept as the
+// reference for the table contents and as the benchmark baseline.
+//
+static int switch_lookup_key(uint16_t keyCode, nyx_key_type_t *key_type_out_ptr)
+{
+	int key = keyCode;
+
+	*key_type_out_ptr = NYX_KEY_TYPE_CUSTOM;
+
+	switch (keyCode)
+	{
+		case KEY_Q:
+		case KEY_HOME:
+			key = NYX_KEYS_CUSTOM_KEY_HOME;
+			break;
+
+		case KEY_HOMEPAGE:
+		case KEY_W:
+			key = NYX_KEYS_CUSTOM_KEY_HOT;
+			break;
+
+		case KEY_BACK:
+		case KEY_E:
+			key = NYX_KEYS_CUSTOM_KEY_BACK;
+			break;
+
+		case KEY_VOLUMEUP:
+			key = NYX_KEYS_CUSTOM_KEY_VOL_UP;
+			break;
+
+		case KEY_VOLUMEDOWN:
+			key = NYX_KEYS_CUSTOM_KEY_VOL_DOWN;
+			break;
+
+		case KEY_END:
+			key = NYX_KEYS_CUSTOM_KEY_POWER_ON;
+			break;
+
+		case KEY_PLAY:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PLAY;
+			break;
+
+		case KEY_PAUSE:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PAUSE;
+			break;
+
+		case KEY_STOP:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_STOP;
+			break;
+
+		case KEY_NEXT:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_NEXT;
+			break;
+
+		case KEY_PREVIOUS:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_PREVIOUS;
+			break;
+
+		case KEY_SEARCH:
+			key = NYX_KEYS_CUSTOM_KEY_SEARCH;
+			break;
+
+		case KEY_BRIGHTNESSDOWN:
+			key = NYX_KEYS_CUSTOM_KEY_BRIGHTNESS_DOWN;
+			break;
+
+		case KEY_BRIGHTNESSUP:
+			key = NYX_KEYS_CUSTOM_KEY_BRIGHTNESS_UP;
+			break;
+
+		case KEY_MUTE:
+			key = NYX_KEYS_CUSTOM_KEY_VOL_MUTE;
+			break;
+
+		case KEY_REWIND:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_REWIND;
+			break;
+
+		case KEY_FASTFORWARD:
+			key = NYX_KEYS_CUSTOM_KEY_MEDIA_FASTFORWARD;
+			break;
+
+		default:
+			*key_type_out_ptr = NYX_KEY_TYPE_STANDARD;
+			break;
+	}
+
+	return key;
+}
+
+static keys_device_t *open_keys(void)
+{
+	nyx_device_t *device = NULL;
+
+	g_assert_true(nyx_module_open(the_instance, &device) == NYX_ERROR_NONE);
+	g_assert_nonnull(device);
+	return (keys_device_t *) device;
+}
+
+//
+// The table must agree with the old switch for every keycode, apart from
+// the function keys which it now translates.
+//
+static void test_keymap_default(void)
+{
+	keys_device_t *device;
+	int code;
+
+	g_unsetenv(KEYS_KEYMAP_ENV);
+	device = open_keys();
+
+	for (code = 0; code < KEY_CNT; code++)
+	{
+		nyx_key_type_t table_type, switch_type;
+		int table_key = lookup_key(device, code, 1, &table_type);
+		int switch_key = switch_lookup_key(code, &switch_type);
+
+		if (code >= KEY_F1 && code <= KEY_F10)
+		{
+			g_assert_cmpint(table_key, ==, F1 + (code - KEY_F1));
+			g_assert_cmpint(table_type, ==, NYX_KEY_TYPE_STANDARD);
+			continue;
+		}
+
+		g_assert_cmpint(table_key, ==, switch_key);
+		g_assert_cmpint(table_type, ==, switch_type);
+	}
+
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+}
+
+//
+// A keymap file overrides individual entries and leaves the rest alone
+//
+static void test_keymap_file(void)
+{
+	const gchar *keymap =
+	    "# test keymap\n"
+	    "16 back\n"
+	    "0x1e 0x41\n"
+	    "17 no_such_key\n"
+	    "99999 home\n";
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.keymap", NULL);
+	keys_device_t *device;
+	nyx_key_type_t type;
+
+	g_assert_true(g_file_set_contents(path, keymap, -1, NULL));
+	g_setenv(KEYS_KEYMAP_ENV, path, TRUE);
+	device = open_keys();
+
+	g_assert_cmpint(lookup_key(device, KEY_Q, 1, &type), ==,
+	                NYX_KEYS_CUSTOM_KEY_BACK);
+	g_assert_cmpint(type, ==, NYX_KEY_TYPE_CUSTOM);
+	g_assert_cmpint(lookup_key(device, KEY_A, 1, &type), ==, 0x41);
+	g_assert_cmpint(type, ==, NYX_KEY_TYPE_STANDARD);
+
+	// Invalid lines keep the built-in translation
+	g_assert_cmpint(lookup_key(device, KEY_W, 1, &type), ==,
+	                NYX_KEYS_CUSTOM_KEY_HOT);
+
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+	g_unsetenv(KEYS_KEYMAP_ENV);
+	unlink(path);
+	g_free(path);
+}
+
+static void
+log_key(evdev_log_recorder_t *recorder, uint16_t code, int32_t value, int ms)
+{
+	InputEvent_t events[2];
+
+	memset(events, 0, sizeof(events));
+	events[0].time.tv_sec = events[1].time.tv_sec = 1000;
+	events[0].time.tv_usec = events[1].time.tv_usec = ms * 1000;
+	events[0].type = EV_KEY;
+	events[0].code = code;
+	events[0].value = value;
+	events[1].type = EV_SYN;
+	events[1].code = SYN_REPORT;
+
+	g_assert_cmpint(evdev_log_record(recorder, events, sizeof(events)), ==, 0);
+}
+
+static const uint16_t log_codes[] = { KEY_A, KEY_Q, KEY_VOLUMEUP, KEY_F3 };
+
+/* Open the module on a fast replay of a press and release of each code */
+static keys_device_t *open_log_replay(const char *path)
+{
+	evdev_log_recorder_t recorder = { 0 };
+	evdev_log_info_t info = { 0 };
+	unsigned int i;
+
+	unlink(path);
+	g_assert_cmpint(evdev_log_recorder_open(&recorder, path, &info), ==, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(log_codes); i++)
+	{
+		log_key(&recorder, log_codes[i], 1, 20 * i);
+		log_key(&recorder, log_codes[i], 0, 20 * i + 10);
+	}
+
+	g_assert_cmpint(evdev_log_recorder_close(&recorder), ==, 0);
+
+	g_unsetenv(KEYS_KEYMAP_ENV);
+	g_setenv(KEYS_REPLAY_ENV, path, TRUE);
+	g_setenv(EVDEV_LOG_PACE_ENV, "fast", TRUE);
+	return open_keys();
+}
+
+static void close_log_replay(keys_device_t *device, gchar *path)
+{
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+	g_unsetenv(KEYS_REPLAY_ENV);
+	g_unsetenv(EVDEV_LOG_PACE_ENV);
+	unlink(path);
+	g_free(path);
+}
+
+static void check_log_key(keys_device_t *device, nyx_event_t *event,
+                          unsigned int seen)
+{
+	nyx_event_keys_t *key = (nyx_event_keys_t *) event;
+	nyx_key_type_t type;
+
+	g_assert_cmpuint(seen, <, 2 * G_N_ELEMENTS(log_codes));
+	g_assert_cmpint(key->key, ==, lookup_key(device, log_codes[seen / 2], 1, &type));
+	g_assert_true(key->key_is_press == !(seen & 1));
+}
+
+//
+// A logged key sequence replays through the keymap in order, with the
+// event source readable until it is done.
+//
+static void test_replay_log(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	keys_device_t *device = open_log_replay(path);
+	nyx_event_t *event;
+	struct pollfd pfd;
+	unsigned int seen = 0;
+
+	g_assert_true(keys_get_event_source((nyx_device_t *) device,
+	                                    &pfd.fd) == NYX_ERROR_NONE);
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, 0) > 0)
+	{
+		for (;;)
+		{
+			g_assert_true(keys_get_event((nyx_device_t *) device,
+			                             &event) == NYX_ERROR_NONE);
+
+			if (NULL == event)
+			{
+				break;
+			}
+
+			check_log_key(device, event, seen++);
+			keys_release_event((nyx_device_t *) device, event);
+		}
+	}
+
+	g_assert_cmpuint(seen, ==, 2 * G_N_ELEMENTS(log_codes));
+	close_log_replay(device, path);
+}
+
+//
+// The bulk calls hand out the same keys, at most max per call, and count
+// as one call each.
+//
+static void test_bulk_events(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	keys_device_t *device = open_log_replay(path);
+	nyx_event_t *events[3];
+	unsigned int count, i, calls = 0, seen = 0;
+	uint64_t values[PERF_COUNTER_COUNT];
+
+	g_assert_true(keys_get_events(NULL, events, 3, &count) == NYX_ERROR_INVALID_HANDLE);
+	g_assert_true(keys_get_events((nyx_device_t *) device, NULL, 3,
+	                              &count) == NYX_ERROR_INVALID_VALUE);
+
+	do
+	{
+		g_assert_true(keys_get_events((nyx_device_t *) device, events,
+		                              G_N_ELEMENTS(events), &count) == NYX_ERROR_NONE);
+		g_assert_cmpuint(count, <=, G_N_ELEMENTS(events));
+		calls++;
+
+		for (i = 0; i < count; i++)
+		{
+			check_log_key(device, events[i], seen++);
+		}
+
+		g_assert_true(keys_release_events((nyx_device_t *) device, events,
+		                                  count) == NYX_ERROR_NONE);
+	}
+	while (count > 0);
+
+	g_assert_cmpuint(seen, ==, 2 * G_N_ELEMENTS(log_codes));
+	g_assert_cmpuint(device->event_pool.fallback_allocs, ==, 0);
+
+	count = PERF_COUNTER_COUNT;
+	g_assert_true(keys_query_perf_counters((nyx_device_t *) device, values,
+	                                       &count) == NYX_ERROR_NONE);
+	g_assert_cmpuint(values[PERF_CALLS], ==, calls);
+	g_assert_cmpuint(values[PERF_EVENTS_EMITTED], ==, seen);
+
+	events[0] = NULL;
+	g_assert_true(keys_release_events((nyx_device_t *) device, events,
+	                                  1) == NYX_ERROR_INVALID_HANDLE);
+
+	close_log_replay(device, path);
+}
+
+//
+// The pool size comes from the environment at open, invalid values keep
+// the default and a size of 0 mallocs every event.
+//
+static void test_event_pool_env(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	keys_device_t *device;
+	nyx_event_t *events[2 * G_N_ELEMENTS(log_codes)];
+	unsigned int count, tries;
+
+	g_setenv(KEYS_EVENT_POOL_ENV, "4x", TRUE);
+	device = open_log_replay(path);
+	g_assert_cmpuint(device->event_pool.high_water, ==, KEYS_EVENT_POOL_SIZE);
+	close_log_replay(device, path);
+
+	path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	g_setenv(KEYS_EVENT_POOL_ENV, "0", TRUE);
+	device = open_log_replay(path);
+	g_assert_cmpuint(device->event_pool.high_water, ==, 0);
+
+	/* Wait for the replay to be read in full */
+	for (count = 0, tries = 0; count < G_N_ELEMENTS(events) && tries < 1000;
+	        tries++)
+	{
+		unsigned int n;
+
+		g_assert_true(keys_get_events((nyx_device_t *) device, events + count,
+		                              G_N_ELEMENTS(events) - count,
+		                              &n) == NYX_ERROR_NONE);
+		count += n;
+
+		if (0 == n)
+		{
+			g_usleep(1000);
+		}
+	}
+
+	g_assert_cmpuint(count, ==, G_N_ELEMENTS(events));
+	g_assert_cmpuint(device->event_pool.fallback_allocs, ==, count);
+	g_assert_true(keys_release_events((nyx_device_t *) device, events,
+	                                  count) == NYX_ERROR_NONE);
+
+	g_unsetenv(KEYS_EVENT_POOL_ENV);
+	close_log_replay(device, path);
+}
+
+//
+// An event still held at close stays readable, and releasing it then
+// frees what is left of the device.
+//
+static void test_close_held_event(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	keys_device_t *device = open_log_replay(path);
+	nyx_event_keys_t *key;
+	nyx_event_t *event = NULL;
+	nyx_key_type_t type;
+	struct pollfd pfd;
+	int expected;
+
+	g_assert_true(keys_get_event_source((nyx_device_t *) device,
+	                                    &pfd.fd) == NYX_ERROR_NONE);
+	pfd.events = POLLIN;
+
+	while (NULL == event && poll(&pfd, 1, 1000) > 0)
+	{
+		g_assert_true(keys_get_event((nyx_device_t *) device,
+		                             &event) == NYX_ERROR_NONE);
+	}
+
+	g_assert_nonnull(event);
+	expected = lookup_key(device, log_codes[0], 1, &type);
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+
+	key = (nyx_event_keys_t *) event;
+	g_assert_cmpint(key->key, ==, expected);
+	g_assert_true(key->key_is_press);
+	g_assert_true(keys_release_event((nyx_device_t *) device,
+	                                 event) == NYX_ERROR_NONE);
+
+	g_unsetenv(KEYS_REPLAY_ENV);
+	g_unsetenv(EVDEV_LOG_PACE_ENV);
+	unlink(path);
+	g_free(path);
+}
+
+//
+// Through the ring the same keys arrive, read in place.
+//
+static void test_ring_events(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_keys.evlog", NULL);
+	keys_device_t *device = open_log_replay(path);
+	const nyx_event_t *event;
+	event_ring_t ring;
+	struct pollfd pfd;
+	unsigned int seen = 0;
+	int memfd;
+
+	g_assert_true(keys_open_event_ring((nyx_device_t *) device, 16,
+	                                   &memfd) == NYX_ERROR_NONE);
+	g_assert_true(keys_get_event_source((nyx_device_t *) device,
+	                                    &pfd.fd) == NYX_ERROR_NONE);
+	g_assert_cmpint(pfd.fd, !=, device->input.epoll_fd);
+	g_assert_cmpint(event_ring_open(&ring, memfd, pfd.fd), ==, 0);
+	pfd.events = POLLIN;
+
+	while (seen < 2 * G_N_ELEMENTS(log_codes))
+	{
+		g_assert_cmpint(poll(&pfd, 1, 1000), ==, 1);
+		event_ring_ack(&ring);
+
+		while ((event = (const nyx_event_t *) event_ring_peek(&ring)) != NULL)
+		{
+			check_log_key(device, (nyx_event_t *) event, seen++);
+			event_ring_pop(&ring);
+		}
+	}
+
+	g_assert_cmpuint(event_ring_dropped(&ring), ==, 0);
+	event_ring_destroy(&ring);
+	close_log_replay(device, path);
+}
+
+/* A memfd holding just a ring header that claims the given geometry */
+static int fake_ring_fd(uint32_t slot_size, uint32_t slot_count, off_t size,
+                        bool seal)
+{
+	event_ring_header_t header;
+	int fd = syscall(SYS_memfd_create, "test-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	g_assert_cmpint(fd, >=, 0);
+	memset(&header, 0, sizeof(header));
+	header.magic = EVENT_RING_MAGIC;
+	header.version = EVENT_RING_VERSION;
+	header.slot_size = slot_size;
+	header.slot_count = slot_count;
+	g_assert_cmpint(ftruncate(fd, size), ==, 0);
+	g_assert_cmpint(pwrite(fd, &header, sizeof(header), 0), ==, sizeof(header));
+
+	if (seal)
+	{
+		g_assert_cmpint(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW), ==, 0);
+	}
+
+	return fd;
+}
+
+//
+// A consumer only maps what the memfd really backs, and never takes the
+// slot size from the shared header again once it is open.
+//
+static void test_ring_open_checks(void)
+{
+	const size_t header = sizeof(event_ring_header_t);
+	event_ring_t producer, consumer;
+	int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	unsigned int i;
+	struct
+	{
+		uint32_t slot_size, slot_count;
+		off_t size;
+		bool seal;
+	} bad[] =
+	{
+		{ 64, 4, header + 64 * 4, false },          /* can still shrink */
+		{ 64, 1u << 20, header + 64 * 4, true },    /* shorter than claimed */
+		{ 0xffffffc0, 1u << 31, header, true },     /* larger than any file */
+		{ 0, 4, header, true },
+		{ 48, 4, header + 48 * 4, true },           /* slots not cache line aligned */
+		{ 64, 3, header + 64 * 3, true },
+	};
+
+	g_assert_cmpint(event_fd, >=, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(bad); i++)
+	{
+		int fd = fake_ring_fd(bad[i].slot_size, bad[i].slot_count, bad[i].size,
+		                      bad[i].seal);
+
+		g_assert_cmpint(event_ring_open(&consumer, fd, event_fd), ==, -1);
+		g_assert_false(event_ring_active(&consumer));
+		close(fd);
+	}
+
+	g_assert_cmpuint(event_ring_map_size(1u << 31, SIZE_MAX / 2), ==, 0);
+
+	g_assert_cmpint(event_ring_create(&producer, "test-ring", 16, 4), ==, 0);
+	g_assert_cmpint(event_ring_open(&consumer, producer.memfd, event_fd), ==, 0);
+	g_assert_cmpuint(consumer.slot_size, ==, EVENT_RING_CACHE_LINE);
+
+	/* A peer rewriting the header can't move either side's slots */
+	consumer.header->slot_size = 0xffffffc0;
+	g_assert_true(event_ring_push(&producer, "ring", 5));
+	g_assert_true(event_ring_push(&producer, "ring", 5));
+	event_ring_publish(&producer);
+	g_assert_true(event_ring_peek(&consumer) == consumer.slots);
+	event_ring_pop(&consumer);
+	g_assert_true(event_ring_peek(&consumer) == consumer.slots + EVENT_RING_CACHE_LINE);
+	g_assert_cmpstr((const char *) event_ring_peek(&consumer), ==, "ring");
+
+	event_ring_destroy(&consumer);
+	event_ring_destroy(&producer);
+	close(event_fd);
+}
+
+#define BENCH_ITERATIONS 20000000
+
+//
+// Compare the table lookup against the old switch over a mix of keycodes.
+// Only runs in perf mode (-m perf).
+//
+static void test_keymap_benchmark(void)
+{
+	static const uint16_t codes[] =
+	{
+		KEY_A, KEY_Q, KEY_VOLUMEUP, KEY_LEFTSHIFT, KEY_FASTFORWARD,
+		KEY_SPACE, KEY_HOME, KEY_ENTER, KEY_BACK, KEY_F5, KEY_UP, KEY_MUTE,
+		KEY_Z, KEY_SEARCH, KEY_BACKSPACE, KEY_END
+	};
+	keys_device_t *device;
+	nyx_key_type_t type;
+	volatile int sink = 0;
+	GTimer *timer;
+	double table_s, switch_s;
+	int i;
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	g_unsetenv(KEYS_KEYMAP_ENV);
+	device = open_keys();
+	timer = g_timer_new();
+
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		sink += lookup_key(device, codes[i & (G_N_ELEMENTS(codes) - 1)], 1, &type);
+	}
+
+	table_s = g_timer_elapsed(timer, NULL);
+	g_timer_start(timer);
+
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+	{
+		sink += switch_lookup_key(codes[i & (G_N_ELEMENTS(codes) - 1)], &type);
+	}
+
+	switch_s = g_timer_elapsed(timer, NULL);
+
+	g_test_minimized_result(table_s * 1e9 / BENCH_ITERATIONS,
+	                        "table lookup: %.2f ns/key", table_s * 1e9 / BENCH_ITERATIONS);
+	g_test_minimized_result(switch_s * 1e9 / BENCH_ITERATIONS,
+	                        "switch lookup: %.2f ns/key", switch_s * 1e9 / BENCH_ITERATIONS);
+
+	g_timer_destroy(timer);
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+}
+
+//
+// Set-up GLib, then register and run the tests.
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/keys/keymap/default", test_keymap_default);
+	g_test_add_func("/keys/keymap/file", test_keymap_file);
+	g_test_add_func("/keys/keymap/benchmark", test_keymap_benchmark);
+	g_test_add_func("/keys/replay/log", test_replay_log);
+	g_test_add_func("/keys/bulk/events", test_bulk_events);
+	g_test_add_func("/keys/ring/events", test_ring_events);
+	g_test_add_func("/keys/ring/open_checks", test_ring_open_checks);
+	g_test_add_func("/keys/pool/env", test_event_pool_env);
+	g_test_add_func("/keys/close/held_event", test_close_held_event);
+
+	return g_test_run();
+}
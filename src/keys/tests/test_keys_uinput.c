@@ -0,0 +1,455 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// End to end latency and throughput of KeysMain against a uinput keyboard:
+// every key goes through the kernel input core and evdev before the module
+// reads it. Needs write access to /dev/uinput; the tests are skipped
+// without it. Run with -m perf for the long version.
+//
+
+#include <glib.h>
+#include <stdio.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/sysmacros.h>
+#include <linux/uinput.h>
+
+#ifndef g_assert_true
+#define g_assert_true(X) g_assert((X))
+#endif
+
+//
+// Pull in the relevant nyx headers. That way we can redefine macros
+// if necessary (e.g. for logging) and the anti-recursion in the headers
+// will let our redefinitions leak through into the UUT.
+//
+#include <nyx/nyx_module.h>
+#include <nyx/module/nyx_utils.h>
+
+//
+// Mock out all the calls to nyx-lib
+//
+#undef nyx_info
+#define nyx_info(m, args...) {}
+#undef nyx_debug
+#define nyx_debug(m, args...) {}
+#undef nyx_warn
+#define nyx_warn(m, args...) {}
+#undef nyx_error
+#define nyx_error(m, args...) {}
+
+static nyx_instance_t the_instance = "an instance";
+
+nyx_error_t nyx_module_register_method(nyx_instance_t instance,
+                                       nyx_device_t *device_in_ptr,
+                                       module_method_t method,
+                                       const char *symbol_str)
+{
+	g_assert_true(instance == the_instance);
+	return NYX_ERROR_NONE;
+}
+
+//*****************************************************************************
+
+// Pull in the unit under test
+#include "../keys.c"
+
+//*****************************************************************************
+//*****************************************************************************
+
+#define UINPUT_DEVICE       "/dev/uinput"
+#define ATTACH_TIMEOUT_MS   5000
+#define EVENT_TIMEOUT_MS    1000
+
+/*
+ * Keys nothing reacts to. KEY_A and KEY_ENTER are only declared so that the
+ * module takes the device for a keyboard; they are never pressed.
+ */
+#define FIRST_TEST_KEY      KEY_F13
+#define NUM_TEST_KEYS       12
+
+typedef struct
+{
+	int uinput_fd;
+	dev_t rdev;                 /**< of the evdev node the kernel made for it */
+	keys_device_t *device;
+	unsigned int reads;         /**< batches read by the module */
+} harness_t;
+
+static inline int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Device number of the eventN node under the uinput device's sysfs entry */
+static bool
+uinput_find_rdev(int fd, dev_t *rdev)
+{
+	char sysname[64], path[PATH_MAX], *contents;
+	unsigned int major, minor;
+	struct dirent *entry;
+	bool found = false;
+	DIR *dir;
+
+	if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+	{
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	dir = opendir(path);
+
+	if (NULL == dir)
+	{
+		return false;
+	}
+
+	while (!found && (entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, "event", 5) != 0)
+		{
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s/%s/dev",
+		         sysname, entry->d_name);
+
+		if (g_file_get_contents(path, &contents, NULL, NULL))
+		{
+			found = 2 == sscanf(contents, "%u:%u", &major, &minor);
+			*rdev = makedev(major, minor);
+			g_free(contents);
+		}
+	}
+
+	closedir(dir);
+	return found;
+}
+
+static bool
+uinput_create(harness_t *h)
+{
+	struct uinput_user_dev setup;
+	int code;
+
+	h->uinput_fd = open(UINPUT_DEVICE, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+
+	if (h->uinput_fd < 0)
+	{
+		return false;
+	}
+
+	ioctl(h->uinput_fd, UI_SET_EVBIT, EV_SYN);
+	ioctl(h->uinput_fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(h->uinput_fd, UI_SET_KEYBIT, KEY_A);
+	ioctl(h->uinput_fd, UI_SET_KEYBIT, KEY_ENTER);
+
+	for (code = FIRST_TEST_KEY; code < FIRST_TEST_KEY + NUM_TEST_KEYS; code++)
+	{
+		ioctl(h->uinput_fd, UI_SET_KEYBIT, code);
+	}
+
+	memset(&setup, 0, sizeof(setup));
+	snprintf(setup.name, sizeof(setup.name), "nyx keys latency harness");
+	setup.id.bustype = BUS_VIRTUAL;
+
+	if (write(h->uinput_fd, &setup, sizeof(setup)) != sizeof(setup) ||
+	        ioctl(h->uinput_fd, UI_DEV_CREATE) < 0 ||
+	        !uinput_find_rdev(h->uinput_fd, &h->rdev))
+	{
+		close(h->uinput_fd);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+uinput_emit(harness_t *h, uint16_t code, int32_t value)
+{
+	struct input_event events[2];
+
+	memset(events, 0, sizeof(events));
+	events[0].type = EV_KEY;
+	events[0].code = code;
+	events[0].value = value;
+	events[1].type = EV_SYN;
+	events[1].code = SYN_REPORT;
+
+	g_assert_true(write(h->uinput_fd, events, sizeof(events)) == sizeof(events));
+}
+
+/* Next key event from the module, or NULL after EVENT_TIMEOUT_MS */
+static nyx_event_keys_t *
+receive(harness_t *h, int timeout_ms)
+{
+	int64_t deadline = now_ns() + timeout_ms * 1000000LL;
+	struct pollfd pfd;
+	nyx_event_t *event;
+	int fd;
+
+	g_assert_true(keys_get_event_source((nyx_device_t *) h->device, &fd) ==
+	              NYX_ERROR_NONE);
+
+	for (;;)
+	{
+		bool batch = 0 == h->device->event_iter;
+
+		event = NULL;
+		g_assert_true(keys_get_event((nyx_device_t *) h->device, &event) ==
+		              NYX_ERROR_NONE);
+
+		if (event)
+		{
+			h->reads += batch;
+			return (nyx_event_keys_t *) event;
+		}
+
+		if (now_ns() >= deadline)
+		{
+			return NULL;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 10);
+	}
+}
+
+//
+// Create the keyboard, open the module and wait for its hot-plug set to
+// pick the keyboard up. Any other keyboard it found is dropped, so only
+// scripted keys arrive.
+//
+static bool
+harness_open(harness_t *h)
+{
+	int64_t deadline;
+	int i;
+
+	memset(h, 0, sizeof(*h));
+
+	if (!uinput_create(h))
+	{
+		g_test_skip("no usable " UINPUT_DEVICE);
+		return false;
+	}
+
+	/* Keep the keys away from the console and everything else */
+	g_setenv(EVDEV_GRAB_ENV, "1", TRUE);
+	g_assert_true(nyx_module_open(the_instance,
+	                              (nyx_device_t **) &h->device) == NYX_ERROR_NONE);
+	g_unsetenv(EVDEV_GRAB_ENV);
+
+	deadline = now_ns() + ATTACH_TIMEOUT_MS * 1000000LL;
+
+	for (;;)
+	{
+		evdev_hotplug_t *input = &h->device->input;
+		bool attached = false;
+
+		for (i = input->node_count - 1; i >= 0; i--)
+		{
+			if (input->nodes[i].rdev == h->rdev)
+			{
+				attached = true;
+			}
+			else
+			{
+				evdev_hotplug_remove(input, i);
+			}
+		}
+
+		if (attached)
+		{
+			return true;
+		}
+
+		/* The node may still be on its way from udev */
+		g_assert_true(now_ns() < deadline);
+		g_assert_true(NULL == receive(h, 50));
+	}
+}
+
+static void
+harness_close(harness_t *h)
+{
+	g_assert_true(nyx_module_close((nyx_device_t *) h->device) == NYX_ERROR_NONE);
+	ioctl(h->uinput_fd, UI_DEV_DESTROY);
+	close(h->uinput_fd);
+}
+
+static void
+expect_key(harness_t *h, nyx_event_keys_t *event, uint16_t code, int32_t value)
+{
+	nyx_key_type_t type;
+
+	g_assert_true(event != NULL);
+	g_assert_cmpint(event->key, ==, lookup_key(h->device, code, value, &type));
+	g_assert_true(event->key_is_press == (value != 0));
+	g_assert_true(event->key_is_auto_repeat == (value > 1));
+
+	keys_release_event((nyx_device_t *) h->device, (nyx_event_t *) event);
+}
+
+/* Press, then repeat, then release: value 1, 2 * repeats, 0 */
+#define SCRIPT_LEN(repeats)     ((repeats) + 2)
+
+static int32_t
+script_value(int step, int repeats)
+{
+	return step == 0 ? 1 : step <= repeats ? 2 : 0;
+}
+
+#define HISTOGRAM_BUCKETS   24
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+//
+// One key event at a time: latency from the write to uinput until
+// keys_get_event() hands out the matching event.
+//
+static void test_uinput_latency(void)
+{
+	int count = g_test_perf() ? 20000 : 500;
+	unsigned int histogram[HISTOGRAM_BUCKETS] = { 0 };
+	nyx_event_keys_t *event;
+	int64_t *latency;
+	harness_t h;
+	int i, bucket;
+
+	if (!harness_open(&h))
+	{
+		return;
+	}
+
+	latency = g_new(int64_t, count);
+
+	for (i = 0; i < count; i++)
+	{
+		uint16_t code = FIRST_TEST_KEY + (i / SCRIPT_LEN(3)) % NUM_TEST_KEYS;
+		int32_t value = script_value(i % SCRIPT_LEN(3), 3);
+		int64_t t0 = now_ns();
+
+		uinput_emit(&h, code, value);
+		event = receive(&h, EVENT_TIMEOUT_MS);
+		latency[i] = now_ns() - t0;
+
+		expect_key(&h, event, code, value);
+
+		for (bucket = 0; bucket < HISTOGRAM_BUCKETS - 1 &&
+		        latency[i] >= (1000LL << bucket); bucket++);
+
+		histogram[bucket]++;
+	}
+
+	/* Nothing extra may be left over */
+	g_assert_true(NULL == receive(&h, 50));
+
+	qsort(latency, count, sizeof(int64_t), compare_int64);
+
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+	{
+		if (histogram[bucket])
+		{
+			g_test_message("  < %8lld us: %u", (1LL << bucket), histogram[bucket]);
+		}
+	}
+
+	g_test_minimized_result(latency[count / 2] / 1000.0,
+	                        "key latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+	                        latency[count / 2] / 1000.0, latency[count * 99 / 100] / 1000.0,
+	                        latency[count * 999 / 1000] / 1000.0, latency[count - 1] / 1000.0);
+
+	g_free(latency);
+	harness_close(&h);
+}
+
+//
+// Keep window key events in flight: write them in one go, then drain them.
+// Windows stay below the kernel's 64 event evdev client buffer (each key
+// is followed by a SYN_REPORT), so any loss is the module's.
+//
+static void test_uinput_throughput(void)
+{
+	static const int windows[] = { 1, 8, 16, 24 };
+	int total = g_test_perf() ? 100000 : 2000;
+	harness_t h;
+	unsigned int w;
+	int i, k;
+
+	if (!harness_open(&h))
+	{
+		return;
+	}
+
+	for (w = 0; w < G_N_ELEMENTS(windows); w++)
+	{
+		int window = windows[w];
+		int64_t t0 = now_ns(), elapsed;
+
+		h.reads = 0;
+
+		for (i = 0; i < total; i += window)
+		{
+			for (k = i; k < i + window; k++)
+			{
+				uinput_emit(&h, FIRST_TEST_KEY + (k / SCRIPT_LEN(5)) % NUM_TEST_KEYS,
+				            script_value(k % SCRIPT_LEN(5), 5));
+			}
+
+			for (k = i; k < i + window; k++)
+			{
+				expect_key(&h, receive(&h, EVENT_TIMEOUT_MS),
+				           FIRST_TEST_KEY + (k / SCRIPT_LEN(5)) % NUM_TEST_KEYS,
+				           script_value(k % SCRIPT_LEN(5), 5));
+			}
+		}
+
+		elapsed = now_ns() - t0;
+		g_assert_true(NULL == receive(&h, 50));
+
+		g_test_maximized_result(total * 1e9 / elapsed,
+		                        "window %2d: %.0f keys/s, %.1f keys per read",
+		                        window, total * 1e9 / elapsed, (double) total / h.reads);
+	}
+
+	harness_close(&h);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/keys/uinput/latency", test_uinput_latency);
+	g_test_add_func("/keys/uinput/throughput", test_uinput_throughput);
+
+	return g_test_run();
+}
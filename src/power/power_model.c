@@ -0,0 +1,33 @@
+// Copyright (c) 2010-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ * @file power_model.c
+ *
+ * @brief The one power model of the process, see power_model.h.
+ *
+ * Built into libnyx-qemux86-power rather than into either module, so that
+ * the battery and charger modules both resolve it to the same object.
+ */
+
+#include "power_model.h"
+
+power_model_t nyx_qemux86_power_model =
+{
+	.charging_disabled = false,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.battery_notify_fd = -1
+};
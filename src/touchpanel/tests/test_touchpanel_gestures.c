@@ -0,0 +1,311 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef g_assert_true
+#define g_assert_true(X) g_assert((X))
+#endif
+
+//
+// Pull in the relevant nyx headers. That way we can redefine macros
+// if necessary (e.g. for logging) and the anti-recursion in the headers
+// will let our redefinitions leak through into the UUT.
+//
+#include <nyx/module/nyx_log.h>
+
+//
+// Mock out all the calls to nyx-lib
+//
+#undef nyx_info
+#define nyx_info(m, args...) {}
+#undef nyx_debug
+#define nyx_debug(m, args...) {}
+#undef nyx_warn
+#define nyx_warn(m, args...) {}
+#undef nyx_error
+#define nyx_error(m, args...) {}
+
+//*****************************************************************************
+//*****************************************************************************
+
+//
+// Include the UUT directly so we can get at its static functions.
+//
+#include "../touchpanel_common.c"
+#include "../touchpanel_gestures.c"
+
+static void
+set_time_ms(time_stamp_t *ts, int ms)
+{
+	ts->time.tv_sec = 1000 + ms / 1000;
+	ts->time.tv_nsec = (ms % 1000) * 1000000L;
+}
+
+//
+// The ring has a power of two capacity but keeps exactly size coords.
+//
+static void test_coords_capacity(void)
+{
+	static const int sizes[][2] =
+	{
+		{ 1, 1 }, { 2, 2 }, { 5, 8 }, { 6, 8 }, { 8, 8 }, { 9, 16 }, { 16, 16 },
+		{ 0, 1 }, { 40, 16 }
+	};
+	coord_buf_t buf;
+	time_stamp_t ts;
+	unsigned int i;
+	int k, x;
+
+	for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+	{
+		g_assert_true(create_coord_buffer(&buf, sizes[i][0]) == 0);
+		g_assert_cmpint(buf.mask + 1, ==, sizes[i][1]);
+		g_assert_cmpint(buf.size, <=, sizes[i][1]);
+
+		for (k = 0; k < 3 * COORD_BUF_MAX_SIZE; k++)
+		{
+			set_time_ms(&ts, k * 10);
+			update_coord_buffer(&buf, k, -k, &ts, 0);
+			g_assert_cmpint(buf.numItems, ==, MIN(k + 1, buf.size));
+
+			get_last_coords(&buf, &x, NULL, NULL);
+			g_assert_cmpint(x, ==, k);
+			g_assert_cmpint(coord_first(&buf)->x, ==, k + 1 - buf.numItems);
+		}
+	}
+}
+
+//
+// positionFilter pulls every coord one pixel towards the one before it.
+//
+static void test_coords_position_filter(void)
+{
+	static const int in[][2] = { { 10, 10 }, { 15, 10 }, { 15, 4 }, { 14, 5 }, { 20, 20 } };
+	static const int out[][2] = { { 10, 10 }, { 14, 10 }, { 14, 5 }, { 14, 5 }, { 19, 19 } };
+	coord_buf_t buf;
+	time_stamp_t ts;
+	unsigned int i;
+	int x, y;
+
+	create_coord_buffer(&buf, 3);
+
+	for (i = 0; i < G_N_ELEMENTS(in); i++)
+	{
+		set_time_ms(&ts, i * 10);
+		update_coord_buffer(&buf, in[i][0], in[i][1], &ts, 1);
+		get_last_coords(&buf, &x, &y, NULL);
+		g_assert_cmpint(x, ==, out[i][0]);
+		g_assert_cmpint(y, ==, out[i][1]);
+	}
+}
+
+//
+// Constant motion is fitted exactly, also across many ring wraps.
+//
+static void test_coords_velocity(void)
+{
+	coord_buf_t buf;
+	time_stamp_t ts;
+	double vx, vy;
+	int k;
+
+	create_coord_buffer(&buf, 6);
+
+	set_time_ms(&ts, 0);
+	update_coord_buffer(&buf, 100, 100, &ts, 0);
+	get_coord_velocity(&buf, &vx, &vy);
+	g_assert_true(vx == 0 && vy == 0);
+
+	for (k = 1; k < 1000; k++)
+	{
+		set_time_ms(&ts, k * 8);
+		update_coord_buffer(&buf, 100 + 4 * k, 100 - k, &ts, 0);
+	}
+
+	get_coord_velocity(&buf, &vx, &vy);
+	g_assert_cmpfloat(fabs(vx - 500.0), <, 1e-6);
+	g_assert_cmpfloat(fabs(vy + 125.0), <, 1e-6);
+}
+
+//
+// The ring as it was before: heap storage and % indexing, with the same
+// velocity fit. Kept here as the reference for the benchmark.
+//
+typedef struct
+{
+	coord_t *pCoords;
+	int head, tail, numItems, size;
+	coord_fit_t fit;
+} mod_coord_buf_t;
+
+static void
+mod_update_coords(mod_coord_buf_t *pBuf, int x, int y, const time_stamp_t *pTime)
+{
+	if (pBuf->head == pBuf->tail && pBuf->numItems == pBuf->size)
+	{
+		coord_fit_update(&pBuf->fit, &pBuf->pCoords[pBuf->head], -1);
+		pBuf->head = (pBuf->head + 1) % pBuf->size;
+	}
+
+	pBuf->pCoords[pBuf->tail].timeStamp = *pTime;
+	pBuf->pCoords[pBuf->tail].x = x;
+	pBuf->pCoords[pBuf->tail].y = y;
+	coord_fit_update(&pBuf->fit, &pBuf->pCoords[pBuf->tail], 1);
+
+	if (pBuf->numItems < pBuf->size)
+	{
+		pBuf->numItems++;
+	}
+
+	pBuf->tail = (pBuf->tail + 1) % pBuf->size;
+}
+
+static void
+mod_last_coords(const mod_coord_buf_t *pBuf, int *x, int *y)
+{
+	const coord_t *coord = &pBuf->pCoords[(pBuf->head + pBuf->numItems - 1) %
+	                                      pBuf->size];
+
+	*x = coord->x;
+	*y = coord->y;
+}
+
+#define BENCH_FINGERS       10
+#define BENCH_FRAMES        200000
+
+//
+// Full gesture updates with ten fingers moving, plus the bare ring against
+// the % indexed, heap backed reference. Only runs in perf mode (-m perf).
+//
+static void test_gestures_benchmark(void)
+{
+	static general_settings_t settings = { .coordBufSize = 6 };
+	static input_event_t events[MAX_EVENTS_PER_UPDATE * 2];
+	static gesture_context_t ctx;
+	static coord_buf_t rings[BENCH_FINGERS];
+	mod_coord_buf_t modRings[BENCH_FINGERS];
+	int ids[BENCH_FINGERS], xs[BENCH_FINGERS], ys[BENCH_FINGERS];
+	volatile int sink = 0;
+	double gesture_s, ring_s, mod_s;
+	time_stamp_t ts;
+	GTimer *timer;
+	int frame, i, n, x, y;
+
+	set_time_ms(&ts, 0);
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	init_gesture_state_machine(&ctx, &settings, BENCH_FINGERS);
+
+	for (i = 0; i < BENCH_FINGERS; i++)
+	{
+		ids[i] = i;
+		create_coord_buffer(&rings[i], settings.coordBufSize);
+		modRings[i].pCoords = (coord_t *) malloc(sizeof(coord_t) * settings.coordBufSize);
+		modRings[i].head = modRings[i].tail = modRings[i].numItems = 0;
+		modRings[i].size = settings.coordBufSize;
+		memset(&modRings[i].fit, 0, sizeof(modRings[i].fit));
+		modRings[i].fit.base = ts;
+	}
+
+	timer = g_timer_new();
+
+	for (frame = 0; frame < BENCH_FRAMES; frame++)
+	{
+		set_time_ms(&ts, frame * 8);
+
+		for (i = 0; i < BENCH_FINGERS; i++)
+		{
+			xs[i] = 40 + i * 100 + frame % 50;
+			ys[i] = 300 + frame % 70;
+		}
+
+		n = 0;
+		gesture_state_machine_mt(&ctx, ids, xs, ys, BENCH_FINGERS, &ts, events, &n);
+		sink += n;
+	}
+
+	gesture_s = g_timer_elapsed(timer, NULL);
+	g_timer_start(timer);
+
+	for (frame = 0; frame < BENCH_FRAMES; frame++)
+	{
+		set_time_ms(&ts, frame * 8);
+
+		for (i = 0; i < BENCH_FINGERS; i++)
+		{
+			update_coord_buffer(&rings[i], frame, i, &ts, 0);
+			get_last_coords(&rings[i], &x, &y, NULL);
+			sink += x;
+		}
+	}
+
+	ring_s = g_timer_elapsed(timer, NULL);
+	g_timer_start(timer);
+
+	for (frame = 0; frame < BENCH_FRAMES; frame++)
+	{
+		set_time_ms(&ts, frame * 8);
+
+		for (i = 0; i < BENCH_FINGERS; i++)
+		{
+			mod_update_coords(&modRings[i], frame, i, &ts);
+			mod_last_coords(&modRings[i], &x, &y);
+			sink += x;
+		}
+	}
+
+	mod_s = g_timer_elapsed(timer, NULL);
+
+	g_test_minimized_result(gesture_s * 1e9 / BENCH_FRAMES,
+	                        "gesture update, %d fingers: %.1f ns/frame", BENCH_FINGERS,
+	                        gesture_s * 1e9 / BENCH_FRAMES);
+	g_test_minimized_result(ring_s * 1e9 / (BENCH_FRAMES * BENCH_FINGERS),
+	                        "inline masked ring: %.2f ns/coord",
+	                        ring_s * 1e9 / (BENCH_FRAMES * BENCH_FINGERS));
+	g_test_minimized_result(mod_s * 1e9 / (BENCH_FRAMES * BENCH_FINGERS),
+	                        "heap %% indexed ring: %.2f ns/coord",
+	                        mod_s * 1e9 / (BENCH_FRAMES * BENCH_FINGERS));
+
+	for (i = 0; i < BENCH_FINGERS; i++)
+	{
+		free(modRings[i].pCoords);
+	}
+
+	g_timer_destroy(timer);
+	deinit_gesture_state_machine(&ctx);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/touchpanel/coords/capacity", test_coords_capacity);
+	g_test_add_func("/touchpanel/coords/position_filter", test_coords_position_filter);
+	g_test_add_func("/touchpanel/coords/velocity", test_coords_velocity);
+	g_test_add_func("/touchpanel/gestures/benchmark", test_gestures_benchmark);
+
+	return g_test_run();
+}
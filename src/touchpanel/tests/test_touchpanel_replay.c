@@ -0,0 +1,1123 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Replays evdev traces through the whole touchpanel module, from the read
+// in touchpanel_get_event() down to the emitted nyx_event_touchpanel_t.
+//
+// The traces are generated here so every run sees the same input. A trace
+// recorded from a real device (raw struct input_event records, as read
+// from /dev/input/eventN) can be replayed as well:
+//
+//   NYX_TOUCH_TRACE=drag.bin [NYX_TOUCH_TRACE_MT=1] test_touchpanel_replay -m perf
+//
+// Logs taken with NYX_TOUCHPANEL_RECORD are replayed by the module itself,
+// the log tests check that this reproduces the original events exactly.
+//
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+
+#ifndef g_assert_true
+#define g_assert_true(X) g_assert((X))
+#endif
+
+#ifndef g_assert_nonnull
+#define g_assert_nonnull(X) g_assert((X) != NULL)
+#endif
+
+//
+// Pull in the relevant nyx headers. That way we can redefine macros
+// if necessary (e.g. for logging) and the anti-recursion in the headers
+// will let our redefinitions leak through into the UUT.
+//
+#include <nyx/nyx_module.h>
+#include <nyx/module/nyx_utils.h>
+#include <nyx/module/nyx_log.h>
+
+//
+// Mock out all the calls to nyx-lib
+//
+#undef nyx_info
+#define nyx_info(m, args...) {}
+#undef nyx_debug
+#define nyx_debug(m, args...) {}
+#undef nyx_warn
+#define nyx_warn(m, args...) {}
+#undef nyx_error
+#define nyx_error(m, args...) {}
+
+static nyx_instance_t the_instance = "an instance";
+
+nyx_error_t nyx_module_register_method(nyx_instance_t instance,
+                                       nyx_device_t *device_in_ptr,
+                                       module_method_t method,
+                                       const char *symbol_str)
+{
+	g_assert_true(instance == the_instance);
+	return NYX_ERROR_NONE;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+//
+// Include the UUT directly so we can get at its static functions.
+//
+#include "../touchpanel_common.c"
+#include "../touchpanel_gestures.c"
+#include "../touchpanel.c"
+
+#define TRACE_FRAME_MS      8
+
+typedef struct
+{
+	input_event_t *events;
+	size_t count;
+	size_t size;
+	int64_t now_us;     /**< time stamped on the next event */
+	bool mt;            /**< needs the protocol B ingest path */
+} trace_t;
+
+static void
+trace_init(trace_t *trace, bool mt)
+{
+	trace->events = NULL;
+	trace->count = 0;
+	trace->size = 0;
+	trace->now_us = 1000 * G_USEC_PER_SEC;
+	trace->mt = mt;
+}
+
+static void
+trace_free(trace_t *trace)
+{
+	g_free(trace->events);
+	trace->events = NULL;
+}
+
+static void
+trace_add(trace_t *trace, uint16_t type, uint16_t code, int32_t value)
+{
+	input_event_t *event;
+
+	if (trace->count == trace->size)
+	{
+		trace->size = trace->size ? trace->size * 2 : 1024;
+		trace->events = g_renew(input_event_t, trace->events, trace->size);
+	}
+
+	event = &trace->events[trace->count++];
+	event->time.tv_sec = trace->now_us / G_USEC_PER_SEC;
+	event->time.tv_usec = trace->now_us % G_USEC_PER_SEC;
+	event->type = type;
+	event->code = code;
+	event->value = value;
+}
+
+/* End the frame, the next one starts a scan period later */
+static void
+trace_syn(trace_t *trace)
+{
+	trace_add(trace, EV_SYN, SYN_REPORT, 0);
+	trace->now_us += TRACE_FRAME_MS * 1000;
+}
+
+static void
+trace_touch(trace_t *trace, int x, int y, int button)
+{
+	trace_add(trace, EV_ABS, ABS_X, x);
+	trace_add(trace, EV_ABS, ABS_Y, y);
+
+	if (button >= 0)
+	{
+		trace_add(trace, EV_KEY, BTN_TOUCH, button);
+	}
+
+	trace_syn(trace);
+}
+
+/* One finger put down, dragged along a line and lifted, repeatedly */
+static void
+trace_make_drags(trace_t *trace, int drags, int moves)
+{
+	int i, k;
+
+	trace_init(trace, false);
+
+	for (i = 0; i < drags; i++)
+	{
+		trace_touch(trace, 100, 200 + i % 50, 1);
+
+		for (k = 1; k <= moves; k++)
+		{
+			trace_touch(trace, 100 + 6 * k, 200 + i % 50 + k, -1);
+		}
+
+		trace_touch(trace, 100 + 6 * moves, 200 + i % 50 + moves, 0);
+	}
+}
+
+/* Short taps all over the panel */
+static void
+trace_make_taps(trace_t *trace, int taps)
+{
+	int i, x, y;
+
+	trace_init(trace, false);
+
+	for (i = 0; i < taps; i++)
+	{
+		x = 50 + (i * 97) % 900;
+		y = 50 + (i * 61) % 500;
+
+		trace_touch(trace, x, y, 1);
+		trace_touch(trace, x + 1, y, -1);
+		trace_touch(trace, x + 1, y, 0);
+	}
+}
+
+/* Ten protocol B contacts landing, wriggling and lifting together */
+static void
+trace_make_mt_storms(trace_t *trace, int storms, int moves)
+{
+	int i, k, slot;
+
+	trace_init(trace, true);
+
+	for (i = 0; i < storms; i++)
+	{
+		for (k = 0; k <= moves + 1; k++)
+		{
+			for (slot = 0; slot < MAX_MT_SLOTS; slot++)
+			{
+				trace_add(trace, EV_ABS, ABS_MT_SLOT, slot);
+
+				if (k == moves + 1)
+				{
+					trace_add(trace, EV_ABS, ABS_MT_TRACKING_ID, -1);
+					continue;
+				}
+
+				if (k == 0)
+				{
+					trace_add(trace, EV_ABS, ABS_MT_TRACKING_ID, i * MAX_MT_SLOTS + slot);
+				}
+
+				trace_add(trace, EV_ABS, ABS_MT_POSITION_X, 40 + slot * 90 + k * 3);
+				trace_add(trace, EV_ABS, ABS_MT_POSITION_Y, 300 + ((slot + k) % 7) * 4);
+			}
+
+			trace_syn(trace);
+		}
+	}
+}
+
+static bool
+trace_load(trace_t *trace, const char *path, bool mt)
+{
+	gchar *contents;
+	gsize length;
+
+	trace_init(trace, mt);
+
+	if (!g_file_get_contents(path, &contents, &length, NULL))
+	{
+		return false;
+	}
+
+	trace->events = (input_event_t *) contents;
+	trace->count = length / sizeof(input_event_t);
+	trace->size = trace->count;
+
+	return true;
+}
+
+typedef struct
+{
+	touchpanel_device_t *device;
+	int write_fd;
+} replay_t;
+
+//
+// Open the module and swap whatever it found under /dev/input for the
+// read end of a pipe. The pipe has no axes to query, so do by hand what
+// attach_touchpanel() does with them, with a 1:1 scale.
+//
+static void
+replay_open(replay_t *replay, bool mt)
+{
+	struct epoll_event ev;
+	evdev_hotplug_t *input;
+	int fds[2];
+
+	g_assert_true(nyx_module_open(the_instance,
+	                              (nyx_device_t **) &replay->device) == NYX_ERROR_NONE);
+	g_assert_true(pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0);
+
+	input = &replay->device->input;
+	evdev_hotplug_destroy(input);
+	memset(input, 0, sizeof(*input));
+	input->inotify_fd = -1;
+	input->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	g_assert_true(input->epoll_fd >= 0);
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fds[0];
+	g_assert_true(epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD, fds[0], &ev) == 0);
+	input->nodes[0].fd = fds[0];
+	input->node_count = 1;
+	input->max_nodes = 1;
+	input->perf = &replay->device->perf;
+
+	replay->device->mtMode = mt;
+	replay->device->scaleX = TOUCH_SCALE_ONE;
+	replay->device->scaleY = TOUCH_SCALE_ONE;
+	replay->device->trackDisplay = false;
+	reset_mt_slots(replay->device);
+	deinit_gesture_state_machine(&replay->device->gestures);
+	init_gesture_state_machine(&replay->device->gestures, &sGeneralSettings,
+	                           mt ? MAX_MT_SLOTS : 1);
+
+	replay->write_fd = fds[1];
+}
+
+static void
+replay_close(replay_t *replay)
+{
+	close(replay->write_fd);
+	g_assert_true(nyx_module_close((nyx_device_t *) replay->device) == NYX_ERROR_NONE);
+}
+
+static inline int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct
+{
+	size_t frames;
+	size_t events_in;
+	size_t events_out;
+	size_t downs, ups;
+	unsigned int allocs;        /**< event pool fallback allocations */
+	int64_t busy_ns;            /**< time spent inside touchpanel_get_event() */
+	int64_t *latency_ns;        /**< per frame, read to first emitted event */
+	size_t latencies;
+	uint64_t counters[PERF_COUNTER_COUNT];  /**< the module's own account */
+	uint32_t digest;            /**< of every emitted item, in order */
+} replay_stats_t;
+
+static void
+stats_add_event(replay_stats_t *stats, const nyx_event_touchpanel_t *touch)
+{
+	const nyx_touchpanel_event_item_t *item;
+	size_t i;
+
+	stats->events_out++;
+
+	for (i = 0; i < (size_t) touch->item_count; i++)
+	{
+		item = &touch->item_array[i];
+		stats->downs += item->state == NYX_TOUCHPANEL_STATE_DOWN;
+		stats->ups += item->state == NYX_TOUCHPANEL_STATE_UP;
+		stats->digest = stats->digest * 31 + item->finger;
+		stats->digest = stats->digest * 31 + item->state;
+		stats->digest = stats->digest * 31 + item->x;
+		stats->digest = stats->digest * 31 + item->y;
+		stats->digest = stats->digest * 31 + (uint32_t) item->timestamp;
+	}
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+//
+// Write the trace into the pipe a frame at a time, and after each frame
+// drain the module. Only time spent in touchpanel_get_event() is counted.
+// If record is set the module logs what it reads there.
+//
+static void
+replay_run(const trace_t *trace, replay_stats_t *stats, const char *record)
+{
+	unsigned int count = PERF_COUNTER_COUNT;
+	replay_t replay;
+	size_t start = 0, end;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->latency_ns = g_new(int64_t, trace->count);
+
+	replay_open(&replay, trace->mt);
+
+	if (record)
+	{
+		/* What setup_touchpanel() would do, for the 1:1 pipe device */
+		evdev_log_info_t info = { trace->mt ? EVDEV_LOG_MT : 0, 1, 1, 1, 1 };
+
+		g_assert_true(evdev_log_recorder_open(&replay.device->record, record,
+		                                      &info) == 0);
+	}
+
+	for (end = 0; end < trace->count; end++)
+	{
+		nyx_event_t *event;
+		bool first = true;
+		int64_t t0, t1;
+
+		if (end + 1 < trace->count && !(trace->events[end].type == EV_SYN &&
+		                                 trace->events[end].code == SYN_REPORT))
+		{
+			continue;
+		}
+
+		/* A pipe write of at most PIPE_BUF bytes is read back whole */
+		g_assert_true((end + 1 - start) * sizeof(input_event_t) <= PIPE_BUF);
+		g_assert_true(write(replay.write_fd, &trace->events[start],
+		                    (end + 1 - start) * sizeof(input_event_t)) ==
+		              (ssize_t)((end + 1 - start) * sizeof(input_event_t)));
+		stats->events_in += end + 1 - start;
+		stats->frames++;
+		start = end + 1;
+
+		for (;;)
+		{
+			t0 = now_ns();
+			g_assert_true(touchpanel_get_event((nyx_device_t *) replay.device,
+			                                   &event) == NYX_ERROR_NONE);
+			t1 = now_ns();
+			stats->busy_ns += t1 - t0;
+
+			if (NULL == event)
+			{
+				break;
+			}
+
+			if (first)
+			{
+				stats->latency_ns[stats->latencies++] = t1 - t0;
+				first = false;
+			}
+
+			stats_add_event(stats, (nyx_event_touchpanel_t *) event);
+			touchpanel_release_event((nyx_device_t *) replay.device, event);
+		}
+	}
+
+	/* Pool fallbacks are the only allocations on the event path */
+	stats->allocs = replay.device->event_pool.fallback_allocs;
+	g_assert_true(touchpanel_query_perf_counters((nyx_device_t *) replay.device,
+	              stats->counters, &count) == NYX_ERROR_NONE);
+	g_assert_cmpuint(count, ==, PERF_COUNTER_COUNT);
+	replay_close(&replay);
+
+	qsort(stats->latency_ns, stats->latencies, sizeof(int64_t), compare_int64);
+}
+
+static int64_t
+percentile(const replay_stats_t *stats, double p)
+{
+	size_t index;
+
+	if (0 == stats->latencies)
+	{
+		return 0;
+	}
+
+	index = (size_t)(p * (stats->latencies - 1) + 0.5);
+	return stats->latency_ns[index];
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+//
+// Every drag reports one DOWN and one UP, and no frame is lost.
+//
+static void test_replay_drags(void)
+{
+	replay_stats_t stats;
+	trace_t trace;
+
+	trace_make_drags(&trace, 5, 20);
+	replay_run(&trace, &stats, NULL);
+
+	g_assert_cmpuint(stats.frames, ==, 5 * 22);
+	/* A release is reported at the button event and again at its SYN */
+	g_assert_cmpuint(stats.events_out, ==, stats.frames + 5);
+	g_assert_cmpuint(stats.downs, ==, 5);
+	g_assert_cmpuint(stats.ups, ==, 5);
+
+	/* The module's counters agree, each drain ends with one empty call */
+	g_assert_cmpuint(stats.counters[PERF_EVENTS_READ], ==, stats.events_in);
+	g_assert_cmpuint(stats.counters[PERF_EVENTS_EMITTED], ==, stats.events_out);
+	g_assert_cmpuint(stats.counters[PERF_CALLS], ==, stats.events_out + stats.frames);
+	g_assert_cmpuint(stats.counters[PERF_ALLOCS], ==, stats.allocs);
+	g_assert_cmpuint(stats.counters[PERF_GESTURE_RUNS], >=, stats.frames);
+	g_assert_cmpuint(stats.counters[PERF_SYSCALLS], >=, 2 * stats.frames);
+
+	g_free(stats.latency_ns);
+	trace_free(&trace);
+}
+
+static void test_replay_mt_storm(void)
+{
+	replay_stats_t stats;
+	trace_t trace;
+
+	trace_make_mt_storms(&trace, 3, 10);
+	replay_run(&trace, &stats, NULL);
+
+	g_assert_cmpuint(stats.downs, ==, 3 * MAX_MT_SLOTS);
+	g_assert_cmpuint(stats.ups, ==, 3 * MAX_MT_SLOTS);
+
+	g_free(stats.latency_ns);
+	trace_free(&trace);
+}
+
+//
+// Open the module on the log at path and drain it until the log is done,
+// waiting on the event source like a real consumer.
+//
+static int64_t
+log_replay_run(const char *path, bool paced, replay_stats_t *stats)
+{
+	touchpanel_device_t *device;
+	nyx_event_t *event;
+	struct pollfd pfd;
+	int64_t start;
+
+	memset(stats, 0, sizeof(*stats));
+	g_setenv(TOUCHPANEL_REPLAY_ENV, path, TRUE);
+	g_setenv(EVDEV_LOG_PACE_ENV, paced ? "paced" : "fast", TRUE);
+
+	g_assert_true(nyx_module_open(the_instance,
+	                              (nyx_device_t **) &device) == NYX_ERROR_NONE);
+	g_assert_true(evdev_log_replaying(&device->replay));
+	g_assert_true(touchpanel_get_event_source((nyx_device_t *) device,
+	              &pfd.fd) == NYX_ERROR_NONE);
+	pfd.events = POLLIN;
+	start = now_ns();
+
+	while (device->replay.pos < device->replay.count)
+	{
+		g_assert_cmpint(poll(&pfd, 1, 1000), ==, 1);
+
+		for (;;)
+		{
+			g_assert_true(touchpanel_get_event((nyx_device_t *) device,
+			                                   &event) == NYX_ERROR_NONE);
+
+			if (NULL == event)
+			{
+				break;
+			}
+
+			stats_add_event(stats, (nyx_event_touchpanel_t *) event);
+			touchpanel_release_event((nyx_device_t *) device, event);
+		}
+	}
+
+	/* Nothing is left to wake the consumer for */
+	g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+
+	stats->events_in = device->replay.count;
+	g_assert_true(nyx_module_close((nyx_device_t *) device) == NYX_ERROR_NONE);
+	g_unsetenv(TOUCHPANEL_REPLAY_ENV);
+	g_unsetenv(EVDEV_LOG_PACE_ENV);
+
+	return now_ns() - start;
+}
+
+//
+// A recorded log replays to the same events, and only takes records that
+// match its header.
+//
+static void
+log_roundtrip(const trace_t *trace)
+{
+	char *path = g_build_filename(g_get_tmp_dir(), "nyx-touch-log-test", NULL);
+	evdev_log_info_t other = { 0, 2, 2, 1, 1 };
+	evdev_log_recorder_t recorder = { 0 };
+	replay_stats_t live, replayed;
+	struct stat st;
+
+	unlink(path);
+	replay_run(trace, &live, path);
+	g_free(live.latency_ns);
+
+	g_assert_true(stat(path, &st) == 0);
+	g_assert_cmpuint(st.st_size, ==, sizeof(evdev_log_header_t) +
+	                 trace->count * sizeof(input_event_t));
+	g_assert_cmpint(evdev_log_recorder_open(&recorder, path, &other), ==, -1);
+
+	log_replay_run(path, false, &replayed);
+
+	g_assert_cmpuint(replayed.events_in, ==, live.events_in);
+	g_assert_cmpuint(replayed.events_out, ==, live.events_out);
+	g_assert_cmpuint(replayed.downs, ==, live.downs);
+	g_assert_cmpuint(replayed.ups, ==, live.ups);
+	g_assert_cmpuint(replayed.digest, ==, live.digest);
+
+	unlink(path);
+	g_free(path);
+}
+
+static void test_log_fast(void)
+{
+	trace_t trace;
+
+	trace_make_drags(&trace, 5, 20);
+	log_roundtrip(&trace);
+	trace_free(&trace);
+
+	trace_make_mt_storms(&trace, 3, 10);
+	log_roundtrip(&trace);
+	trace_free(&trace);
+}
+
+//
+// Paced, the replay takes as long as the recording did.
+//
+static void test_log_paced(void)
+{
+	char *path = g_build_filename(g_get_tmp_dir(), "nyx-touch-log-test", NULL);
+	replay_stats_t live, replayed;
+	int64_t span_ns, elapsed_ns;
+	trace_t trace;
+
+	trace_make_drags(&trace, 1, 10);
+	span_ns = (trace.now_us - TRACE_FRAME_MS * 1000 - 1000 * G_USEC_PER_SEC) * 1000;
+
+	unlink(path);
+	replay_run(&trace, &live, path);
+	g_free(live.latency_ns);
+
+	elapsed_ns = log_replay_run(path, true, &replayed);
+
+	g_assert_cmpint(elapsed_ns, >=, span_ns);
+	g_assert_cmpuint(replayed.digest, ==, live.digest);
+
+	unlink(path);
+	g_free(path);
+	trace_free(&trace);
+}
+
+//
+// Draining with the bulk calls gives the same events as one at a time.
+//
+static void test_bulk_events(void)
+{
+	nyx_event_t *events[4];
+	replay_stats_t single, bulk;
+	replay_t replay;
+	unsigned int count, i;
+	size_t start = 0, end;
+	trace_t trace;
+
+	trace_make_drags(&trace, 5, 20);
+	replay_run(&trace, &single, NULL);
+	g_free(single.latency_ns);
+
+	memset(&bulk, 0, sizeof(bulk));
+	replay_open(&replay, trace.mt);
+
+	/* A few frames per write, so that a call has more than one ready */
+	for (end = 0; end < trace.count; end++)
+	{
+		if (end + 1 < trace.count && (end + 1 - start) * sizeof(input_event_t) <
+		        PIPE_BUF - 8 * sizeof(input_event_t))
+		{
+			continue;
+		}
+
+		g_assert_true(write(replay.write_fd, &trace.events[start],
+		                    (end + 1 - start) * sizeof(input_event_t)) ==
+		              (ssize_t)((end + 1 - start) * sizeof(input_event_t)));
+		start = end + 1;
+
+		do
+		{
+			g_assert_true(touchpanel_get_events((nyx_device_t *) replay.device, events,
+			                                    G_N_ELEMENTS(events), &count) == NYX_ERROR_NONE);
+			g_assert_cmpuint(count, <=, G_N_ELEMENTS(events));
+
+			for (i = 0; i < count; i++)
+			{
+				stats_add_event(&bulk, (nyx_event_touchpanel_t *) events[i]);
+			}
+
+			g_assert_true(touchpanel_release_events((nyx_device_t *) replay.device,
+			              events, count) == NYX_ERROR_NONE);
+		}
+		while (count > 0);
+	}
+
+	g_assert_cmpuint(replay.device->event_pool.fallback_allocs, ==, 0);
+	replay_close(&replay);
+
+	g_assert_cmpuint(bulk.events_out, ==, single.events_out);
+	g_assert_cmpuint(bulk.digest, ==, single.digest);
+
+	trace_free(&trace);
+}
+
+/* Write the whole trace into the pipe, a few frames per write */
+static void
+replay_write_all(replay_t *replay, const trace_t *trace)
+{
+	size_t start = 0, end;
+
+	for (end = 0; end < trace->count; end++)
+	{
+		if (end + 1 < trace->count && (end + 1 - start) * sizeof(input_event_t) <
+		        PIPE_BUF - 8 * sizeof(input_event_t))
+		{
+			continue;
+		}
+
+		g_assert_true(write(replay->write_fd, &trace->events[start],
+		                    (end + 1 - start) * sizeof(input_event_t)) ==
+		              (ssize_t)((end + 1 - start) * sizeof(input_event_t)));
+		start = end + 1;
+	}
+}
+
+//
+// Delivered through the ring, read in place from a mapping of our own,
+// the events are the same as those handed out one at a time.
+//
+static void test_ring_events(void)
+{
+	const nyx_event_touchpanel_t *touch;
+	replay_stats_t single, ringed;
+	event_ring_t ring;
+	struct pollfd pfd;
+	replay_t replay;
+	trace_t trace;
+	int memfd, fd;
+
+	trace_make_drags(&trace, 5, 20);
+	replay_run(&trace, &single, NULL);
+	g_free(single.latency_ns);
+
+	memset(&ringed, 0, sizeof(ringed));
+	replay_open(&replay, trace.mt);
+
+	g_assert_true(touchpanel_open_event_ring((nyx_device_t *) replay.device, 100,
+	              &memfd) == NYX_ERROR_INVALID_VALUE);
+	g_assert_true(touchpanel_open_event_ring((nyx_device_t *) replay.device, 256,
+	              &memfd) == NYX_ERROR_NONE);
+	g_assert_true(touchpanel_open_event_ring((nyx_device_t *) replay.device, 256,
+	              &fd) == NYX_ERROR_NONE);
+	g_assert_cmpint(fd, ==, memfd);
+	g_assert_true(touchpanel_get_event((nyx_device_t *) replay.device,
+	                                   (nyx_event_t **) &touch) == NYX_ERROR_INVALID_OPERATION);
+
+	g_assert_true(touchpanel_get_event_source((nyx_device_t *) replay.device,
+	              &pfd.fd) == NYX_ERROR_NONE);
+	g_assert_cmpint(event_ring_open(&ring, memfd, pfd.fd), ==, 0);
+	pfd.events = POLLIN;
+
+	replay_write_all(&replay, &trace);
+
+	while (ringed.events_out < single.events_out)
+	{
+		g_assert_cmpint(poll(&pfd, 1, 1000), ==, 1);
+		event_ring_ack(&ring);
+
+		while ((touch = (const nyx_event_touchpanel_t *) event_ring_peek(&ring)) != NULL)
+		{
+			stats_add_event(&ringed, touch);
+			event_ring_pop(&ring);
+		}
+	}
+
+	g_assert_cmpuint(ringed.events_out, ==, single.events_out);
+	g_assert_cmpuint(ringed.digest, ==, single.digest);
+	g_assert_cmpuint(event_ring_dropped(&ring), ==, 0);
+
+	event_ring_destroy(&ring);
+	replay_close(&replay);
+	trace_free(&trace);
+}
+
+//
+// A consumer that doesn't keep up loses the newest events, never blocks
+// the module.
+//
+static void test_ring_overflow(void)
+{
+	uint64_t values[PERF_COUNTER_COUNT];
+	unsigned int count = PERF_COUNTER_COUNT;
+	replay_stats_t single;
+	event_ring_t ring;
+	replay_t replay;
+	trace_t trace;
+	int memfd, event_fd, read_count = 0;
+
+	trace_make_drags(&trace, 5, 20);
+	replay_run(&trace, &single, NULL);
+	g_free(single.latency_ns);
+
+	replay_open(&replay, trace.mt);
+	g_assert_true(touchpanel_open_event_ring((nyx_device_t *) replay.device, 4,
+	              &memfd) == NYX_ERROR_NONE);
+	g_assert_true(touchpanel_get_event_source((nyx_device_t *) replay.device,
+	              &event_fd) == NYX_ERROR_NONE);
+	g_assert_cmpint(event_ring_open(&ring, memfd, event_fd), ==, 0);
+
+	replay_write_all(&replay, &trace);
+
+	/* Wait for the module to have taken in everything */
+	do
+	{
+		g_usleep(1000);
+		g_assert_true(touchpanel_query_perf_counters((nyx_device_t *) replay.device,
+		              values, &count) == NYX_ERROR_NONE);
+	}
+	while (values[PERF_EVENTS_DROPPED] + 4 < single.events_out);
+
+	while (event_ring_peek(&ring) != NULL)
+	{
+		event_ring_pop(&ring);
+		read_count++;
+	}
+
+	g_assert_cmpint(read_count, ==, 4);
+	g_assert_cmpuint(values[PERF_EVENTS_DROPPED], ==, event_ring_dropped(&ring));
+
+	event_ring_destroy(&ring);
+	replay_close(&replay);
+	trace_free(&trace);
+}
+
+/* Write one frame and return the position of the first item it produces */
+static void
+feed_frame(replay_t *replay, int x, int y, int button, int *out_x, int *out_y)
+{
+	nyx_event_touchpanel_t *touch = NULL;
+	nyx_event_t *event;
+	trace_t trace;
+
+	trace_init(&trace, false);
+	trace_touch(&trace, x, y, button);
+	g_assert_true(write(replay->write_fd, trace.events,
+	                    trace.count * sizeof(input_event_t)) ==
+	              (ssize_t)(trace.count * sizeof(input_event_t)));
+
+	for (;;)
+	{
+		g_assert_true(touchpanel_get_event((nyx_device_t *) replay->device,
+		                                   &event) == NYX_ERROR_NONE);
+
+		if (NULL == event)
+		{
+			break;
+		}
+
+		if (NULL == touch)
+		{
+			touch = (nyx_event_touchpanel_t *) event;
+			*out_x = touch->item_array[0].x;
+			*out_y = touch->item_array[0].y;
+		}
+
+		touchpanel_release_event((nyx_device_t *) replay->device, event);
+	}
+
+	g_assert_nonnull(touch);
+	trace_free(&trace);
+}
+
+//
+// The fixed point scale matches exact integer division over the whole axis.
+//
+static void test_scale_exact(void)
+{
+	static const int32_t axes[][2] =
+	{
+		{ 1920, 32767 }, { 1080, 32767 }, { 1024, 1023 }, { 500, 1000 },
+		{ 13, 65535 }, { 65535, 65535 }, { 65535, 1 }
+	};
+	unsigned int i;
+	int32_t value;
+
+	for (i = 0; i < G_N_ELEMENTS(axes); i++)
+	{
+		uint64_t factor = touch_scale_factor(axes[i][0], axes[i][1]);
+
+		for (value = 0; value <= axes[i][1]; value++)
+		{
+			g_assert_cmpint(touch_scale(value, factor), ==,
+			                (int)((int64_t) value * axes[i][0] / axes[i][1]));
+		}
+	}
+
+	g_assert_cmpint(touch_scale(-5, TOUCH_SCALE_ONE), ==, -5);
+	g_assert_cmpint(touch_scale(1234, touch_scale_factor(0, 1000)), ==, 1234);
+	g_assert_cmpint(touch_scale(1234, touch_scale_factor(1000, 0)), ==, 1234);
+}
+
+//
+// A device attached while the display resolution is unknown is scaled 1:1,
+// picks up the display scale once the watcher has it and follows later
+// mode changes, all without being reopened.
+//
+static void test_display_scale(void)
+{
+	evdev_log_info_t info = { 0, 1000, 1000, 0, 0 };
+	replay_t replay;
+	uint32_t saved;
+	int x = 0, y = 0;
+
+	/* Keep the watcher from finding a real display */
+	g_setenv(TOUCHPANEL_FB_ENV, "/nonexistent", TRUE);
+	replay_open(&replay, false);
+
+	saved = __atomic_load_n(&sDisplayRes, __ATOMIC_RELAXED);
+	__atomic_store_n(&sDisplayRes, 0, __ATOMIC_RELAXED);
+	setup_touchpanel(replay.device, &info);
+	g_assert_true(replay.device->trackDisplay);
+
+	feed_frame(&replay, 400, 800, 1, &x, &y);
+	g_assert_cmpint(x, ==, 400);
+	g_assert_cmpint(y, ==, 800);
+
+	__atomic_store_n(&sDisplayRes, display_res_pack(500, 250), __ATOMIC_RELAXED);
+
+	feed_frame(&replay, 400, 800, -1, &x, &y);
+	g_assert_cmpuint(replay.device->displayRes, ==, display_res_pack(500, 250));
+	g_assert_cmpint(x, ==, 200);
+	g_assert_cmpint(y, ==, 200);
+
+	__atomic_store_n(&sDisplayRes, display_res_pack(1920, 1080), __ATOMIC_RELAXED);
+
+	feed_frame(&replay, 400, 800, -1, &x, &y);
+	g_assert_cmpint(x, ==, 768);
+	g_assert_cmpint(y, ==, 864);
+
+	feed_frame(&replay, 400, 800, 0, &x, &y);
+	replay_close(&replay);
+
+	__atomic_store_n(&sDisplayRes, saved, __ATOMIC_RELAXED);
+	g_unsetenv(TOUCHPANEL_FB_ENV);
+}
+
+//
+// The active scan rate drops moves over the limit but never a DOWN or UP,
+// and the UP frame restarts both the scan clock and the idle countdown.
+//
+static void test_scan_governor(void)
+{
+	replay_stats_t stats;
+	replay_t replay;
+	trace_t trace;
+	size_t start = 0, end;
+	int64_t up_ms = 0;
+
+	memset(&stats, 0, sizeof(stats));
+	trace_make_drags(&trace, 1, 20);
+	replay_open(&replay, false);
+	g_assert_true(touchpanel_set_active_scan_rate((nyx_device_t *) replay.device,
+	              25) == NYX_ERROR_NONE);
+
+	for (end = 0; end < trace.count; end++)
+	{
+		nyx_event_t *event;
+
+		if (!(trace.events[end].type == EV_SYN && trace.events[end].code == SYN_REPORT))
+		{
+			continue;
+		}
+
+		g_assert_true(write(replay.write_fd, &trace.events[start],
+		                    (end + 1 - start) * sizeof(input_event_t)) ==
+		              (ssize_t)((end + 1 - start) * sizeof(input_event_t)));
+		up_ms = get_ms_tval(&trace.events[end].time);
+		start = end + 1;
+
+		for (;;)
+		{
+			g_assert_true(touchpanel_get_event((nyx_device_t *) replay.device,
+			                                   &event) == NYX_ERROR_NONE);
+
+			if (NULL == event)
+			{
+				break;
+			}
+
+			stats_add_event(&stats, (nyx_event_touchpanel_t *) event);
+			touchpanel_release_event((nyx_device_t *) replay.device, event);
+		}
+	}
+
+	g_assert_cmpuint(stats.downs, ==, 1);
+	g_assert_cmpuint(stats.ups, >=, 1);
+	/* 20 moves 8ms apart, at most one per 40ms gets through */
+	g_assert_cmpuint(replay.device->throttled_frames, >=, 20 - (20 * 8 / 40 + 1));
+	g_assert_cmpint(replay.device->lastTouchMs, ==, up_ms);
+	g_assert_cmpint(replay.device->lastScanMs, ==, up_ms);
+
+	replay_close(&replay);
+	trace_free(&trace);
+}
+
+//
+// A log that cannot be replayed fails the open and leaves no device.
+//
+static void test_open_fail(void)
+{
+	gchar *path = g_build_filename(g_get_tmp_dir(), "test_touchpanel_missing.evlog",
+	                               NULL);
+	nyx_device_t *device = (nyx_device_t *) &device;
+
+	unlink(path);
+	g_setenv(TOUCHPANEL_REPLAY_ENV, path, TRUE);
+	g_assert_true(nyx_module_open(the_instance, &device) == NYX_ERROR_GENERIC);
+	g_assert_true(NULL == device);
+	g_unsetenv(TOUCHPANEL_REPLAY_ENV);
+	g_free(path);
+}
+
+//
+// Once nothing has touched the panel for noTouchThreshold ms, frames are
+// let through at the idle scan rate, counted from the last frame that went
+// out. A touch is never held back by it.
+//
+static void test_scan_governor_idle(void)
+{
+	static touchpanel_device_t device;
+	int64_t now_ms, last_ms, up_ms = 1000;
+	unsigned int allowed = 0;
+
+	device.idleSettings = sDefaultIdleSettings;
+	g_assert_true(touchpanel_set_idle_scan_rate((nyx_device_t *) &device,
+	              2) == NYX_ERROR_NONE);
+
+	/* An UP frame went out at up_ms */
+	scan_governor_note(&device, up_ms, true);
+
+	for (now_ms = up_ms + 8; now_ms < up_ms + device.idleSettings.noTouchThreshold;
+	        now_ms += 8)
+	{
+		g_assert_true(scan_governor_allow(&device, now_ms, false));
+	}
+
+	/* Idle from here on: one frame per 500ms after the last one let through */
+	for (last_ms = now_ms - 8; now_ms <= up_ms + 2000; now_ms += 8)
+	{
+		if (scan_governor_allow(&device, now_ms, false))
+		{
+			g_assert_cmpint(now_ms - last_ms, >=, 500);
+			g_assert_cmpint(now_ms - last_ms, <, 508);
+			last_ms = now_ms;
+			allowed++;
+		}
+	}
+
+	g_assert_cmpuint(allowed, ==, 2);
+	g_assert_true(scan_governor_allow(&device, now_ms, true));
+	g_assert_true(scan_governor_allow(&device, now_ms + 8, false));
+}
+
+static void
+report(const char *name, const trace_t *trace)
+{
+	replay_stats_t stats;
+
+	replay_run(trace, &stats, NULL);
+
+	g_test_minimized_result((double) stats.busy_ns / stats.events_in,
+	                        "%s: %.1f ns/event, %.4f allocs/event, %zu frames -> %zu events",
+	                        name, (double) stats.busy_ns / stats.events_in,
+	                        (double) stats.allocs / stats.events_in,
+	                        stats.frames, stats.events_out);
+	g_test_message("%s: read to event p50 %" G_GINT64_FORMAT " ns, p99 %"
+	               G_GINT64_FORMAT " ns, p99.9 %" G_GINT64_FORMAT " ns", name,
+	               percentile(&stats, 0.5), percentile(&stats, 0.99),
+	               percentile(&stats, 0.999));
+
+	g_free(stats.latency_ns);
+}
+
+//
+// Only runs in perf mode (-m perf).
+//
+static void test_replay_benchmark(void)
+{
+	const char *path = g_getenv("NYX_TOUCH_TRACE");
+	trace_t trace;
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	trace_make_drags(&trace, 2000, 60);
+	report("single finger drags", &trace);
+	trace_free(&trace);
+
+	trace_make_taps(&trace, 20000);
+	report("rapid taps", &trace);
+	trace_free(&trace);
+
+	trace_make_mt_storms(&trace, 2000, 30);
+	report("10 finger storms", &trace);
+	trace_free(&trace);
+
+	if (path)
+	{
+		g_assert_true(trace_load(&trace, path, NULL != g_getenv("NYX_TOUCH_TRACE_MT")));
+		report(path, &trace);
+		trace_free(&trace);
+	}
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/touchpanel/replay/drags", test_replay_drags);
+	g_test_add_func("/touchpanel/replay/mt_storm", test_replay_mt_storm);
+	g_test_add_func("/touchpanel/replay/log_fast", test_log_fast);
+	g_test_add_func("/touchpanel/replay/log_paced", test_log_paced);
+	g_test_add_func("/touchpanel/replay/bulk", test_bulk_events);
+	g_test_add_func("/touchpanel/replay/ring", test_ring_events);
+	g_test_add_func("/touchpanel/replay/ring_overflow", test_ring_overflow);
+	g_test_add_func("/touchpanel/replay/scale_exact", test_scale_exact);
+	g_test_add_func("/touchpanel/replay/display_scale", test_display_scale);
+	g_test_add_func("/touchpanel/replay/scan_governor", test_scan_governor);
+	g_test_add_func("/touchpanel/replay/scan_governor_idle", test_scan_governor_idle);
+	g_test_add_func("/touchpanel/replay/open_fail", test_open_fail);
+	g_test_add_func("/touchpanel/replay/benchmark", test_replay_benchmark);
+
+	return g_test_run();
+}
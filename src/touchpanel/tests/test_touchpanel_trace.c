@@ -0,0 +1,281 @@
+// Copyright (c) 2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// The gesture code built with its tracepoints, as with -DNYX_INPUT_TRACE=ON.
+// The other tests build it without them.
+//
+
+#define NYX_INPUT_TRACE 1
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef g_assert_true
+#define g_assert_true(X) g_assert((X))
+#endif
+
+//
+// Pull in the relevant nyx headers. That way we can redefine macros
+// if necessary (e.g. for logging) and the anti-recursion in the headers
+// will let our redefinitions leak through into the UUT.
+//
+#include <nyx/module/nyx_log.h>
+
+//
+// Mock out all the calls to nyx-lib
+//
+#undef nyx_info
+#define nyx_info(m, args...) {}
+#undef nyx_debug
+#define nyx_debug(m, args...) {}
+#undef nyx_warn
+#define nyx_warn(m, args...) {}
+#undef nyx_error
+#define nyx_error(m, args...) {}
+
+//*****************************************************************************
+//*****************************************************************************
+
+//
+// Include the UUT directly so we can get at its static functions.
+//
+#include "../touchpanel_common.c"
+#include "../touchpanel_gestures.c"
+
+static general_settings_t settings = { .coordBufSize = 6 };
+
+static void
+trace_reset(bool enabled)
+{
+	memset(&input_trace_ring, 0, sizeof(input_trace_ring));
+
+	if (enabled)
+	{
+		input_trace_init();
+	}
+}
+
+/* One single touch frame, the way touchpanel.c feeds mouse input */
+static void
+feed(gesture_context_t *ctx, int x, int y, bool down, int ms)
+{
+	static input_event_t events[MAX_EVENTS_PER_UPDATE];
+	int xs[2] = { x, 0 }, ys[2] = { y, 0 }, ws[2] = { down, 0 };
+	time_stamp_t ts;
+	int n = 0;
+
+	ts.time.tv_sec = 1000 + ms / 1000;
+	ts.time.tv_nsec = (ms % 1000) * 1000000L;
+	gesture_state_machine(ctx, xs, ys, ws, down ? 1 : 0, &ts, events, &n);
+}
+
+static void
+drag(gesture_context_t *ctx, int moves)
+{
+	int i;
+
+	for (i = 0; i <= moves; i++)
+	{
+		feed(ctx, 100 + 10 * i, 200, true, i * 10);
+	}
+
+	feed(ctx, 100 + 10 * moves, 200, false, (moves + 1) * 10);
+}
+
+static const input_trace_record_t *
+record_at(unsigned int i)
+{
+	return &input_trace_ring.records[i & (INPUT_TRACE_RING_SIZE - 1)];
+}
+
+//
+// Disabled at runtime, nothing is recorded.
+//
+static void test_trace_off(void)
+{
+	gesture_context_t ctx;
+
+	g_unsetenv(INPUT_TRACE_FILE_ENV);
+	trace_reset(true);
+
+	init_gesture_state_machine(&ctx, &settings, 1);
+	drag(&ctx, 20);
+	deinit_gesture_state_machine(&ctx);
+
+	g_assert_true(!input_trace_ring.enabled);
+	g_assert_cmpuint(input_trace_ring.head, ==, 0);
+	g_assert_cmpint(input_trace_dump(), ==, 0);
+}
+
+//
+// A drag records the new finger, its match on every move and its release,
+// in order.
+//
+static void test_trace_records(void)
+{
+	gesture_context_t ctx;
+	unsigned int i, matches = 0;
+
+	g_setenv(INPUT_TRACE_FILE_ENV, "/dev/null", TRUE);
+	trace_reset(true);
+
+	init_gesture_state_machine(&ctx, &settings, 1);
+	drag(&ctx, 5);
+	deinit_gesture_state_machine(&ctx);
+
+	g_assert_cmpuint(input_trace_ring.head, >=, 3);
+	g_assert_cmpuint(record_at(0)->id, ==, INPUT_TRACE_TP_NEW_FINGER);
+	g_assert_cmpint(record_at(0)->args[2], ==, 100);
+	g_assert_cmpuint(record_at(1)->id, ==, INPUT_TRACE_TP_FINGER_DOWN);
+	g_assert_cmpuint(record_at(input_trace_ring.head - 1)->id, ==,
+	                 INPUT_TRACE_TP_FINGER_UP);
+
+	for (i = 0; i < input_trace_ring.head; i++)
+	{
+		if (i > 0)
+		{
+			g_assert_cmpuint(record_at(i)->ns, >=, record_at(i - 1)->ns);
+		}
+
+		if (record_at(i)->id == INPUT_TRACE_TP_FINGER_MATCH)
+		{
+			g_assert_cmpint(record_at(i)->args[1], ==, 100 + 10 * (matches + 1));
+			matches++;
+		}
+	}
+
+	g_assert_cmpuint(matches, ==, 5);
+	g_unsetenv(INPUT_TRACE_FILE_ENV);
+}
+
+//
+// Once the ring has wrapped the file holds the newest records, oldest first.
+//
+static void test_trace_dump(void)
+{
+	char *path = g_build_filename(g_get_tmp_dir(), "nyx-input-trace-test", NULL);
+	input_trace_header_t header;
+	input_trace_record_t *records;
+	unsigned int written, i;
+	gsize length;
+	gchar *contents;
+
+	g_setenv(INPUT_TRACE_FILE_ENV, path, TRUE);
+	trace_reset(true);
+
+	written = INPUT_TRACE_RING_SIZE + INPUT_TRACE_RING_SIZE / 4 + 3;
+
+	for (i = 0; i < written; i++)
+	{
+		INPUT_TRACE(TP_READ, i, 0, 0, 0, 0);
+	}
+
+	g_assert_cmpint(input_trace_dump(), ==, 0);
+	g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+	g_assert_cmpuint(length, ==, sizeof(header) +
+	                 INPUT_TRACE_RING_SIZE * sizeof(input_trace_record_t));
+
+	memcpy(&header, contents, sizeof(header));
+	g_assert_true(0 == memcmp(header.magic, INPUT_TRACE_MAGIC, sizeof(header.magic)));
+	g_assert_cmpuint(header.version, ==, 1);
+	g_assert_cmpuint(header.record_size, ==, sizeof(input_trace_record_t));
+	g_assert_cmpuint(header.count, ==, INPUT_TRACE_RING_SIZE);
+	g_assert_cmpuint(header.lost, ==, written - INPUT_TRACE_RING_SIZE);
+
+	records = (input_trace_record_t *)(contents + sizeof(header));
+
+	for (i = 0; i < header.count; i++)
+	{
+		g_assert_cmpuint(records[i].id, ==, INPUT_TRACE_TP_READ);
+		g_assert_cmpint(records[i].args[0], ==, header.lost + i);
+	}
+
+	g_free(contents);
+	unlink(path);
+	g_free(path);
+	g_unsetenv(INPUT_TRACE_FILE_ENV);
+	trace_reset(false);
+}
+
+#define BENCH_DRAGS     20000
+
+//
+// Cost of the tracepoints when compiled in, disabled and recording. Only
+// runs in perf mode (-m perf).
+//
+static void test_trace_benchmark(void)
+{
+	static const char *const names[] = { "disabled", "recording" };
+	gesture_context_t ctx;
+	unsigned int pass;
+	GTimer *timer;
+	int i;
+
+	if (!g_test_perf())
+	{
+		return;
+	}
+
+	timer = g_timer_new();
+
+	for (pass = 0; pass < G_N_ELEMENTS(names); pass++)
+	{
+		double elapsed;
+
+		if (pass)
+		{
+			g_setenv(INPUT_TRACE_FILE_ENV, "/dev/null", TRUE);
+		}
+
+		trace_reset(true);
+		init_gesture_state_machine(&ctx, &settings, 1);
+		g_timer_start(timer);
+
+		for (i = 0; i < BENCH_DRAGS; i++)
+		{
+			drag(&ctx, 20);
+		}
+
+		elapsed = g_timer_elapsed(timer, NULL);
+		deinit_gesture_state_machine(&ctx);
+
+		g_test_minimized_result(elapsed * 1e9 / (BENCH_DRAGS * 22),
+		                        "tracepoints %s: %.1f ns/frame, %u records",
+		                        names[pass], elapsed * 1e9 / (BENCH_DRAGS * 22),
+		                        input_trace_ring.head);
+	}
+
+	g_unsetenv(INPUT_TRACE_FILE_ENV);
+	trace_reset(false);
+	g_timer_destroy(timer);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/touchpanel/trace/off", test_trace_off);
+	g_test_add_func("/touchpanel/trace/records", test_trace_records);
+	g_test_add_func("/touchpanel/trace/dump", test_trace_dump);
+	g_test_add_func("/touchpanel/trace/benchmark", test_trace_benchmark);
+
+	return g_test_run();
+}
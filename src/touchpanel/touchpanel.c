@@ -27,10 +27,12 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <glib.h>
 #include <errno.h>
-#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #include <nyx/nyx_module.h>
@@ -46,7 +48,14 @@
 #include <fcntl.h>
 
 #include "touchpanel_gestures.h"
+#include "event_pool.h"
+#include "event_ring.h"
+#include "evdev_filter.h"
+#include "evdev_hotplug.h"
+#include "evdev_log.h"
+#include "input_trace.h"
 #include "msgid.h"
+#include "perf_counters.h"
 
 /* Later versions of nyx_utils.h no longer define this macro */
 #undef return_if
@@ -57,12 +66,24 @@
     }                                                         \
   } while(0)
 
-typedef struct
-{
-	nyx_device_t _parent;
-	nyx_event_touchpanel_t *current_event_ptr;
-	int32_t mode;
-} touchpanel_device_t;
+/* Number of touch events kept preallocated per device, read at open */
+#ifndef TOUCHPANEL_EVENT_POOL_SIZE
+#define TOUCHPANEL_EVENT_POOL_SIZE  16
+#endif
+
+#define TOUCHPANEL_EVENT_POOL_ENV   "NYX_TOUCHPANEL_EVENT_POOL"
+
+/* Values accepted by touchpanel_set_mode() */
+#define TOUCHPANEL_MODE_DEFAULT             0
+/* Collapse queued move-only frames into the newest one */
+#define TOUCHPANEL_MODE_COALESCE_MOTION     1
+
+/*
+ * Replay an evdev log (see evdev_log.h) instead of reading the touch
+ * device, and record whatever is read into one.
+ */
+#define TOUCHPANEL_REPLAY_ENV   "NYX_TOUCHPANEL_REPLAY"
+#define TOUCHPANEL_RECORD_ENV   "NYX_TOUCHPANEL_RECORD"
 
 NYX_DECLARE_MODULE(NYX_DEVICE_TOUCHPANEL, "Touchpanel");
 
@@ -75,9 +96,79 @@ typedef struct
 	input_event_t input[MAX_HIDD_EVENTS];
 } event_list_t;
 
+/*
+ * Multi-touch protocol B state. Filled directly from ABS_MT_* events and
+ * handed to the gesture state machine once per SYN_REPORT.
+ */
+#define MAX_MT_SLOTS    NYX_MAX_TOUCH_EVENTS
+
+typedef struct
+{
+	int trackingId;     /**< -1 when the slot holds no contact */
+	int x;
+	int y;
+} mt_slot_t;
+
+/*
+ * Everything needed to read and translate one touch device lives here, so
+ * that several devices can be opened and drained from different threads.
+ */
+typedef struct
+{
+	nyx_device_t _parent;
+	nyx_event_touchpanel_t *current_event_ptr;
+	int32_t mode;
+	event_pool_t event_pool;
+	unsigned int coalesced_frames;  /**< frames dropped by motion coalescing */
+	unsigned int throttled_frames;  /**< frames dropped by the scan-rate governor */
+
+	evdev_hotplug_t input;          /**< the touch device, once it shows up */
+	evdev_log_player_t replay;      /**< replaces the touch device if set */
+	evdev_log_recorder_t record;
+	event_list_t event_list;        /**< frames produced by the gesture code */
+	/*
+	 * Raw evdev events staged from the device. A full page is read per syscall
+	 * so that a whole SYN frame is normally ingested with a single wakeup.
+	 */
+	event_list_t raw_list;
+	/*
+	 * Motion coalescing keeps the newest move-only frame here while it looks
+	 * ahead, and parks a following DOWN/UP frame until the held one is out.
+	 */
+	event_list_t held_list;
+	event_list_t pending_list;
+
+	uint64_t scaleX, scaleY;        /**< see touch_scale() */
+	evdev_log_info_t axes;          /**< of the device, see setup_touchpanel() */
+	bool trackDisplay;              /**< rescale when sDisplayRes changes */
+	uint32_t displayRes;            /**< the sDisplayRes scaleX/Y are for */
+	bool recordPending;             /**< see update_touchpanel_scale() */
+	int cachedX, cachedY;
+	int touchButtonState;
+
+	bool mtMode;
+	int mtCurrentSlot;
+	mt_slot_t mtSlots[MAX_MT_SLOTS];
+
+	/* see scan_governor_allow() */
+	unsigned int activeScanRate;
+	interrupt_on_touch_settings_t idleSettings;
+	int64_t lastScanMs, lastTouchMs;
+
+	gesture_context_t gestures;
 
-event_list_t touchpanel_event_list;
-int touchpanel_event_fd = -1;
+	perf_counters_t perf;           /**< see touchpanel_query_perf_counters() */
+
+	event_ring_t ring;              /**< see touchpanel_open_event_ring() */
+	pthread_t ring_thread;
+} touchpanel_device_t;
+
+static inline void touchpanel_event_list_reset(event_list_t *list,
+        size_t num_events)
+{
+	list->input_filled = num_events * sizeof(input_event_t);
+	list->input_read = 0;
+}
 
 static void touch_item_reset(nyx_touchpanel_event_item_t *t)
 {
@@ -91,17 +182,23 @@ static void touch_item_reset(nyx_touchpanel_event_item_t *t)
 	t->weight = (double) NAN;
 }
 
-static nyx_event_touchpanel_t *touch_event_create()
+static nyx_event_touchpanel_t *touch_event_create(touchpanel_device_t *d)
 {
 	nyx_event_touchpanel_t *event_ptr;
-	event_ptr =
-	    (nyx_event_touchpanel_t *) calloc(sizeof(nyx_event_touchpanel_t), 1);
+
+	if (G_UNLIKELY(0 == d->event_pool.free_count))
+	{
+		perf_count(&d->perf, PERF_ALLOCS, 1);
+	}
+
+	event_ptr = (nyx_event_touchpanel_t *) event_pool_get(&d->event_pool);
 
 	if (NULL == event_ptr)
 	{
 		return event_ptr;
 	}
 
+	/* items are reset as they are handed out, see touch_item_reset() */
 	event_ptr->type = NYX_TOUCHPANEL_EVENT_TYPE_TOUCH;
 	event_ptr->item_count = 0;
 	return event_ptr;
@@ -119,8 +216,14 @@ nyx_error_t touchpanel_release_event(nyx_device_t *d, nyx_event_t *e)
 		return NYX_ERROR_INVALID_HANDLE;
 	}
 
-	nyx_event_touchpanel_t *a = (nyx_event_touchpanel_t *) e;
-	free(a);
+	touchpanel_device_t *touchpanel_device = (touchpanel_device_t *) d;
+
+	/* The last event held past nyx_module_close() takes the device with it */
+	if (event_pool_put(&touchpanel_device->event_pool, e))
+	{
+		free(touchpanel_device);
+	}
+
 	return NYX_ERROR_NONE;
 }
 
@@ -166,7 +269,22 @@ static inline int64_t get_ts_tval(struct timeval *tv)
 	return tv->tv_sec * 1000000000LL + tv->tv_usec * 1000;
 }
 
+#ifndef VBOXGUEST_DEVICE_NAME
 #define VBOXGUEST_DEVICE_NAME   "/dev/vboxguest"
+#endif
+
+/*
+ * "vbox" or "none" skips looking for the hypervisor, which by default is
+ * taken to be VirtualBox if VBOXGUEST_DEVICE_NAME exists.
+ */
+#define TOUCHPANEL_HYPERVISOR_ENV   "NYX_TOUCHPANEL_HYPERVISOR"
+
+typedef enum
+{
+	HYPERVISOR_UNKNOWN,
+	HYPERVISOR_NONE,
+	HYPERVISOR_VBOX
+} hypervisor_t;
 
 /** Version of VMMDevRequestHeader structure. */
 #define VMMDEV_REQUEST_HEADER_VERSION (0x10001)
@@ -237,7 +355,7 @@ static void init_vbox_touchpanel(void)
 	if (vbox_fd < 0)
 	{
 		nyx_error(MSGID_NYX_QMUX_TP_VBOX_OPEN_ERR, 0, "ERROR: vboxguest module open failed: %d", errno);
-		goto error;
+		goto exit;
 	}
 
 	VMMdev_req_mouse_status Req;
@@ -258,12 +376,12 @@ static void init_vbox_touchpanel(void)
 	          (void *)&Req.header) < 0)
 	{
 		nyx_error(MSGID_NYX_QMUX_TP_IOCTL_ERR, 0, "ERROR: vboxguest rms ioctl failed: %d", errno);
-		goto error;
+		goto exit;
 	}
 	else if (Req.header.rc < 0)
 	{
 		nyx_error(MSGID_NYX_QMUX_TP_IOCTL_READ_ERR, 0, "ERROR: vboxguest SetMouseStatus failed: %d", Req.header.rc);
-		goto error;
+		goto exit;
 	}
 
 	VMMdev_req_mouse_pointer mpReq;
@@ -290,17 +408,17 @@ static void init_vbox_touchpanel(void)
 	          (void *)&mpReq.header) < 0)
 	{
 		nyx_error(MSGID_NYX_QMUX_TP_IOCTL_REQUEST_ERR, 0,"ERROR: vboxguest mpr ioctl failed: %d", errno);
-		goto error;
+		goto exit;
 	}
 	else if (mpReq.header.rc < 0)
 	{
 		nyx_error(MSGID_NYX_QMUX_TP_SETPTR_ERR, 0,"ERROR: vboxguest SetPointerShape failed: %d", mpReq.header.rc);
-		goto error;
+		goto exit;
 	}
 
-	return;
-error:
+exit:
 
+	// Nothing needs the device open once the requests are made
 	if (vbox_fd >= 0)
 	{
 		close(vbox_fd);
@@ -309,6 +427,39 @@ error:
 	return;
 }
 
+/* Detected once per process, the answer doesn't change */
+static hypervisor_t
+touchpanel_hypervisor(void)
+{
+	static hypervisor_t sHypervisor = HYPERVISOR_UNKNOWN;
+	hypervisor_t hypervisor = __atomic_load_n(&sHypervisor, __ATOMIC_RELAXED);
+	const char *forced;
+
+	if (hypervisor != HYPERVISOR_UNKNOWN)
+	{
+		return hypervisor;
+	}
+
+	forced = getenv(TOUCHPANEL_HYPERVISOR_ENV);
+
+	if (forced && 0 == strcmp(forced, "vbox"))
+	{
+		hypervisor = HYPERVISOR_VBOX;
+	}
+	else if (forced && 0 == strcmp(forced, "none"))
+	{
+		hypervisor = HYPERVISOR_NONE;
+	}
+	else
+	{
+		hypervisor = access(VBOXGUEST_DEVICE_NAME, F_OK) == 0 ? HYPERVISOR_VBOX :
+		             HYPERVISOR_NONE;
+	}
+
+	__atomic_store_n(&sHypervisor, hypervisor, __ATOMIC_RELAXED);
+	return hypervisor;
+}
+
 
 /*
  * FIXME: The following two definitions are a temporary hack to work around
@@ -321,25 +472,126 @@ static general_settings_t sGeneralSettings =
 	.fingerDownThreshold = 0
 };
 
+/*
+ * Software scan-rate governor. The active rate caps how often motion frames
+ * are emitted while a finger is down; once nothing has touched the panel
+ * for noTouchThreshold ms, idle frames are only processed at scanRate.
+ * Frames over either limit are dropped rather than held back, the next one
+ * carries the newer position. DOWN and UP frames are never limited.
+ * A rate of 0 means unlimited.
+ */
+static const interrupt_on_touch_settings_t sDefaultIdleSettings =
+{
+	.enabled = false,
+	.scanRate = 0,
+	.wakeThreshold = 0,
+	.noTouchThreshold = 500
+};
+
+static inline int64_t get_ms_tval(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000LL + tv->tv_usec / 1000;
+}
+
+/* Account for a frame that went out at now_ms, touched if a finger was down */
+static void
+scan_governor_note(touchpanel_device_t *touch_device, int64_t now_ms,
+                   bool touched)
+{
+	if (touched)
+	{
+		touch_device->lastTouchMs = now_ms;
+	}
+
+	touch_device->lastScanMs = now_ms;
+}
+
+/* Decide whether a frame seen at now_ms may go through */
+static bool
+scan_governor_allow(touchpanel_device_t *touch_device, int64_t now_ms,
+                    bool touching)
+{
+	unsigned int rate = 0;
+
+	if (touching)
+	{
+		touch_device->lastTouchMs = now_ms;
+		rate = touch_device->activeScanRate;
+	}
+	else if (touch_device->idleSettings.enabled &&
+	         now_ms - touch_device->lastTouchMs >= touch_device->idleSettings.noTouchThreshold)
+	{
+		rate = touch_device->idleSettings.scanRate;
+	}
+
+	if (rate > 0)
+	{
+		int64_t elapsed = now_ms - touch_device->lastScanMs;
+
+		if (elapsed >= 0 && elapsed < 1000 / rate)
+		{
+			return false;
+		}
+	}
+
+	touch_device->lastScanMs = now_ms;
+	return true;
+}
+
+/* Whether a finger is on the panel once the events so far are applied */
+static bool
+touch_in_contact(const touchpanel_device_t *touch_device)
+{
+	int i;
+
+	if (!touch_device->mtMode)
+	{
+		return touch_device->touchButtonState != 0;
+	}
+
+	for (i = 0; i < MAX_MT_SLOTS; i++)
+	{
+		if (touch_device->mtSlots[i].trackingId >= 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#ifndef FRAMEBUF_DEVICE_NAME
 #define FRAMEBUF_DEVICE_NAME    "/dev/fb"
+#endif
+
+/* Framebuffer to take the display resolution from, instead of the above */
+#define TOUCHPANEL_FB_ENV       "NYX_TOUCHPANEL_FB"
+
+/*
+ * Set to re-read the display mode every that many ms, for setups that
+ * change it at runtime. By default it is only read once per open, so an
+ * idle process does not wake up for it.
+ */
+#define TOUCHPANEL_DISPLAY_POLL_ENV     "NYX_TOUCHPANEL_DISPLAY_POLL_MS"
+#define DISPLAY_POLL_MS_DEFAULT         0
 
+/* May be called periodically, so failures are left to the caller to report */
 static int
 get_display_res(int *x, int *y)
 {
 	int ret = -1;
 	struct fb_var_screeninfo varinfo;
+	const char *fb = getenv(TOUCHPANEL_FB_ENV);
 
-	int displayFd = open(FRAMEBUF_DEVICE_NAME, O_RDONLY);
+	int displayFd = open(fb ? fb : FRAMEBUF_DEVICE_NAME, O_RDONLY | O_CLOEXEC);
 
 	if (displayFd < 0)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_OPEN_FB_ERR, 0, "Error in opening fb file");
 		return ret;
 	}
 
 	if (ioctl(displayFd, FBIOGET_VSCREENINFO, &varinfo) < 0)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_VSCREEN_INFO_ERR, 0, "Error in getting var screen info");
 		goto exit;
 	}
 
@@ -353,194 +605,668 @@ exit:
 	return ret;
 }
 
+/*
+ * The display resolution as x << 16 | y, 0 until it is known. It is read
+ * by a thread started at open, so that neither the probe nor the
+ * hypervisor setup hold up nyx_module_open(). By default that thread
+ * reads it once and exits. With TOUCHPANEL_DISPLAY_POLL_ENV set, a single
+ * thread runs from the first open to the last close and keeps it current
+ * across mode changes. Devices compare it with the value they were scaled
+ * for once per read, see fill_raw_event_list().
+ */
+static uint32_t sDisplayRes;
 
-static float scaleX, scaleY;
+static inline uint32_t
+display_res_pack(int x, int y)
+{
+	if (x <= 0 || y <= 0 || x > 0xffff || y > 0xffff)
+	{
+		return 0;
+	}
 
-static int
-init_touchpanel(void)
+	return (uint32_t) x << 16 | (uint32_t) y;
+}
+
+static inline int
+display_res_x(uint32_t res)
 {
-	struct input_absinfo abs;
-	int  maxX, maxY, sXres, sYres, ret = -1;
+	return res >> 16;
+}
+
+static inline int
+display_res_y(uint32_t res)
+{
+	return res & 0xffff;
+}
 
-	touchpanel_event_fd = open("/dev/input/touchscreen0", O_RDWR);
+static struct
+{
+	pthread_mutex_t lock;
+	unsigned int users;         /**< open devices */
+	int interval_ms;
+	int stop_fd;
+	bool running;
+	pthread_t thread;
+} sDisplayWatch = { .lock = PTHREAD_MUTEX_INITIALIZER, .stop_fd = -1 };
+
+static void *
+display_watch_thread(void *arg)
+{
+	static bool vbox_done;
+	struct pollfd stop = { .fd = sDisplayWatch.stop_fd, .events = POLLIN };
+	uint32_t last = __atomic_load_n(&sDisplayRes, __ATOMIC_RELAXED);
+	bool failed = false;
 
-	if (touchpanel_event_fd < 0)
+	for (;;)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_OPEN_ERR, 0,"Error in opening touchpanel event device");
-		return -1;
-	}
+		int x = 0, y = 0;
+		uint32_t res = get_display_res(&x, &y) == 0 ? display_res_pack(x, y) : 0;
+		int ret;
 
-	ret = ioctl(touchpanel_event_fd, EVIOCGABS(0), &abs);
+		/* Keep the last mode known when the framebuffer is briefly unreadable */
+		if (0 == res)
+		{
+			if (!failed && last)
+			{
+				nyx_error(MSGID_NYX_QMUX_TP_RES_ERR, 0,
+				          "Failed to get display resolution, keeping the last one");
+			}
+			else if (!failed)
+			{
+				nyx_error(MSGID_NYX_QMUX_TP_RES_ERR, 0,
+				          "Failed to get display resolution, touches stay unscaled");
+			}
+		}
+		else if (res != last)
+		{
+			nyx_debug("Display is %dx%d", x, y);
+			__atomic_store_n(&sDisplayRes, res, __ATOMIC_RELAXED);
+			last = res;
+		}
 
-	if (ret < 0)
-	{
-		nyx_error(MSGID_NYX_QMUX_TP_EVENT_HLIMIT_ERR, 0,"Error in fetching screen horizontal limits");
-		goto error;
-	}
+		failed = 0 == res;
 
-	maxX = abs.maximum;
+		// The following function is valid only for virtualbox qemux86 image
+		if (!vbox_done)
+		{
+			vbox_done = true;
 
-	ret = ioctl(touchpanel_event_fd, EVIOCGABS(1), &abs);
+			if (HYPERVISOR_VBOX == touchpanel_hypervisor())
+			{
+				init_vbox_touchpanel();
+			}
+		}
 
-	if (ret < 0)
-	{
-		nyx_error(MSGID_NYX_QMUX_TP_EVENT_VLIMIT_ERR, 0, "Error in fetching screen vertical limits");
-		goto error;
+		if (sDisplayWatch.interval_ms <= 0)
+		{
+			break;
+		}
+
+		ret = poll(&stop, 1, sDisplayWatch.interval_ms);
+
+		if (ret > 0 || (ret < 0 && errno != EINTR))
+		{
+			break;
+		}
 	}
 
-	maxY = abs.maximum;
+	return NULL;
+}
+
+/* Probe the display for a device being opened, see sDisplayRes */
+static void
+display_watch_start(void)
+{
+	const char *interval = getenv(TOUCHPANEL_DISPLAY_POLL_ENV);
+	bool first;
 
-	// The following function is valid only for virtualbox qemux86 image
-	init_vbox_touchpanel();
-	init_gesture_state_machine(&sGeneralSettings, 1);
+	pthread_mutex_lock(&sDisplayWatch.lock);
+	first = 0 == sDisplayWatch.users++;
 
-	/* Get the display resolution */
-	if (get_display_res(&sXres, &sYres) < 0)
+	if (first)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_RES_ERR, 0, "Failed to get display resolution");
-		goto error;
+		sDisplayWatch.interval_ms = interval ? atoi(interval) : DISPLAY_POLL_MS_DEFAULT;
+		sDisplayWatch.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	}
 
-	scaleX = (float)sXres / (float)maxX;
-	scaleY = (float)sYres / (float)maxY;
+	/* A polling thread is shared, a one-shot probe is redone per open */
+	if (first || sDisplayWatch.interval_ms <= 0)
+	{
+		if (sDisplayWatch.running)
+		{
+			pthread_join(sDisplayWatch.thread, NULL);
+		}
 
-	return 0;
-error:
+		sDisplayWatch.running = sDisplayWatch.stop_fd >= 0 &&
+		                        pthread_create(&sDisplayWatch.thread, NULL,
+		                                       display_watch_thread, NULL) == 0;
 
-	if (touchpanel_event_fd >= 0)
-	{
-		close(touchpanel_event_fd);
+		if (!sDisplayWatch.running)
+		{
+			nyx_warn(MSGID_NYX_QMUX_TP_RES_ERR, 0,
+			         "Cannot probe the display in the background, mode changes will be missed");
+			sDisplayWatch.interval_ms = 0;
+			display_watch_thread(NULL);
+		}
 	}
 
-	return ret;
+	pthread_mutex_unlock(&sDisplayWatch.lock);
 }
 
-
-nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
+/* ...and stop with the last, before the module can be unloaded */
+static void
+display_watch_stop(void)
 {
+	uint64_t one = 1;
 
-	touchpanel_device_t *touchpanel_device = (touchpanel_device_t *) calloc(
-	            sizeof(touchpanel_device_t), 1);
+	pthread_mutex_lock(&sDisplayWatch.lock);
 
-	if (G_UNLIKELY(!touchpanel_device))
+	if (sDisplayWatch.users > 0 && 0 == --sDisplayWatch.users)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_OUT_OF_MEMORY, 0, "Out of memory");
-		return NYX_ERROR_OUT_OF_MEMORY;
-	}
+		if (sDisplayWatch.running)
+		{
+			if (write(sDisplayWatch.stop_fd, &one, sizeof(one)) < 0)
+			{
+				/* Only fails once the counter is saturated, it is readable then */
+			}
 
+			pthread_join(sDisplayWatch.thread, NULL);
+			sDisplayWatch.running = false;
+		}
 
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                                     NYX_GET_EVENT_SOURCE_MODULE_METHOD, "touchpanel_get_event_source");
+		if (sDisplayWatch.stop_fd >= 0)
+		{
+			close(sDisplayWatch.stop_fd);
+			sDisplayWatch.stop_fd = -1;
+		}
+	}
 
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_GET_EVENT_MODULE_METHOD, "touchpanel_get_event");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_RELEASE_EVENT_MODULE_METHOD, "touchpanel_release_event");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_SET_OPERATING_MODE_MODULE_METHOD, "touchpanel_set_operating_mode");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_SET_ACTIVE_SCAN_RATE_MODULE_METHOD,
-	                           "touchpanel_set_active_scan_rate");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_SET_IDLE_SCAN_RATE_MODULE_METHOD,
-	                           "touchpanel_set_idle_scan_rate");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_GET_IDLE_SCAN_RATE_MODULE_METHOD,
-	                           "touchpanel_get_idle_scan_rate");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_GET_ACTIVE_SCAN_RATE_MODULE_METHOD,
-	                           "touchpanel_get_active_scan_rate");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_SET_MODE_MODULE_METHOD, "touchpanel_set_mode");
-	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
-	                           NYX_TOUCHPANEL_GET_MODE_MODULE_METHOD, "touchpanel_get_mode");
+	pthread_mutex_unlock(&sDisplayWatch.lock);
+}
 
-	*d = (nyx_device_t *) touchpanel_device;
 
-	if (init_touchpanel() < 0)
+static bool
+is_mt_device(int fd)
+{
+	unsigned long absBits[NBITS(ABS_CNT)] = { 0 };
+
+	if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absBits)), absBits) < 0)
 	{
-		goto fail_unlock_settings;
+		return false;
 	}
 
-	return NYX_ERROR_NONE;
-
-fail_unlock_settings:
-	return NYX_ERROR_GENERIC;
+	return TEST_BIT(ABS_MT_SLOT, absBits) &&
+	       TEST_BIT(ABS_MT_TRACKING_ID, absBits) &&
+	       TEST_BIT(ABS_MT_POSITION_X, absBits) &&
+	       TEST_BIT(ABS_MT_POSITION_Y, absBits);
 }
 
-nyx_error_t nyx_module_close(nyx_device_t *d)
+static void
+reset_mt_slots(touchpanel_device_t *touch_device)
 {
+	int i;
 
-	touchpanel_device_t *touchpanel_device = (touchpanel_device_t *) d;
-
-	if (touchpanel_device->current_event_ptr)
+	for (i = 0; i < MAX_MT_SLOTS; i++)
 	{
-		touchpanel_release_event(d,
-		                         (nyx_event_t *) touchpanel_device->current_event_ptr);
+		touch_device->mtSlots[i].trackingId = -1;
+		touch_device->mtSlots[i].x = 0;
+		touch_device->mtSlots[i].y = 0;
 	}
 
-	nyx_debug("Freeing touchpanel %p", d);
+	touch_device->mtCurrentSlot = 0;
+}
 
-	deinit_gesture_state_machine();
-	free(d);
+/*
+ * Have the kernel drop everything handle_new_event() ignores: EV_MSC
+ * timestamps and scancodes, and relative motion except the wheel.
+ */
+static void
+filter_touchpanel_events(int fd)
+{
+	static const unsigned int types[] = { EV_SYN, EV_KEY, EV_REL, EV_ABS };
+	static const unsigned int rel_codes[] = { REL_WHEEL };
 
-	if (touchpanel_event_fd >= 0)
+	if (evdev_set_mask(fd, EV_SYN, types, G_N_ELEMENTS(types), EV_CNT) < 0 ||
+	        evdev_set_mask(fd, EV_REL, rel_codes, G_N_ELEMENTS(rel_codes), REL_CNT) < 0)
 	{
-		close(touchpanel_event_fd);
-		touchpanel_event_fd = -1;
+		nyx_debug("EVIOCSMASK not supported (%d), filtering touch events in userspace",
+		          errno);
 	}
 
-
-	return NYX_ERROR_NONE;
+	if (evdev_grab_requested() && evdev_grab(fd) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_OPEN_ERR, 0, "Failed to grab touchpanel device");
+	}
 }
 
-nyx_error_t touchpanel_get_event_source(nyx_device_t *d, int *f)
+/* Absolute X/Y, as matched by the touchscreen0 rule in 99-nyx-modules.rules */
+static bool
+is_touchscreen(int fd)
 {
+	unsigned long absBits[NBITS(ABS_CNT)] = { 0 };
 
-	if (NULL == d)
+	if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absBits)), absBits) < 0)
 	{
-		return NYX_ERROR_INVALID_HANDLE;
+		return false;
 	}
 
-	if (NULL == f)
+	return TEST_BIT(ABS_X, absBits) && TEST_BIT(ABS_Y, absBits);
+}
+
+/*
+ * Touch coordinates are scaled in Q32 fixed point: a factor of
+ * ceil(2^32 * res / max) gives exactly floor(value * res / max) for any
+ * 0 <= value <= max < 65536, with one multiply and no float conversions.
+ */
+#define TOUCH_SCALE_SHIFT   32
+#define TOUCH_SCALE_ONE     (1ULL << TOUCH_SCALE_SHIFT)
+
+static inline uint64_t
+touch_scale_factor(int32_t res, int32_t max)
+{
+	if (res <= 0 || max <= 0)
 	{
-		return NYX_ERROR_INVALID_VALUE;
+		return TOUCH_SCALE_ONE;
 	}
 
-	*f = touchpanel_event_fd;
-
-	return NYX_ERROR_NONE;
+	return (((uint64_t) res << TOUCH_SCALE_SHIFT) + max - 1) / max;
 }
 
-nyx_error_t touchpanel_set_operating_mode(nyx_device_t *d,
-        nyx_operating_mode_t m)
+static inline int
+touch_scale(int32_t value, uint64_t factor)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	return (int)(((int64_t) value * (int64_t) factor) >> TOUCH_SCALE_SHIFT);
 }
 
-void
-get_time_stamp(time_stamp_t *pTime)
+/*
+ * Scale to the display, 1:1 while its resolution is unknown. Recording
+ * only starts once it is known, since the log header has to describe the
+ * scaling, and stops if the mode changes. The first device sets the header.
+ */
+static void
+update_touchpanel_scale(touchpanel_device_t *touch_device)
 {
-	struct timeval tv;
-	(void)gettimeofday(&tv, NULL);
+	const char *record = getenv(TOUCHPANEL_RECORD_ENV);
+	evdev_log_info_t *info = &touch_device->axes;
 
-	pTime->time.tv_sec = tv.tv_sec;
-	pTime->time.tv_nsec = tv.tv_usec * 1000;
-}
+	if (touch_device->trackDisplay)
+	{
+		uint32_t res = __atomic_load_n(&sDisplayRes, __ATOMIC_RELAXED);
 
+		if (touch_device->displayRes != 0 && evdev_log_recording(&touch_device->record))
+		{
+			nyx_warn(MSGID_NYX_QMUX_TP_RECORD_ERR, 0,
+			         "Display mode changed, no longer recording touch events");
 
-int cachedX, cachedY;
+			if (evdev_log_recorder_close(&touch_device->record) < 0)
+			{
+				nyx_warn(MSGID_NYX_QMUX_TP_RECORD_ERR, 0, "Failed to write the touch event log");
+			}
+		}
 
-static void
-generate_mouse_gesture(int touchButtonState)
+		touch_device->displayRes = res;
+		info->res_x = display_res_x(res);
+		info->res_y = display_res_y(res);
+	}
+
+	touch_device->scaleX = touch_scale_factor(info->res_x, info->max_x);
+	touch_device->scaleY = touch_scale_factor(info->res_y, info->max_y);
+
+	if (touch_device->recordPending && info->res_x > 0)
+	{
+		touch_device->recordPending = false;
+
+		if (!evdev_log_recording(&touch_device->record) &&
+		        evdev_log_recorder_open(&touch_device->record, record, info) < 0)
+		{
+			nyx_warn(MSGID_NYX_QMUX_TP_RECORD_ERR, 0, "Cannot record touch events to %s",
+			         record);
+		}
+	}
+}
+
+/*
+ * Set up scaling and the gesture state for the device info describes. A
+ * res_x of 0 follows the display resolution from the watcher.
+ */
+static void
+setup_touchpanel(touchpanel_device_t *touch_device, const evdev_log_info_t *info)
+{
+	touch_device->mtMode = (info->flags & EVDEV_LOG_MT) != 0;
+	reset_mt_slots(touch_device);
+
+	deinit_gesture_state_machine(&touch_device->gestures);
+	init_gesture_state_machine(&touch_device->gestures, &sGeneralSettings,
+	                           touch_device->mtMode ? MAX_MT_SLOTS : 1);
+
+	touch_device->axes = *info;
+	touch_device->trackDisplay = 0 == info->res_x;
+	touch_device->displayRes = 0;
+	touch_device->recordPending = getenv(TOUCHPANEL_RECORD_ENV) != NULL;
+	update_touchpanel_scale(touch_device);
+}
+
+/* Find out what a newly found touch node looks like and set up for it */
+static int
+attach_touchpanel(void *ctx, int fd, bool preferred)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) ctx;
+	evdev_log_info_t info = { 0 };
+	struct input_absinfo abs;
+	int ret = -1;
+	int absX = ABS_X, absY = ABS_Y;
+
+	if (!preferred && !is_touchscreen(fd))
+	{
+		return -1;
+	}
+
+	filter_touchpanel_events(fd);
+
+	if (evdev_set_clock(fd) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_OPEN_ERR, 0,
+		         "Failed to select touch event clock, using CLOCK_REALTIME");
+	}
+
+	if (is_mt_device(fd))
+	{
+		info.flags |= EVDEV_LOG_MT;
+		absX = ABS_MT_POSITION_X;
+		absY = ABS_MT_POSITION_Y;
+	}
+
+	ret = ioctl(fd, EVIOCGABS(absX), &abs);
+
+	if (ret < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_EVENT_HLIMIT_ERR, 0,"Error in fetching screen horizontal limits");
+		return ret;
+	}
+
+	info.max_x = abs.maximum;
+
+	ret = ioctl(fd, EVIOCGABS(absY), &abs);
+
+	if (ret < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_EVENT_VLIMIT_ERR, 0, "Error in fetching screen vertical limits");
+		return ret;
+	}
+
+	info.max_y = abs.maximum;
+
+	setup_touchpanel(touch_device, &info);
+
+	nyx_debug("Touchpanel %p: attached input device (fd %d, %s)", ctx, fd,
+	          touch_device->mtMode ? "multi-touch" : "single touch");
+
+	return 0;
+}
+
+/* Forget any half read frame of a device that went away */
+static void
+detach_touchpanel(void *ctx, int fd)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) ctx;
+
+	touchpanel_event_list_reset(&touch_device->raw_list, 0);
+	reset_mt_slots(touch_device);
+
+	nyx_debug("Touchpanel %p: input device removed (fd %d)", ctx, fd);
+}
+
+/*
+ * Set up for the device the log was recorded from, with the display
+ * resolution it had, so that every frame scales exactly as it did then.
+ */
+static int
+init_touchpanel_replay(touchpanel_device_t *touch_device, const char *path)
+{
+	evdev_log_player_t *replay = &touch_device->replay;
+
+	if (evdev_log_player_open(replay, path, evdev_log_paced(),
+	                          touch_device->input.epoll_fd) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_REPLAY_ERR, 0, "Cannot replay touch events from %s",
+		          path);
+		return -1;
+	}
+
+	if (replay->info.max_x <= 0 || replay->info.max_y <= 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_REPLAY_ERR, 0, "%s has no touch axes", path);
+		evdev_log_player_close(replay);
+		return -1;
+	}
+
+	setup_touchpanel(touch_device, &replay->info);
+
+	nyx_debug("Touchpanel %p: replaying %zu events from %s (%s)", touch_device,
+	          replay->count, path, touch_device->mtMode ? "multi-touch" : "single touch");
+
+	return 0;
+}
+
+/*
+ * The touch device is looked for under /dev/input now and whenever nodes
+ * appear there, so the module keeps working if udev is late or the device
+ * re-enumerates. The touchscreen0 symlink is preferred.
+ */
+static int
+init_touchpanel(touchpanel_device_t *touch_device)
+{
+	const char *replay = getenv(TOUCHPANEL_REPLAY_ENV);
+
+	touchpanel_event_list_reset(&touch_device->event_list, 0);
+	touchpanel_event_list_reset(&touch_device->raw_list, 0);
+	touchpanel_event_list_reset(&touch_device->pending_list, 0);
+
+	/* A replayed log is the only input, no touch device is attached */
+	if (evdev_hotplug_init(&touch_device->input, EVDEV_HOTPLUG_DIR, "touchscreen0",
+	                       replay ? 0 : 1, attach_touchpanel, detach_touchpanel,
+	                       touch_device) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_OPEN_ERR, 0,"Error in creating touchpanel event source");
+		return -1;
+	}
+
+	if (replay)
+	{
+		return init_touchpanel_replay(touch_device, replay);
+	}
+
+	if (touch_device->input.inotify_fd < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_OPEN_ERR, 0,
+		         "Cannot watch %s, a touch device plugged in later will be missed",
+		         EVDEV_HOTPLUG_DIR);
+	}
+
+	if (0 == touch_device->input.node_count)
+	{
+		nyx_debug("No touch device yet, waiting for one to appear");
+	}
+
+	return 0;
+}
+
+
+nyx_error_t nyx_module_open(nyx_instance_t i, nyx_device_t **d)
+{
+
+	touchpanel_device_t *touchpanel_device = (touchpanel_device_t *) calloc(
+	            sizeof(touchpanel_device_t), 1);
+
+	if (G_UNLIKELY(!touchpanel_device))
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_OUT_OF_MEMORY, 0, "Out of memory");
+		return NYX_ERROR_OUT_OF_MEMORY;
+	}
+
+	if (event_pool_init(&touchpanel_device->event_pool,
+	                    sizeof(nyx_event_touchpanel_t),
+	                    event_pool_size_from_env(TOUCHPANEL_EVENT_POOL_ENV,
+	                            TOUCHPANEL_EVENT_POOL_SIZE)) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_OUT_OF_MEMORY, 0,
+		         "Failed to preallocate touch events, falling back to malloc");
+	}
+
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                                     NYX_GET_EVENT_SOURCE_MODULE_METHOD, "touchpanel_get_event_source");
+
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_GET_EVENT_MODULE_METHOD, "touchpanel_get_event");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_RELEASE_EVENT_MODULE_METHOD, "touchpanel_release_event");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_SET_OPERATING_MODE_MODULE_METHOD, "touchpanel_set_operating_mode");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_SET_ACTIVE_SCAN_RATE_MODULE_METHOD,
+	                           "touchpanel_set_active_scan_rate");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_SET_IDLE_SCAN_RATE_MODULE_METHOD,
+	                           "touchpanel_set_idle_scan_rate");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_GET_IDLE_SCAN_RATE_MODULE_METHOD,
+	                           "touchpanel_get_idle_scan_rate");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_GET_ACTIVE_SCAN_RATE_MODULE_METHOD,
+	                           "touchpanel_get_active_scan_rate");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_SET_MODE_MODULE_METHOD, "touchpanel_set_mode");
+	nyx_module_register_method(i, (nyx_device_t *) touchpanel_device,
+	                           NYX_TOUCHPANEL_GET_MODE_MODULE_METHOD, "touchpanel_get_mode");
+
+	touchpanel_device->idleSettings = sDefaultIdleSettings;
+	display_watch_start();
+	input_trace_init();
+	perf_counters_init(&touchpanel_device->perf, false, PERF_EVENT_TIMING_PERIOD);
+
+	if (init_touchpanel(touchpanel_device) < 0)
+	{
+		goto fail;
+	}
+
+	touchpanel_device->input.perf = &touchpanel_device->perf;
+	*d = (nyx_device_t *) touchpanel_device;
+
+	return NYX_ERROR_NONE;
+
+fail:
+	/* Nothing has been handed out yet, so the pool goes right away */
+	deinit_gesture_state_machine(&touchpanel_device->gestures);
+	evdev_hotplug_destroy(&touchpanel_device->input);
+	display_watch_stop();
+	event_pool_destroy(&touchpanel_device->event_pool);
+	free(touchpanel_device);
+	*d = NULL;
+
+	return NYX_ERROR_GENERIC;
+}
+
+/*
+ * Events the consumer still holds stay valid: the device then lingers,
+ * closed, until the last of them is released through it.
+ */
+nyx_error_t nyx_module_close(nyx_device_t *d)
+{
+
+	touchpanel_device_t *touchpanel_device = (touchpanel_device_t *) d;
+
+	if (event_ring_active(&touchpanel_device->ring))
+	{
+		event_ring_stop(&touchpanel_device->ring);
+		pthread_join(touchpanel_device->ring_thread, NULL);
+		event_ring_destroy(&touchpanel_device->ring);
+	}
+
+	if (touchpanel_device->current_event_ptr)
+	{
+		touchpanel_release_event(d,
+		                         (nyx_event_t *) touchpanel_device->current_event_ptr);
+		touchpanel_device->current_event_ptr = NULL;
+	}
+
+	nyx_debug("Freeing touchpanel %p (%u event pool fallback allocations, "
+	          "%u coalesced frames)", d, touchpanel_device->event_pool.fallback_allocs,
+	          touchpanel_device->coalesced_frames);
+
+	deinit_gesture_state_machine(&touchpanel_device->gestures);
+
+	evdev_log_player_close(&touchpanel_device->replay);
+	evdev_hotplug_destroy(&touchpanel_device->input);
+
+	if (evdev_log_recorder_close(&touchpanel_device->record) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_RECORD_ERR, 0, "Failed to write the touch event log");
+	}
+
+	if (input_trace_dump() < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_TRACE_ERR, 0, "Failed to write the input trace");
+	}
+
+	display_watch_stop();
+	if (event_pool_destroy(&touchpanel_device->event_pool) == 0)
+	{
+		free(d);
+	}
+	else
+	{
+		nyx_debug("Touchpanel %p closed with events still held, freed with the last one", d);
+	}
+
+	return NYX_ERROR_NONE;
+}
+
+nyx_error_t touchpanel_get_event_source(nyx_device_t *d, int *f)
+{
+
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == f)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+
+	*f = event_ring_active(&touch_device->ring) ? touch_device->ring.event_fd :
+	     touch_device->input.epoll_fd;
+
+	return NYX_ERROR_NONE;
+}
+
+nyx_error_t touchpanel_set_operating_mode(nyx_device_t *d,
+        nyx_operating_mode_t m)
+{
+	return NYX_ERROR_NOT_IMPLEMENTED;
+}
+
+/* Frames are stamped with the time the kernel gave the evdev events */
+static inline void
+time_stamp_from_tval(time_stamp_t *pTime, const struct timeval *tv)
+{
+	pTime->time.tv_sec = tv->tv_sec;
+	pTime->time.tv_nsec = tv->tv_usec * 1000;
+}
+
+static void
+generate_mouse_gesture(touchpanel_device_t *touch_device, int touchButtonState,
+                       const struct timeval *tv)
 {
 	int32_t xOrd[2], yOrd[2], wOrd[2], fingers;
 	time_stamp_t eventTime;
 	int num_events = 0;
 
-	get_time_stamp(&eventTime);
-	xOrd[0] = cachedX;
-	yOrd[0] = cachedY;
+	time_stamp_from_tval(&eventTime, tv);
+	xOrd[0] = touch_device->cachedX;
+	yOrd[0] = touch_device->cachedY;
 	wOrd[0] = touchButtonState ? 1 : 0;
 	fingers = touchButtonState ? 1 : 0;
 
@@ -548,13 +1274,88 @@ generate_mouse_gesture(int touchButtonState)
 	yOrd[1] = 0;
 	wOrd[1] = 0;
 
-	gesture_state_machine(xOrd, yOrd, wOrd, fingers, &eventTime,
-	                      touchpanel_event_list.input, &num_events);
-	touchpanel_event_list.input_filled = num_events * sizeof(input_event_t);
-	touchpanel_event_list.input_read = 0;
+	perf_count(&touch_device->perf, PERF_GESTURE_RUNS, 1);
+	gesture_state_machine(&touch_device->gestures, xOrd, yOrd, wOrd, fingers,
+	                      &eventTime, touch_device->event_list.input, &num_events);
+	touchpanel_event_list_reset(&touch_device->event_list, num_events);
 }
 
 
+static void
+generate_mt_gesture(touchpanel_device_t *touch_device, const struct timeval *tv)
+{
+	int32_t ids[MAX_MT_SLOTS], xOrd[MAX_MT_SLOTS], yOrd[MAX_MT_SLOTS];
+	time_stamp_t eventTime;
+	int num_events = 0;
+	int i;
+
+	time_stamp_from_tval(&eventTime, tv);
+
+	for (i = 0; i < MAX_MT_SLOTS; i++)
+	{
+		ids[i] = touch_device->mtSlots[i].trackingId;
+		xOrd[i] = touch_device->mtSlots[i].x;
+		yOrd[i] = touch_device->mtSlots[i].y;
+	}
+
+	perf_count(&touch_device->perf, PERF_GESTURE_RUNS, 1);
+	gesture_state_machine_mt(&touch_device->gestures, ids, xOrd, yOrd,
+	                         MAX_MT_SLOTS, &eventTime,
+	                         touch_device->event_list.input, &num_events);
+	touchpanel_event_list_reset(&touch_device->event_list, num_events);
+}
+
+/*
+ * Protocol B devices report per-slot state and do their own contact
+ * tracking; legacy single-touch ABS_X/ABS_Y/BTN_TOUCH emulation is ignored.
+ */
+static void handle_mt_event(touchpanel_device_t *touch_device,
+                            input_event_t *event)
+{
+	// Contacts in slots we cannot report are dropped
+	int current = touch_device->mtCurrentSlot;
+	mt_slot_t *slot = (current >= 0 && current < MAX_MT_SLOTS) ?
+	                  &touch_device->mtSlots[current] : NULL;
+
+	if (event->type == EV_ABS)
+	{
+		if (event->code == ABS_MT_SLOT)
+		{
+			touch_device->mtCurrentSlot = event->value;
+			return;
+		}
+
+		if (NULL == slot)
+		{
+			return;
+		}
+
+		switch (event->code)
+		{
+
+			case ABS_MT_TRACKING_ID:
+				slot->trackingId = event->value;
+				break;
+
+			case ABS_MT_POSITION_X:
+				slot->x = touch_scale(event->value, touch_device->scaleX);
+				break;
+
+			case ABS_MT_POSITION_Y:
+				slot->y = touch_scale(event->value, touch_device->scaleY);
+				break;
+
+			default:
+				break;
+		}
+	}
+	else if (event->type == EV_SYN && event->code == SYN_REPORT)
+	{
+		/* ingest_frame() applies the scan rates to the finished frame */
+		generate_mt_gesture(touch_device, &event->time);
+	}
+}
+
 /**
  * An EV_SYN event that is a flag to indicate that we've just started a plugin
  * and anything expecting us to be in a certain state should clear its state
@@ -562,19 +1363,24 @@ generate_mouse_gesture(int touchButtonState)
 #define SYN_START       8
 
 
-static void handle_new_event(input_event_t *event)
+static void handle_new_event(touchpanel_device_t *touch_device,
+                             input_event_t *event)
 {
-	static int touchButtonState = 0;
+	if (touch_device->mtMode)
+	{
+		handle_mt_event(touch_device, event);
+		return;
+	}
 
 	// Truncate scaled X & Y coordinate values
 	if ((event->type == EV_ABS) && (event->code == ABS_X))
 	{
-		cachedX = (int)(event->value * scaleX);
+		touch_device->cachedX = touch_scale(event->value, touch_device->scaleX);
 	}
 
 	else if ((event->type == EV_ABS) && (event->code == ABS_Y))
 	{
-		cachedY = (int)(event->value * scaleY);
+		touch_device->cachedY = touch_scale(event->value, touch_device->scaleY);
 	}
 
 	// qemu touchpanel sends BTN_TOUCH, virtualbox touchpanel sends BTN_LEFT
@@ -582,116 +1388,331 @@ static void handle_new_event(input_event_t *event)
 	                                     (event->code == BTN_LEFT)))
 	{
 		// save touchButtonState (up or down)
-		touchButtonState = event->value;
+		touch_device->touchButtonState = event->value;
+
+		if (touch_device->touchButtonState == 0)
+		{
+			/* generate another event with the coordinates and time of the
+			* release point so that we can calculate how long the mouse
+			* button has been down in the same spot and not create flicks
+			* if it has been down for long enough
+			*/
+			generate_mouse_gesture(touch_device, 1, &event->time);
+		}
+	}
+	else if (event->type == EV_SYN)
+	{
+		/* ingest_frame() applies the scan rates to the finished frame */
+		generate_mouse_gesture(touch_device, touch_device->touchButtonState,
+		                       &event->time);
+	}
+
+	if ((event->type == EV_REL && event->code == REL_WHEEL) ||
+	        (event->type == EV_KEY && (event->code == BTN_MIDDLE ||
+	                                   event->code == BTN_SIDE ||
+	                                   event->code == BTN_EXTRA || event->code == BTN_FORWARD ||
+	                                   event->code == BTN_BACK || event->code == BTN_TASK)))
+	{
+		memcpy(&touch_device->event_list.input[0], event, sizeof(input_event_t));
+		// Forward an EV_SYN after the key event, to make sure it is processed immediately.
+		input_event_t syn_event;
+		syn_event.time = event->time;
+		syn_event.type = EV_SYN;
+		syn_event.code = SYN_START;
+		syn_event.value = 0;
+
+		memcpy(&touch_device->event_list.input[1], &syn_event, sizeof(input_event_t));
+
+		touchpanel_event_list_reset(&touch_device->event_list, 2);
+	}
+
+	return;
+}
+
+static int
+fill_raw_event_list(touchpanel_device_t *touch_device)
+{
+	ssize_t rd;
+
+	/* A relaxed load per read is all a display mode change costs */
+	if (G_UNLIKELY(touch_device->trackDisplay &&
+	               __atomic_load_n(&sDisplayRes, __ATOMIC_RELAXED) != touch_device->displayRes))
+	{
+		update_touchpanel_scale(touch_device);
+	}
+
+	if (evdev_log_replaying(&touch_device->replay))
+	{
+		rd = evdev_log_play(&touch_device->replay, touch_device->raw_list.input,
+		                    sizeof(touch_device->raw_list.input));
+	}
+	else
+	{
+		rd = evdev_hotplug_read(&touch_device->input, touch_device->raw_list.input,
+		                        sizeof(touch_device->raw_list.input));
+	}
+
+	if (rd < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_EVT_READ_ERR, 0, "Failed to read events from touchpanel event file");
+		return -1;
+	}
+
+	if (rd > 0 && evdev_log_recording(&touch_device->record) &&
+	        evdev_log_record(&touch_device->record, touch_device->raw_list.input, rd) < 0)
+	{
+		nyx_warn(MSGID_NYX_QMUX_TP_RECORD_ERR, 0, "Failed to write the touch event log");
+		evdev_log_recorder_close(&touch_device->record);
+	}
+
+	touchpanel_event_list_reset(&touch_device->raw_list,
+	                            rd / sizeof(input_event_t));
+	perf_count(&touch_device->perf, PERF_EVENTS_READ, rd / sizeof(input_event_t));
+	INPUT_TRACE(TP_READ, rd / sizeof(input_event_t), 0, 0, 0, 0);
+
+	return rd / sizeof(input_event_t);
+}
+
+/* A frame that reports at least one finger, in whatever state */
+static bool
+frame_has_finger(const event_list_t *list)
+{
+	size_t i, count = list->input_filled / sizeof(input_event_t);
+
+	for (i = 0; i < count; i++)
+	{
+		if (list->input[i].type == EV_FINGERID)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* A frame that only moves already-down fingers */
+static bool
+is_motion_frame(const event_list_t *list)
+{
+	size_t i, count = list->input_filled / sizeof(input_event_t);
+	bool hasFinger = false;
+
+	for (i = 0; i < count; i++)
+	{
+		switch (list->input[i].type)
+		{
+			case EV_FINGERID:
+				hasFinger = true;
+				break;
+
+			case EV_ABS:
+			case EV_SYN:
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	return hasFinger;
+}
+
+/*
+ * Feed staged raw events into the gesture code until it has produced a
+ * frame in the device event_list, refilling the staging list from the
+ * device whenever it runs dry (unless refill is false).
+ */
+static int
+ingest_frame(touchpanel_device_t *touch_device, bool refill)
+{
+	int numEvents = 0;
+	int64_t now_ms;
+
+	while (touch_device->event_list.input_read ==
+	        touch_device->event_list.input_filled)
+	{
+		if (touch_device->raw_list.input_read == touch_device->raw_list.input_filled)
+		{
+			if (!refill || fill_raw_event_list(touch_device) <= 0)
+			{
+				break;
+			}
+		}
+
+		input_event_t *pEvent = &touch_device->raw_list.input[
+		                            touch_device->raw_list.input_read / sizeof(input_event_t)];
+		touch_device->raw_list.input_read += sizeof(input_event_t);
+		numEvents++;
+
+		if (G_UNLIKELY(pEvent->type == EV_SYN && pEvent->code == SYN_DROPPED))
+		{
+			perf_count(&touch_device->perf, PERF_EVENTS_DROPPED, 1);
+		}
+
+		handle_new_event(touch_device, pEvent);
+
+		if (touch_device->event_list.input_filled == 0)
+		{
+			continue;
+		}
+
+		now_ms = get_ms_tval(&pEvent->time);
+
+		// Rate limit moves; DOWN/UP transitions always go through
+		if (!is_motion_frame(&touch_device->event_list))
+		{
+			/* An UP frame had its finger down until now */
+			scan_governor_note(touch_device, now_ms,
+			                   frame_has_finger(&touch_device->event_list));
+		}
+		else if (!scan_governor_allow(touch_device, now_ms,
+		                              touch_in_contact(touch_device)))
+		{
+			touch_device->throttled_frames++;
+			perf_count(&touch_device->perf, PERF_EVENTS_DROPPED, 1);
+			touchpanel_event_list_reset(&touch_device->event_list, 0);
+		}
+	}
+
+	return numEvents;
+}
+
+static void
+event_list_copy(event_list_t *dst, const event_list_t *src)
+{
+	memcpy(dst->input, src->input, src->input_filled);
+	dst->input_filled = src->input_filled;
+	dst->input_read = src->input_read;
+}
+
+/* Both frames report the same fingers in the same order */
+static bool
+same_fingers(const event_list_t *a, const event_list_t *b)
+{
+	size_t i = 0, j = 0;
+	size_t countA = a->input_filled / sizeof(input_event_t);
+	size_t countB = b->input_filled / sizeof(input_event_t);
 
-		if (touchButtonState == 0)
+	for (;;)
+	{
+		while (i < countA && a->input[i].type != EV_FINGERID)
 		{
-			/* generate another event with the coordinates and time of the
-			* release point so that we can calculate how long the mouse
-			* button has been down in the same spot and not create flicks
-			* if it has been down for long enough
-			*/
-			generate_mouse_gesture(1);
+			i++;
 		}
-	}
-	else if (event->type == EV_SYN)
-	{
-		generate_mouse_gesture(touchButtonState);
-	}
 
-	if ((event->type == EV_REL && event->code == REL_WHEEL) ||
-	        (event->type == EV_KEY && (event->code == BTN_MIDDLE ||
-	                                   event->code == BTN_SIDE ||
-	                                   event->code == BTN_EXTRA || event->code == BTN_FORWARD ||
-	                                   event->code == BTN_BACK || event->code == BTN_TASK)))
-	{
-		memcpy(&touchpanel_event_list.input[0], event, sizeof(input_event_t));
-		// Forward an EV_SYN after the key event, to make sure it is processed immediately.
-		input_event_t syn_event;
-		syn_event.type = EV_SYN;
-		syn_event.code = SYN_START;
-		syn_event.value = 0;
+		while (j < countB && b->input[j].type != EV_FINGERID)
+		{
+			j++;
+		}
 
-		memcpy(&touchpanel_event_list.input[1], &syn_event, sizeof(input_event_t));
+		if (i == countA || j == countB)
+		{
+			return i == countA && j == countB;
+		}
 
-		touchpanel_event_list.input_filled = 2 * sizeof(input_event_t);
-		touchpanel_event_list.input_read = 0;
+		if (a->input[i++].value != b->input[j++].value)
+		{
+			return false;
+		}
 	}
-
-	return;
 }
 
-static struct pollfd fds[1];
-
 static int
-read_input_event(void)
+read_input_event(touchpanel_device_t *touch_device)
 {
 	int numEvents = 0;
-	int rd = 0;
-	input_event_t pEvent;
-
-	fds[0].fd = touchpanel_event_fd;
-	fds[0].events = POLLIN;
 
-	int ret_val = poll(fds, 1, 0);
+	if (touch_device->pending_list.input_filled)
+	{
+		event_list_copy(&touch_device->event_list, &touch_device->pending_list);
+		touchpanel_event_list_reset(&touch_device->pending_list, 0);
+	}
+	else
+	{
+		numEvents = ingest_frame(touch_device, true);
+	}
 
-	if (ret_val <= 0)
+	if (touch_device->mode != TOUCHPANEL_MODE_COALESCE_MOTION)
 	{
-		return 0;
+		return numEvents;
 	}
 
-	if (fds[0].revents & POLLIN)
+	/*
+	 * Only look at what has already been read from the device, so a
+	 * continuous drag can never keep us from returning a frame.
+	 */
+	while (is_motion_frame(&touch_device->event_list) &&
+	        touch_device->raw_list.input_read < touch_device->raw_list.input_filled)
 	{
-		rd = read(fds[0].fd, &pEvent, sizeof(input_event_t));
+		event_list_copy(&touch_device->held_list, &touch_device->event_list);
+		touchpanel_event_list_reset(&touch_device->event_list, 0);
 
-		if (rd < 0 && errno != EINTR)
+		numEvents += ingest_frame(touch_device, false);
+
+		if (touch_device->event_list.input_filled == 0)
+		{
+			// nothing newer is complete yet
+			event_list_copy(&touch_device->event_list, &touch_device->held_list);
+			break;
+		}
+
+		if (is_motion_frame(&touch_device->event_list) &&
+		        same_fingers(&touch_device->held_list, &touch_device->event_list))
 		{
-			nyx_error(MSGID_NYX_QMUX_TP_EVT_READ_ERR, 0, "Failed to read events from keypad event file");
-			return -1;
+			touch_device->coalesced_frames++;
+			perf_count(&touch_device->perf, PERF_EVENTS_DROPPED, 1);
+			continue;
 		}
 
-		handle_new_event(&pEvent);
+		// A transition: hand out the held frame first and keep this one
+		event_list_copy(&touch_device->pending_list, &touch_device->event_list);
+		event_list_copy(&touch_device->event_list, &touch_device->held_list);
+		break;
 	}
 
 	return numEvents;
 }
 
-nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
+/*
+ * Translate the next ready frame into *e, NULL if there is none.
+ * NYX_ERROR_OUT_OF_MEMORY if no event could be had to translate it into.
+ */
+static nyx_error_t
+touchpanel_next_event(touchpanel_device_t *touch_device, nyx_event_t **e)
 {
 	int event_count = 0;
 	int event_iter = 0;
-	static int read_input = 0;
 
 	nyx_event_t *p_generated = NULL;
-	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
 
 	/*
-	 * Event bookkeeping...
+	 * Event bookkeeping... once the last generated frame has been handed
+	 * out, pull the next one from the staged (or freshly read) raw events.
 	 */
-	if (!read_input)
+	if (touch_device->event_list.input_read == touch_device->event_list.input_filled)
 	{
-		read_input_event();
-		touch_device->current_event_ptr = NULL;
-		read_input = 1;
+		read_input_event(touch_device);
 	}
 
 	/*
 	* Event bookkeeping...
 	*/
-	event_count = touchpanel_event_list.input_filled / sizeof(input_event_t);
-	event_iter = touchpanel_event_list.input_read / sizeof(input_event_t);
-
-	if (event_iter == event_count)
-	{
-		read_input = 0;
-	}
+	event_count = touch_device->event_list.input_filled / sizeof(input_event_t);
+	event_iter = touch_device->event_list.input_read / sizeof(input_event_t);
 
 	if (touch_device->current_event_ptr == NULL)
 	{
 		/*
 		* let's allocate new event and hold it here.
 		*/
-		touch_device->current_event_ptr = touch_event_create();
+		touch_device->current_event_ptr = touch_event_create(touch_device);
+
+		if (G_UNLIKELY(NULL == touch_device->current_event_ptr))
+		{
+			nyx_error(MSGID_NYX_QMUX_TP_OUT_OF_MEMORY, 0, "Out of memory");
+			*e = NULL;
+			return NYX_ERROR_OUT_OF_MEMORY;
+		}
 	}
 
 	touch_device->current_event_ptr->_parent.type = NYX_EVENT_TOUCHPANEL;
@@ -700,9 +1721,9 @@ nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
 	{
 		input_event_t *input_event_ptr;
 		nyx_touchpanel_event_item_t *item_ptr;
-		input_event_ptr = &touchpanel_event_list.input[event_iter];
+		input_event_ptr = &touch_device->event_list.input[event_iter];
 
-		touchpanel_event_list.input_read += sizeof(input_event_t);
+		touch_device->event_list.input_read += sizeof(input_event_t);
 
 		switch (input_event_ptr->type)
 		{
@@ -713,9 +1734,14 @@ nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
 				if (NULL == item_ptr)
 				{
 					p_generated = (nyx_event_t *) touch_device->current_event_ptr;
-					touch_device->current_event_ptr = touch_event_create();
-					item_ptr = touch_event_get_next_item(
-					               touch_device->current_event_ptr);
+					touch_device->current_event_ptr = touch_event_create(touch_device);
+
+					/* Without a new event this finger is lost */
+					if (NULL != touch_device->current_event_ptr)
+					{
+						item_ptr = touch_event_get_next_item(
+						               touch_device->current_event_ptr);
+					}
 				}
 
 				if (NULL != item_ptr)
@@ -742,6 +1768,14 @@ nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
 					{
 						item_ptr->y = input_event_ptr->value;
 					}
+					else if (ABS_VELOCITY_X == input_event_ptr->code)
+					{
+						item_ptr->xVelocity = input_event_ptr->value;
+					}
+					else if (ABS_VELOCITY_Y == input_event_ptr->code)
+					{
+						item_ptr->yVelocity = input_event_ptr->value;
+					}
 					else
 					{
 						nyx_error(MSGID_NYX_QMUX_TP_ABS_ERR, 0, "Unexpected code 0x%x", input_event_ptr->code);
@@ -789,37 +1823,355 @@ nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
 		}
 	}
 
+	if (NULL != p_generated)
+	{
+		perf_count(&touch_device->perf, PERF_EVENTS_EMITTED, 1);
+		INPUT_TRACE(TP_EVENT, ((nyx_event_touchpanel_t *) p_generated)->item_count,
+		            0, 0, 0, 0);
+	}
+
 	*e = p_generated;
+	return NYX_ERROR_NONE;
+}
+
+static void
+touchpanel_perf_call_done(touchpanel_device_t *touch_device, uint64_t start)
+{
+	if (perf_call_done(&touch_device->perf, start))
+	{
+		char summary[256];
+		uint64_t values[PERF_COUNTER_COUNT];
+
+		perf_counters_read(&touch_device->perf, values, PERF_COUNTER_COUNT);
+		perf_counters_format(values, summary, sizeof(summary));
+		nyx_info(MSGID_NYX_QMUX_TP_PERF, 0, "Touchpanel %p: %s (%u coalesced, "
+		         "%u throttled frames)", touch_device, summary,
+		         touch_device->coalesced_frames, touch_device->throttled_frames);
+	}
+}
+
+nyx_error_t touchpanel_get_event(nyx_device_t *d, nyx_event_t **e)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+	nyx_error_t ret;
+	uint64_t start;
+
+	if (G_UNLIKELY(event_ring_active(&touch_device->ring)))
+	{
+		*e = NULL;
+		return NYX_ERROR_INVALID_OPERATION;
+	}
+
+	start = perf_call_begin(&touch_device->perf);
+	ret = touchpanel_next_event(touch_device, e);
+	touchpanel_perf_call_done(touch_device, start);
+
+	return ret;
+}
+
+/**
+ * @brief Take up to max ready events in one call.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. Hands out
+ * what calling touchpanel_get_event() until it returns no event would,
+ * stopping early once max events are taken, but is counted (and read
+ * with) as a single call. Events go back through touchpanel_release_events()
+ * or one at a time through touchpanel_release_event().
+ *
+ * @param count out: number of events stored in events, also on error
+ */
+nyx_error_t touchpanel_get_events(nyx_device_t *d, nyx_event_t **events,
+                                  unsigned int max, unsigned int *count)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+	nyx_error_t ret = NYX_ERROR_NONE;
+	uint64_t start;
+	unsigned int n = 0;
+
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == events || NULL == count)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	if (G_UNLIKELY(event_ring_active(&touch_device->ring)))
+	{
+		*count = 0;
+		return NYX_ERROR_INVALID_OPERATION;
+	}
+
+	start = perf_call_begin(&touch_device->perf);
+
+	while (n < max && NYX_ERROR_NONE == (ret = touchpanel_next_event(touch_device,
+	                                     &events[n])) && NULL != events[n])
+	{
+		n++;
+	}
+
+	touchpanel_perf_call_done(touch_device, start);
+	*count = n;
+
+	return ret;
+}
+
+/**
+ * @brief Release count events, as taken by touchpanel_get_events().
+ *
+ * NULL entries are skipped, and reported once all others are released.
+ */
+nyx_error_t touchpanel_release_events(nyx_device_t *d, nyx_event_t **events,
+                                      unsigned int count)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+	nyx_error_t ret = NYX_ERROR_NONE;
+	unsigned int i;
+
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == events && count > 0)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (NULL == events[i])
+		{
+			ret = NYX_ERROR_INVALID_HANDLE;
+			continue;
+		}
+
+		if (event_pool_put(&touch_device->event_pool, events[i]))
+		{
+			/* The last ones held past nyx_module_close() */
+			free(touch_device);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* Drains the device into the ring for as long as the module is open */
+static void *
+touchpanel_ring_thread(void *arg)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) arg;
+	nyx_event_touchpanel_t *touch;
+	nyx_event_t *event;
+	uint64_t start;
+
+	while (event_ring_wait(&touch_device->ring, touch_device->input.epoll_fd))
+	{
+		start = perf_call_begin(&touch_device->perf);
+
+		while (NYX_ERROR_NONE == touchpanel_next_event(touch_device, &event) &&
+		       NULL != event)
+		{
+			touch = (nyx_event_touchpanel_t *) event;
+
+			/* Only the items in use are copied */
+			if (!event_ring_push(&touch_device->ring, touch,
+			                     offsetof(nyx_event_touchpanel_t, item_array) +
+			                     touch->item_count * sizeof(touch->item_array[0])))
+			{
+				perf_count(&touch_device->perf, PERF_EVENTS_DROPPED, 1);
+			}
+
+			event_pool_put(&touch_device->event_pool, touch);
+		}
+
+		event_ring_publish(&touch_device->ring);
+		touchpanel_perf_call_done(touch_device, start);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Switch to delivering events through a shared memory ring.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. From now
+ * on a thread of the module reads the device and writes every finished
+ * nyx_event_touchpanel_t (up to its last used item) into a ring of slots
+ * slots, see event_ring.h. touchpanel_get_event_source() then returns
+ * the ring's eventfd and touchpanel_get_event() is no longer available.
+ * The ring stays until the module is closed; asking again returns it.
+ *
+ * @param slots a power of two
+ * @param fd out: the ring's memfd, owned by the module; map it with
+ *           event_ring_open() or pass it to another process
+ */
+nyx_error_t touchpanel_open_event_ring(nyx_device_t *d, unsigned int slots,
+                                       int *fd)
+{
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == fd)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	if (event_ring_active(&touch_device->ring))
+	{
+		*fd = touch_device->ring.memfd;
+		return NYX_ERROR_NONE;
+	}
+
+	if (event_ring_create(&touch_device->ring, "nyx-touchpanel",
+	                      sizeof(nyx_event_touchpanel_t), slots) < 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_RING_ERR, 0, "Cannot create a %u slot event ring: %d",
+		          slots, errno);
+		return EINVAL == errno ? NYX_ERROR_INVALID_VALUE : NYX_ERROR_GENERIC;
+	}
+
+	if (pthread_create(&touch_device->ring_thread, NULL, touchpanel_ring_thread,
+	                   touch_device) != 0)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_RING_ERR, 0, "Cannot start the event ring thread");
+		event_ring_destroy(&touch_device->ring);
+		return NYX_ERROR_GENERIC;
+	}
+
+	*fd = touch_device->ring.memfd;
+
+	return NYX_ERROR_NONE;
+}
+
+/**
+ * @brief Copy out the module's performance counters.
+ *
+ * Not a nyx method: consumers look the symbol up in the module. values
+ * is indexed by perf_counter_t; count limits how many are written.
+ *
+ * @param count in: room in values, out: number of values written
+ */
+nyx_error_t touchpanel_query_perf_counters(nyx_device_t *d, uint64_t *values,
+        unsigned int *count)
+{
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == values || NULL == count)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	*count = perf_counters_read(&((touchpanel_device_t *) d)->perf, values,
+	                            *count);
 
 	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_set_active_scan_rate(nyx_device_t *d, unsigned int r)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	((touchpanel_device_t *) d)->activeScanRate = r;
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_set_idle_scan_rate(nyx_device_t *d, unsigned int r)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+
+	touch_device->idleSettings.enabled = (r > 0);
+	touch_device->idleSettings.scanRate = r;
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_get_active_scan_rate(nyx_device_t *d, unsigned int *r)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == r)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	*r = ((touchpanel_device_t *) d)->activeScanRate;
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_get_idle_scan_rate(nyx_device_t *d, unsigned int *r)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == r)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	touchpanel_device_t *touch_device = (touchpanel_device_t *) d;
+
+	*r = touch_device->idleSettings.enabled ? touch_device->idleSettings.scanRate :
+	     0;
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_set_mode(nyx_device_t *d, int m)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (m != TOUCHPANEL_MODE_DEFAULT && m != TOUCHPANEL_MODE_COALESCE_MOTION)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	((touchpanel_device_t *) d)->mode = m;
+
+	return NYX_ERROR_NONE;
 }
 
 nyx_error_t touchpanel_get_mode(nyx_device_t *d, int *m)
 {
-	return NYX_ERROR_NOT_IMPLEMENTED;
+	if (NULL == d)
+	{
+		return NYX_ERROR_INVALID_HANDLE;
+	}
+
+	if (NULL == m)
+	{
+		return NYX_ERROR_INVALID_VALUE;
+	}
+
+	*m = ((touchpanel_device_t *) d)->mode;
+
+	return NYX_ERROR_NONE;
 }
@@ -21,8 +21,8 @@
 #include "msgid.h"
 
 void
-set_event_params(input_event_t *pEvent, time_stamp_t *pTime, uint16_t type,
-                 uint16_t code, int32_t value)
+set_event_params(input_event_t *pEvent, const time_stamp_t *pTime,
+                 uint16_t type, uint16_t code, int32_t value)
 {
 	if (NULL == pEvent || NULL == pTime)
 	{
@@ -30,10 +30,9 @@ set_event_params(input_event_t *pEvent, time_stamp_t *pTime, uint16_t type,
 		return;
 	}
 
-	((struct timeval *)pTime)->tv_sec = ((struct timeval *)
-	                                     &pEvent->time)->tv_sec;
-	((struct timeval *)pTime)->tv_usec = ((struct timeval *)
-	                                      &pEvent->time)->tv_usec;
+	/* tv_nsec may run past a second, see gesture_state_machine() */
+	pEvent->time.tv_sec = pTime->time.tv_sec + pTime->time.tv_nsec / 1000000000L;
+	pEvent->time.tv_usec = (pTime->time.tv_nsec % 1000000000L) / 1000;
 
 	pEvent->type = type;
 	pEvent->code = code;
@@ -16,6 +16,8 @@
 
 
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <limits.h>
 #include <glib-2.0/glib.h>
 
@@ -24,24 +26,26 @@
 
 #include "touchpanel_gestures.h"
 #include "touchpanel_common.h"
+#include "input_trace.h"
 #include "msgid.h"
 
-static GList *sFingers = NULL;
-static GQueue availableFingers = G_QUEUE_INIT;
+int gesture_state_machine_finger(gesture_context_t *pCtx, int slot,
+                                 input_event_t *events, int *numEvents);
 
-static uint32_t curFingerId = 0;
-
-int gesture_state_machine_finger(finger_t *finger, input_event_t *events,
-                                 int *numEvents);
-
-static const general_settings_t *spGeneralSettings = NULL;
+void
+reset_coord_buffer(coord_buf_t *pCoordBuf)
+{
+	pCoordBuf->tail = 0;
+	pCoordBuf->numItems = 0;
+	memset(&pCoordBuf->fit, 0, sizeof(pCoordBuf->fit));
+}
 
 /**
  *******************************************************************************
- * @brief Allocate and initialize the buffer that keeps a coordinate history
+ * @brief Initialize the buffer that keeps a coordinate history
  *
  * @param  ppCoordBuf   IN/OUT  ptr to the coordinate buffer struct
- * @param  bufSize      IN      size of the buffer
+ * @param  bufSize      IN      number of coords kept, 1..COORD_BUF_MAX_SIZE
  *
  * @retval  0 on success
  * @retval -1 on failure
@@ -50,6 +54,7 @@ static const general_settings_t *spGeneralSettings = NULL;
 int
 create_coord_buffer(coord_buf_t *pCoordBuf, int bufSize)
 {
+	unsigned int capacity = 1;
 
 	if (NULL == pCoordBuf)
 	{
@@ -57,104 +62,158 @@ create_coord_buffer(coord_buf_t *pCoordBuf, int bufSize)
 		return -1;
 	}
 
-	pCoordBuf->pCoords = (coord_t *)malloc(sizeof(coord_t) * bufSize);
+	if (bufSize < 1 || bufSize > COORD_BUF_MAX_SIZE)
+	{
+		nyx_error(MSGID_NYX_QMUX_TP_COORDS_ERR, 0,
+		          "Coordinate buffer size %d not in 1..%d, clamping", bufSize,
+		          COORD_BUF_MAX_SIZE);
+		bufSize = CLAMP(bufSize, 1, COORD_BUF_MAX_SIZE);
+	}
 
-	if (NULL == pCoordBuf->pCoords)
+	while (capacity < (unsigned int) bufSize)
 	{
-		nyx_error(MSGID_NYX_QMUX_TP_COORDS_ERR, 0,"Failed to allocate memory");
-		return -1;
+		capacity <<= 1;
 	}
 
 	pCoordBuf->size = bufSize;
-	pCoordBuf->head = 0;
-	pCoordBuf->tail = 0;
-	pCoordBuf->numItems = 0;
+	pCoordBuf->mask = capacity - 1;
+	reset_coord_buffer(pCoordBuf);
 
 	return 0;
 }
 
 
-void
-free_coord_buffer(coord_buf_t *pCoordBuf)
+static inline coord_t *
+coord_at(coord_buf_t *pCoordBuf, unsigned int n)
 {
-	free(pCoordBuf->pCoords);
+	return &pCoordBuf->coords[n & pCoordBuf->mask];
 }
 
+/* Oldest coord in the buffer */
+static inline coord_t *
+coord_first(coord_buf_t *pCoordBuf)
+{
+	return coord_at(pCoordBuf, pCoordBuf->tail - pCoordBuf->numItems);
+}
 
-void
-reset_coord_buffer(coord_buf_t *pCoordBuf)
+static inline double
+coord_fit_time(const coord_fit_t *pFit, const time_stamp_t *pTime)
 {
-	pCoordBuf->head = 0;
-	pCoordBuf->tail = 0;
-	pCoordBuf->numItems = 0;
+	return (double)(pTime->time.tv_sec - pFit->base.time.tv_sec) +
+	       (double)(pTime->time.tv_nsec - pFit->base.time.tv_nsec) * 1e-9;
 }
 
-void
-update_coord_buffer(coord_buf_t *pCoordBuf, int xCoord, int yCoord,
-                    const time_stamp_t *pTime)
+/* Add (sign 1) or remove (sign -1) one coord from the fit */
+static inline void
+coord_fit_update(coord_fit_t *pFit, const coord_t *pCoord, double sign)
+{
+	double t = coord_fit_time(pFit, &pCoord->timeStamp);
+
+	pFit->sumT += sign * t;
+	pFit->sumTT += sign * t * t;
+	pFit->sumX += sign * pCoord->x;
+	pFit->sumTX += sign * t * pCoord->x;
+	pFit->sumY += sign * pCoord->y;
+	pFit->sumTY += sign * t * pCoord->y;
+}
+
+/*
+ * Recompute the sums from scratch, relative to the oldest coord. Done every
+ * COORD_FIT_REBUILD_PERIOD coords, which bounds both the rounding drift of
+ * the add/remove updates and how far times get from the base.
+ */
+#define COORD_FIT_REBUILD_PERIOD    256
+static void
+coord_fit_rebuild(coord_buf_t *pCoordBuf)
 {
-	if (pCoordBuf->head == pCoordBuf->tail &&
-	        pCoordBuf->numItems == pCoordBuf->size)
+	int i;
+
+	unsigned int first = pCoordBuf->tail - pCoordBuf->numItems;
+
+	memset(&pCoordBuf->fit, 0, sizeof(pCoordBuf->fit));
+	pCoordBuf->fit.base = coord_at(pCoordBuf, first)->timeStamp;
+
+	for (i = 0; i < pCoordBuf->numItems; i++)
 	{
-		/* full buffer, so make space for new item and overwrite old one */
-		pCoordBuf->head = (pCoordBuf->head + 1) % pCoordBuf->size;
+		coord_fit_update(&pCoordBuf->fit, coord_at(pCoordBuf, first + i), 1);
 	}
+}
 
-	int index = pCoordBuf->tail;
-	coord_t *pCurCoord = &((pCoordBuf->pCoords)[index]);
+/**
+ * @brief Velocity over the buffered coords, in pixels per second.
+ *
+ * This is the slope of the least-squares line through the coords; 0 until
+ * there are two coords at different times.
+ */
+void
+get_coord_velocity(const coord_buf_t *pCoordBuf, double *pXVelocity,
+                   double *pYVelocity)
+{
+	const coord_fit_t *pFit = &pCoordBuf->fit;
+	double n = pCoordBuf->numItems;
+	double denom = n * pFit->sumTT - pFit->sumT * pFit->sumT;
 
-	if (spGeneralSettings->positionFilter && pCoordBuf->numItems)
+	/* Also catches a spread of timestamps that is all rounding error */
+	if (pCoordBuf->numItems < 2 || denom <= 1e-9 * n * n)
 	{
-		int prev;
-
-		if (index)
-		{
-			prev = index - 1;
-		}
+		*pXVelocity = 0;
+		*pYVelocity = 0;
+		return;
+	}
 
-		else
-		{
-			prev = pCoordBuf->size - 1;
-		}
+	*pXVelocity = (n * pFit->sumTX - pFit->sumT * pFit->sumX) / denom;
+	*pYVelocity = (n * pFit->sumTY - pFit->sumT * pFit->sumY) / denom;
+}
 
-		if (xCoord < pCoordBuf->pCoords[prev].x)
-		{
-			xCoord++;
-		}
+void
+update_coord_buffer(coord_buf_t *pCoordBuf, int xCoord, int yCoord,
+                    const time_stamp_t *pTime, int positionFilter)
+{
+	coord_t *pCurCoord;
 
-		else if (xCoord > pCoordBuf->pCoords[prev].x)
-		{
-			xCoord--;
-		}
+	if (pCoordBuf->numItems == 0)
+	{
+		pCoordBuf->fit.base = *pTime;
+	}
+	else if (positionFilter)
+	{
+		const coord_t *pPrev = coord_at(pCoordBuf, pCoordBuf->tail - 1);
 
-		if (yCoord < pCoordBuf->pCoords[prev].y)
-		{
-			yCoord++;
-		}
+		/* Pull each axis one pixel back towards the previous coord */
+		xCoord += (xCoord < pPrev->x) - (xCoord > pPrev->x);
+		yCoord += (yCoord < pPrev->y) - (yCoord > pPrev->y);
+	}
 
-		else if (yCoord > pCoordBuf->pCoords[prev].y)
-		{
-			yCoord--;
-		}
+	if (pCoordBuf->numItems == pCoordBuf->size)
+	{
+		/* full buffer, so drop the oldest item */
+		coord_fit_update(&pCoordBuf->fit, coord_first(pCoordBuf), -1);
+		pCoordBuf->numItems--;
 	}
 
+	pCurCoord = coord_at(pCoordBuf, pCoordBuf->tail);
 	pCurCoord->timeStamp = *pTime;
 	pCurCoord->x = xCoord;
 	pCurCoord->y = yCoord;
 
-	if (pCoordBuf->numItems < pCoordBuf->size)
+	pCoordBuf->numItems++;
+	pCoordBuf->tail++;
+
+	if ((pCoordBuf->tail & (COORD_FIT_REBUILD_PERIOD - 1)) == 0)
 	{
-		pCoordBuf->numItems++;
+		coord_fit_rebuild(pCoordBuf);
+	}
+	else
+	{
+		coord_fit_update(&pCoordBuf->fit, pCurCoord, 1);
 	}
-
-	pCoordBuf->tail = (pCoordBuf->tail + 1) % pCoordBuf->size;
 }
 
 void get_last_coords(const coord_buf_t *pCoordBuf, int *xCoord, int *yCoord,
                      time_stamp_t *timestamp)
 {
-	int previndex = (pCoordBuf->head + pCoordBuf->numItems - 1) % pCoordBuf->size;
-	coord_t *coord = &pCoordBuf->pCoords[previndex];
+	const coord_t *coord = &pCoordBuf->coords[(pCoordBuf->tail - 1) &
+	                                          pCoordBuf->mask];
 
 	if (xCoord)
 	{
@@ -172,87 +231,146 @@ void get_last_coords(const coord_buf_t *pCoordBuf, int *xCoord, int *yCoord,
 	}
 }
 
-void init_gesture_state_machine(const general_settings_t *pGeneralSettings,
+void init_gesture_state_machine(gesture_context_t *pCtx,
+                                const general_settings_t *pGeneralSettings,
                                 int maxFingers)
 {
 	int i;
 
-	spGeneralSettings = pGeneralSettings;
+	pCtx->pGeneralSettings = pGeneralSettings;
+	pCtx->curFingerId = 0;
+
+	pCtx->table.capacity = MIN(maxFingers * 2, MAX_TRACKED_FINGERS);
 
-	for (i = 0 ; i < maxFingers * 2; i++)
+	for (i = 0 ; i < pCtx->table.capacity; i++)
 	{
-		finger_t *finger = malloc(sizeof(finger_t));
-		create_coord_buffer(&finger->coords, pGeneralSettings->coordBufSize);
-		finger->state.state = UNUSED;
-		g_queue_push_tail(&availableFingers, finger);
+		create_coord_buffer(&pCtx->table.fingers[i].coords,
+		                    pGeneralSettings->coordBufSize);
+		pCtx->table.state[i] = UNUSED;
+		pCtx->table.minDist[i] = INT_MAX;
+		pCtx->table.lastX[i] = 0;
+		pCtx->table.lastY[i] = 0;
 	}
 }
 
 
 void
-deinit_gesture_state_machine(void)
+deinit_gesture_state_machine(gesture_context_t *pCtx)
 {
-	finger_t *finger = NULL;
+	int i;
 
-	while ((finger = g_queue_pop_head(&availableFingers)) != NULL)
+	for (i = 0 ; i < pCtx->table.capacity; i++)
 	{
-		free_coord_buffer(&finger->coords);
-		free(finger);
+		pCtx->table.state[i] = UNUSED;
 	}
 
-	finger = NULL;
-	GList *l = sFingers;
-
-	while (l != NULL)
-	{
-		if (l->data)
-		{
-			finger = (finger_t *)l->data;
-			free_coord_buffer(&finger->coords);
-		}
-
-		l = g_list_remove(l, l->data);
-
-		if (finger)
-		{
-			free(finger);
-			finger = NULL;
-		}
-	}
+	pCtx->table.capacity = 0;
 }
 
 void
 reset_state_data(gesture_state_data_t *pStateData)
 {
-	pStateData->state = START_STATE;
 	pStateData->insideTapRadius = true;
 }
 
-static void add_new_finger(int x, int y, int weight,
-                           const time_stamp_t *pCurTime)
+/* Append a coordinate to a finger's history and mirror it into the table */
+static void
+update_finger_coords(gesture_context_t *pCtx, int slot, int x, int y,
+                     const time_stamp_t *pTime)
 {
-	finger_t *finger = g_queue_pop_head(&availableFingers);
+	finger_t *finger = &pCtx->table.fingers[slot];
 
-	if (!finger)
-	{
-		nyx_debug("No available finger buffers, rejecting finger");
-		return;
-	}
+	update_coord_buffer(&finger->coords, x, y, pTime,
+	                    pCtx->pGeneralSettings->positionFilter);
+	get_last_coords(&finger->coords, &pCtx->table.lastX[slot],
+	                &pCtx->table.lastY[slot], NULL);
+}
+
+static void init_finger_slot(gesture_context_t *pCtx, int slot, int x, int y,
+                             int weight, const time_stamp_t *pCurTime)
+{
+	finger_t *finger = &pCtx->table.fingers[slot];
 
-	//  ASSERT(finger->state.state == UNUSED);
 	reset_state_data(&finger->state);
-	finger->id = curFingerId++;
+	pCtx->table.state[slot] = START_STATE;
+	finger->id = pCtx->curFingerId++;
+	finger->trackingId = -1;
 	finger->timestamp = *pCurTime;
 	//hal_info"NEW: %ld,%ld\n",finger->id.time.tv_sec,finger->id.time.tv_nsec);
-	finger->minDist = 0;
+	pCtx->table.minDist[slot] = 0;
 	finger->minDistId = 0;
 	finger->lastWeight = weight;
 	reset_coord_buffer(&finger->coords);
-	update_coord_buffer(&finger->coords, x, y, pCurTime);
-	nyx_debug("Finger down at %d,%d", x, y);
-	sFingers = g_list_prepend(sFingers, finger);
+	update_finger_coords(pCtx, slot, x, y, pCurTime);
+	INPUT_TRACE(TP_FINGER_DOWN, slot, x, y, weight, 0);
+}
+
+static void add_new_finger(gesture_context_t *pCtx, int x, int y, int weight,
+                           const time_stamp_t *pCurTime)
+{
+	int slot;
+
+	for (slot = 0; slot < pCtx->table.capacity; slot++)
+	{
+		if (pCtx->table.state[slot] == UNUSED)
+		{
+			break;
+		}
+	}
+
+	if (slot == pCtx->table.capacity)
+	{
+		INPUT_TRACE(TP_FINGER_REJECTED, x, y, 0, 0, 0);
+		return;
+	}
+
+	init_finger_slot(pCtx, slot, x, y, weight, pCurTime);
 }
 
+/*
+ * Find the tracked finger closest to (x, y) that is not already claimed by
+ * a closer coordinate. Free slots and taken fingers are folded into the
+ * distance instead of being skipped, which keeps the loop free of branches.
+ */
+static int
+find_nearest_finger(const gesture_context_t *pCtx, int x, int y, int *pMinDist)
+{
+	int i;
+	int best = INT_MAX;
+	int bestSlot = -1;
+
+	for (i = 0; i < pCtx->table.capacity; i++)
+	{
+		int dx = x - pCtx->table.lastX[i];
+		int dy = y - pCtx->table.lastY[i];
+		int dist = (dx * dx + dy * dy);
+
+		//Another finger from the input list is already a better match.
+		dist = (pCtx->table.state[i] != UNUSED &&
+		        dist <= pCtx->table.minDist[i]) ? dist : INT_MAX;
+
+		bestSlot = (dist < best) ? i : bestSlot;
+		best = (dist < best) ? dist : best;
+	}
+
+	*pMinDist = best;
+	return bestSlot;
+}
+
+
+/* Number of fingers currently tracked (down) */
+int
+gesture_active_fingers(const gesture_context_t *pCtx)
+{
+	int i, count = 0;
+
+	for (i = 0; i < pCtx->table.capacity; i++)
+	{
+		count += (pCtx->table.state[i] != UNUSED);
+	}
+
+	return count;
+}
 
 #define MAX_EVENTS_PER_UPDATE 100
 
@@ -261,104 +379,68 @@ static void add_new_finger(int x, int y, int weight,
  * The hardware does not do any fingertracking, so we do it all here.
  */
 void
-gesture_state_machine(int *pXCoords, int *pYCoords, const int *pFingerWeights,
-                      int numFingers, const time_stamp_t *pCurTime,
+gesture_state_machine(gesture_context_t *pCtx, int *pXCoords, int *pYCoords,
+                      const int *pFingerWeights, int numFingers,
+                      const time_stamp_t *pCurTime,
                       input_event_t *events, int *numEvents)
 {
 	/* Update Fingers */
-	int j;
+	int i, j;
 	int timestmpcnt = 0;
-	GList *list;
 
 	//For each new finger
 	for (j = 0; j < numFingers; j++)
 	{
-		int minDist = INT_MAX;
-		GList *minId = NULL;
-		list = g_list_first(sFingers);
+		int minDist;
 
 		//Try and match it against one of the existing ones
-		while (list)
-		{
-			int xPrev, yPrev;
-			int matched = 0;
-			finger_t *finger = (finger_t *)list->data;
-
-			get_last_coords(&finger->coords, &xPrev, &yPrev, NULL);
-			int dx = pXCoords[j] - xPrev;
-			int dy = pYCoords[j] - yPrev;
-			int dist = (dx * dx + dy * dy);
-
-			//Another finger from the input list is already a better match.
-			if (dist > finger->minDist)
-			{
-				list = g_list_next(list);
-				continue;
-			}
-
-			if (dist < minDist)
-			{
-				matched = 1;
-			}
-
-			if (matched)
-			{
-				minId = list;
-				minDist = dist;
-			}
-
-			list = g_list_next(list);
-		}
+		int slot = find_nearest_finger(pCtx, pXCoords[j], pYCoords[j], &minDist);
 
-		if (minId)
+		if (slot >= 0)
 		{
-			finger_t *finger = (finger_t *)minId->data;
-			finger->minDistId = j;
-			finger->minDist = minDist;
+			pCtx->table.fingers[slot].minDistId = j;
+			pCtx->table.minDist[slot] = minDist;
 		}
 	}
 
-	//Okay, at this point, for each existing finger, (sFingers)
+	//Okay, at this point, for each existing finger,
 	//We have set minDistId to the index of the finger in the input array
-	//Or it's set to INT_MAX if it didn't match any of the new fingers.
-
-	//Iterate through the fingerList, and update each of the fingers that has a match with new coordinates.
-	list = g_list_first(sFingers);
+	//Or minDist is still INT_MAX if it didn't match any of the new fingers.
 
-	while (list)
+	//Iterate through the finger table, and update each of the fingers that has a match with new coordinates.
+	for (i = 0; i < pCtx->table.capacity; i++)
 	{
-		finger_t *finger = (finger_t *)list->data;
+		finger_t *finger = &pCtx->table.fingers[i];
 
 		//Finger released
-		if (finger->minDist == INT_MAX)
+		if (pCtx->table.state[i] == UNUSED || pCtx->table.minDist[i] == INT_MAX)
 		{
-			list = g_list_next(list);
 			continue;
 		}
 
-		nyx_info(MSGID_NYX_QMUX_TP_FINGER_WT, 0,"New coord (at: %d), %d,%d weight: %d, distance: %d",
-		         finger->minDistId, pXCoords[finger->minDistId], pYCoords[finger->minDistId],
-		         pFingerWeights[finger->minDistId], finger->minDist);
+		INPUT_TRACE(TP_FINGER_MATCH, finger->minDistId, pXCoords[finger->minDistId],
+		            pYCoords[finger->minDistId], pFingerWeights[finger->minDistId],
+		            pCtx->table.minDist[i]);
 
 		//Let's ignore the coordinate if there was a huge difference in weight
 		//This is a common scenario when the user is releasing his finger.
 		if (finger->lastWeight / 2 < pFingerWeights[finger->minDistId])
 		{
-			update_coord_buffer(&finger->coords, pXCoords[finger->minDistId],
-			                    pYCoords[finger->minDistId], pCurTime);
+			update_finger_coords(pCtx, i, pXCoords[finger->minDistId],
+			                     pYCoords[finger->minDistId], pCurTime);
 		}
 		else
 		{
-			nyx_debug("Ignoring coordinate");
+			INPUT_TRACE(TP_COORD_IGNORED, i, finger->lastWeight,
+			            pFingerWeights[finger->minDistId], 0, 0);
 		}
 
 		finger->lastWeight = pFingerWeights[finger->minDistId];
 		//remove finger from pool of "new" fingers.
 		pXCoords[finger->minDistId] = pYCoords[finger->minDistId] = 0;
 
-		finger->minDist = 0;
+		pCtx->table.minDist[i] = 0;
 		finger->minDistId = 0;
-		list = g_list_next(list);
 	}
 
 	//Now go through the list and find any new unmatched fingers
@@ -376,57 +458,110 @@ gesture_state_machine(int *pXCoords, int *pYCoords, const int *pFingerWeights,
 		}
 
 		if (pFingerWeights[j] < g_atomic_int_get(
-		            &spGeneralSettings->fingerDownThreshold))
+		            &pCtx->pGeneralSettings->fingerDownThreshold))
 		{
-			nyx_info(MSGID_NYX_QMUX_TP_FING_LOW_WT, 0,"Discarding finger with too low weight (%d)", pFingerWeights[j]);
+			INPUT_TRACE(TP_FINGER_LIGHT, j, pFingerWeights[j], 0, 0, 0);
 			continue;
 		}
 
-		nyx_debug("pFingerWeight: %d (%d)", pFingerWeights[j], j);
-
-		nyx_debug("j: %d, %d) New finger @ %d,%d", j, numFingers, pXCoords[j],
-		         pYCoords[j]);
+		INPUT_TRACE(TP_NEW_FINGER, j, numFingers, pXCoords[j], pYCoords[j],
+		            pFingerWeights[j]);
 
 		ts.time.tv_nsec += timestmpcnt;
 		timestmpcnt += 1000000;
-		add_new_finger(pXCoords[j], pYCoords[j], pFingerWeights[j], &ts);
+		add_new_finger(pCtx, pXCoords[j], pYCoords[j], pFingerWeights[j], &ts);
 	}
 
 	/* All fingers has been matched, now let's process the changes */
-	list = g_list_first(sFingers);
+	for (i = 0; i < pCtx->table.capacity; i++)
+	{
+		if (pCtx->table.state[i] == UNUSED)
+		{
+			continue;
+		}
+
+		//-1 means to return the slot to the free pool
+		if (gesture_state_machine_finger(pCtx, i, events, numEvents) == -1)
+		{
+			pCtx->table.state[i] = UNUSED;
+			pCtx->table.minDist[i] = INT_MAX;
+		}
+	}
 
-	while (list)
+	if (0 < *numEvents)
 	{
-		finger_t *finger = (finger_t *)list->data;
+		//ASSERT(numEvents < MAX_EVENTS_PER_UPDATE);
+		/* add EV_SYN event */
+		set_event_params(&events[(*numEvents)++], pCurTime, EV_SYN, 0,
+		                 0);
+	}
+}
 
-		//-1 means to move the list element into the available list
-		if (gesture_state_machine_finger(finger, events, numEvents) == -1)
+/*
+ * Multi-touch (protocol B) variant:
+ * The kernel already tracks contacts in slots, so each MT slot maps straight
+ * onto the finger table entry with the same index and no matching is done.
+ * A tracking id of -1 means the slot holds no contact.
+ */
+void
+gesture_state_machine_mt(gesture_context_t *pCtx,
+                         const int *pTrackingIds, const int *pXCoords,
+                         const int *pYCoords, int numSlots,
+                         const time_stamp_t *pCurTime,
+                         input_event_t *events, int *numEvents)
+{
+	int i;
+
+	numSlots = MIN(numSlots, pCtx->table.capacity);
+
+	for (i = 0; i < numSlots; i++)
+	{
+		finger_t *finger = &pCtx->table.fingers[i];
+
+		// Contact lifted, or the slot was reused for a new contact
+		if (pCtx->table.state[i] != UNUSED &&
+		        finger->trackingId != pTrackingIds[i])
 		{
-			finger->state.state = UNUSED;
-			list = g_list_next(list);
-			sFingers = g_list_remove(sFingers, finger);
-			g_queue_push_tail(&availableFingers, finger);
+			pCtx->table.minDist[i] = 1;
+			gesture_state_machine_finger(pCtx, i, events, numEvents);
+			pCtx->table.state[i] = UNUSED;
+			pCtx->table.minDist[i] = INT_MAX;
+		}
+
+		if (pTrackingIds[i] < 0)
+		{
+			continue;
+		}
+
+		if (pCtx->table.state[i] == UNUSED)
+		{
+			init_finger_slot(pCtx, i, pXCoords[i], pYCoords[i], 1, pCurTime);
+			finger->trackingId = pTrackingIds[i];
 		}
 		else
 		{
-			list = g_list_next(list);
+			update_finger_coords(pCtx, i, pXCoords[i], pYCoords[i], pCurTime);
+			pCtx->table.minDist[i] = 0;
 		}
+
+		gesture_state_machine_finger(pCtx, i, events, numEvents);
 	}
 
 	if (0 < *numEvents)
 	{
-		//ASSERT(numEvents < MAX_EVENTS_PER_UPDATE);
 		/* add EV_SYN event */
-		set_event_params(&events[(*numEvents)++], (time_stamp_t *) pCurTime, EV_SYN, 0,
+		set_event_params(&events[(*numEvents)++], pCurTime, EV_SYN, 0,
 		                 0);
 	}
 }
 
-int gesture_state_machine_finger(finger_t *finger, input_event_t *events,
-                                 int *numEvents)
+int gesture_state_machine_finger(gesture_context_t *pCtx, int slot,
+                                 input_event_t *events, int *numEvents)
 {
 	int x, y;
+	double xVelocity, yVelocity;
 	time_stamp_t timestamp;
+	finger_t *finger = &pCtx->table.fingers[slot];
 
 	get_last_coords(&finger->coords, &x, &y, &timestamp);
 
@@ -436,14 +571,14 @@ int gesture_state_machine_finger(finger_t *finger, input_event_t *events,
 	set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_FINGERID,
 	                 0 , finger->id);
 
-	switch (finger->state.state)
+	switch (pCtx->table.state[slot])
 	{
 		case START_STATE:
 		{
 			finger->state.start[X_DIM] = x;
 			finger->state.start[Y_DIM] = y;
 			finger->state.startTime = timestamp;
-			finger->state.state = FINGER_DOWN_STATE;
+			pCtx->table.state[slot] = FINGER_DOWN_STATE;
 			set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_KEY,
 			                 BTN_TOUCH, 1);
 		}
@@ -469,12 +604,18 @@ int gesture_state_machine_finger(finger_t *finger, input_event_t *events,
 	                 ABS_X, x);
 	set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_ABS,
 	                 ABS_Y, y);
+
+	get_coord_velocity(&finger->coords, &xVelocity, &yVelocity);
+	set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_ABS,
+	                 ABS_VELOCITY_X, (int32_t) lround(xVelocity));
+	set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_ABS,
+	                 ABS_VELOCITY_Y, (int32_t) lround(yVelocity));
 	*numEvents = finger->numEvents;
 
-	if (finger->minDist > 0)
+	if (pCtx->table.minDist[slot] > 0)
 	{
 		//send finger release event
-		nyx_debug("Finger up at %d,%d", x, y);
+		INPUT_TRACE(TP_FINGER_UP, slot, x, y, 0, 0);
 		set_event_params(&finger->events[finger->numEvents++], &timestamp, EV_KEY,
 		                 BTN_TOUCH, 0);
 		*numEvents = finger->numEvents;
@@ -482,7 +623,7 @@ int gesture_state_machine_finger(finger_t *finger, input_event_t *events,
 	}
 	else
 	{
-		finger->minDist = INT_MAX;
+		pCtx->table.minDist[slot] = INT_MAX;
 	}
 
 	return 0;
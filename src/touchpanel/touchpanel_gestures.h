@@ -29,6 +29,13 @@ typedef         __u32           uint32_t;
 
 #define EV_FINGERID 0x07
 
+/*
+ * Finger velocity in pixels per second, reported after ABS_X/ABS_Y in
+ * ABS codes no touch device produces.
+ */
+#define ABS_VELOCITY_X  ABS_RX
+#define ABS_VELOCITY_Y  ABS_RY
+
 typedef struct time_stamp
 {
 	struct timespec time;   /**< internal time stamp format */
@@ -47,7 +54,6 @@ typedef struct interrupt_on_touch_settings
 	int scanRate;           /**< HZ */
 	int wakeThreshold;
 	int noTouchThreshold;   /**< ms */
-	int watchdogTimeout;    /**< ms */
 } interrupt_on_touch_settings_t;
 
 
@@ -67,13 +73,35 @@ typedef struct coord
 	time_stamp_t timeStamp;   /**< time of the coordinates */
 } coord_t;
 
+/*
+ * Running sums over the buffered coords for a least-squares line fit of
+ * x and y against time, so the slope (velocity) is O(1) per sample. Times
+ * are seconds since base to keep the sums well conditioned.
+ */
+typedef struct coord_fit
+{
+	time_stamp_t base;
+	double sumT, sumTT;
+	double sumX, sumTX;
+	double sumY, sumTY;
+} coord_fit_t;
+
+/** largest coordBufSize supported, must be a power of two */
+#define COORD_BUF_MAX_SIZE      16
+
+/*
+ * The ring is stored inline so it shares cache lines with its finger, and
+ * is indexed with a mask: its capacity is size rounded up to a power of
+ * two. tail counts coords since the last reset and is masked on use.
+ */
 typedef struct coord_buf
 {
-	coord_t *pCoords;       /**< array of coords */
-	int head;               /**< index of start of items in the array */
-	int tail;               /**< index of end of items in the array  */
+	unsigned int tail;      /**< number of coords written, masked on use */
+	unsigned int mask;      /**< capacity - 1 */
 	int numItems;           /**< number of items in the array */
-	int size;               /**< total size of coord array */
+	int size;               /**< number of most recent coords kept */
+	coord_fit_t fit;        /**< velocity fit over the items */
+	coord_t coords[COORD_BUF_MAX_SIZE];
 } coord_buf_t;
 
 typedef enum
@@ -91,7 +119,6 @@ typedef enum
 
 typedef struct gesture_state_data
 {
-	gesture_state_t state;
 	int start[NUM_DIMENSIONS];
 	bool insideTapRadius;
 	time_stamp_t startTime;
@@ -110,22 +137,56 @@ typedef struct finger
 	coord_buf_t coords;
 	time_stamp_t timestamp;
 	uint32_t id;
+	int trackingId;         /**< kernel MT tracking id, -1 if not tracked */
 	gesture_state_data_t state;
-	int minDist;
 	int minDistId;
 	int lastWeight;
 	int numEvents;
 	input_event_t *events;
 } finger_t;
 
+/** maximum number of fingers the gesture state machine can track */
+#define MAX_TRACKED_FINGERS     20
+
+/**
+ * Fixed-capacity finger table. The fields touched for every incoming
+ * coordinate while matching are kept in separate contiguous arrays so the
+ * nearest-neighbour scan stays in a few cache lines.
+ */
+typedef struct finger_table
+{
+	int lastX[MAX_TRACKED_FINGERS];     /**< last filtered x of each finger */
+	int lastY[MAX_TRACKED_FINGERS];     /**< last filtered y of each finger */
+	int minDist[MAX_TRACKED_FINGERS];   /**< best match distance this frame */
+	gesture_state_t state[MAX_TRACKED_FINGERS]; /**< UNUSED for free slots */
+	finger_t fingers[MAX_TRACKED_FINGERS];
+	int capacity;                       /**< number of usable slots */
+} finger_table_t;
+
+/** State of one gesture state machine, one per touchpanel device */
+typedef struct gesture_context
+{
+	finger_table_t table;
+	uint32_t curFingerId;       /**< id handed to the next new finger */
+	const general_settings_t *pGeneralSettings;
+} gesture_context_t;
+
 
 
-void init_gesture_state_machine(const general_settings_t *pGeneralSettings,
+void init_gesture_state_machine(gesture_context_t *pCtx,
+                                const general_settings_t *pGeneralSettings,
                                 int maxFingers);
-void deinit_gesture_state_machine(void);
-void gesture_state_machine(int *pXCoords, int *pYCoords,
+void deinit_gesture_state_machine(gesture_context_t *pCtx);
+void gesture_state_machine(gesture_context_t *pCtx,
+                           int *pXCoords, int *pYCoords,
                            const int *pFingerWeights,
                            int fingerCount, const time_stamp_t *pTime,
                            input_event_t *events, int *numEvents);
+int gesture_active_fingers(const gesture_context_t *pCtx);
+void gesture_state_machine_mt(gesture_context_t *pCtx,
+                              const int *pTrackingIds, const int *pXCoords,
+                              const int *pYCoords, int numSlots,
+                              const time_stamp_t *pTime,
+                              input_event_t *events, int *numEvents);
 
 #endif  /* __TOUCHPANEL_GESTURES_PRV_H */